@@ -0,0 +1,45 @@
+#pragma once
+#include <NvFBC.h>
+
+#include "captureSource.hpp"
+
+#define LIB_NVFBC_NAME "libnvidia-fbc.so.1"
+
+/**
+ * @brief NVIDIA Frame Buffer Capture backend, grabs YUV444P or NV12 frames to system memory
+ *
+ * One instance tracks one RandR output, each with its own NvFBC handle so
+ * several outputs can be captured from different threads */
+class captureNvFBC : public captureSource {
+ public:
+  ~captureNvFBC();
+
+  bool init(const captureConfig &cfg) override;
+  bool bind() override;
+  void release() override;
+  bool grab(captureFrame &out) override;
+
+  AVPixelFormat format() const override { return cfg.format; }
+  const char   *name() const override { return "nvfbc"; }
+  int           output_count() const override { return outputCount; }
+  bool          screen_area(int &x, int &y, int &width, int &height) const override {
+    x      = trackedBox.x;
+    y      = trackedBox.y;
+    width  = trackedBox.w;
+    height = trackedBox.h;
+    return true;
+  }
+
+ private:
+  void                   *libNVFBC = NULL;
+  NVFBC_API_FUNCTION_LIST pFn;
+  NVFBC_SESSION_HANDLE    fbcHandle;
+  unsigned char          *frame          = NULL;
+  bool                    handleCreated  = false;
+  bool                    sessionCreated = false;
+  int                     outputCount    = 0;
+  NVFBC_BOX               trackedBox     = {0, 0, 0, 0};
+  captureConfig           cfg;
+  int64_t                 timestampOffsetUs = 0;  //!< monotonic_us() - ulTimestampUs, taken at the first grab
+  bool                    timestampBase     = false;
+};
@@ -0,0 +1,84 @@
+#pragma once
+#include <atomic>
+#include <boost/thread/thread.hpp>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavcodec/packet.h>
+#include <libavutil/frame.h>
+}
+
+#include "frameRing.hpp"
+#include "latencyHistogram.hpp"
+#include "protocol.hpp"
+
+/**
+ * @brief Three stage capture -> encode -> send pipeline
+ *
+ * The capture stage runs on the caller thread: it fills @ref capture_slot and
+ * calls @ref publish. Encoding and sending run on their own threads, linked
+ * to the capture stage by rings of pre-allocated AVFrame/AVPacket slots. A
+ * stage waiting on a ring sleeps until the other side of the ring wakes it. */
+class capturePipeline {
+ public:
+  struct config {
+    size_t     frame_slots  = 3;
+    size_t     packet_slots = 8;
+    ringPolicy policy       = ringPolicy::DROP_OLDEST;
+    int        stream       = 0;  //!< output the packets are sent for
+
+    // Encoder stage histograms, created once per stream by the caller: the
+    // registry never frees them and a stream rebuilds its pipeline on every resize
+    latencyHistogram *send_frame     = NULL;  //!< avcodec_send_frame
+    latencyHistogram *receive_packet = NULL;  //!< avcodec_receive_packet
+  };
+
+  capturePipeline(AVCodecContext *ctx, const config &cfg);
+  ~capturePipeline();
+  capturePipeline(const capturePipeline &)            = delete;
+  capturePipeline &operator=(const capturePipeline &) = delete;
+
+  void start();
+  void stop();
+
+  AVFrame *capture_slot() { return frames.write_slot(); }
+  bool     publish();
+  void     set_rate(int64_t bit_rate, int buffer_size);
+
+  void print_stats(FILE *out) const;
+
+ private:
+  AVCodecContext *ctx;
+  config          cfg;
+
+  frameRing<AVFrame *>  frames;
+  frameRing<AVPacket *> packets;
+  encodeTiming          timing;  //!< written by the encoder thread, read by the network thread once the packet is out
+
+  std::atomic<bool>     running{false};
+  std::atomic<bool>     encoding{false};  //!< the encoder thread may still push packets
+  std::atomic<int64_t>  bitRate{0};  //!< new target for the encoder thread, 0 once applied
+  std::atomic<int>      bufferSize{0};
+  std::atomic<uint64_t> capture_waits{0};
+  std::atomic<uint64_t> encode_waits{0};
+  std::atomic<uint64_t> encode_idle{0};
+  std::atomic<uint64_t> send_idle{0};
+
+  std::mutex              wakeLock;
+  std::condition_variable framesChanged;   //!< a frame was published or a frame slot freed
+  std::condition_variable packetsChanged;  //!< a packet was published or a packet slot freed
+
+  boost::thread th_encode;
+  boost::thread th_send;
+
+  template <typename F>
+  void wait(std::condition_variable &changed, F ready);
+  void signal(std::condition_variable &changed);
+  void encode_loop();
+  void send_loop();
+};
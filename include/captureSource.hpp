@@ -0,0 +1,75 @@
+#pragma once
+#include <time.h>
+
+#include <cstddef>
+#include <cstdint>
+
+extern "C" {
+#include <libavutil/pixfmt.h>
+}
+
+#include "protocol.hpp"
+
+/**
+ * @brief monotonic clock in microseconds, the time base of captureFrame::timestamp_us */
+inline uint64_t monotonic_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief capture parameters shared by every backend */
+struct captureConfig {
+  int           width         = VSIZEW;  //!< 0 captures at the native size of the output
+  int           height        = VSIZEH;
+  AVPixelFormat format        = AV_PIX_FMT_YUV444P;
+  bool          with_cursor   = true;
+  bool          push_model    = false;  //!< grab as soon as the display produced a frame
+  bool          force_refresh = true;   //!< refresh the buffer even if the frame did not change
+  int           timeout_ms    = 0;      //!< 0 waits for a new frame, otherwise the old one is returned
+  int           sampling_ms   = 16;     //!< display sampling period when not in push model
+  int           output        = 0;      //!< index of the display output to capture
+};
+
+/**
+ * @brief one captured frame, owned by the capture source
+ *
+ * The planes stay valid until the next call to @ref captureSource::grab */
+struct captureFrame {
+  uint8_t *data[4]      = {nullptr};
+  int      linesize[4]  = {0};
+  int      width        = 0;     //!< size of the planes, may change between grabs
+  int      height       = 0;
+  size_t   byte_size    = 0;     //!< size of the contiguous buffer starting at data[0]
+  bool     is_new       = true;  //!< false if the content is the one of the previous grab
+  uint64_t timestamp_us = 0;     //!< CLOCK_MONOTONIC time the content was produced, 0 if unknown
+};
+
+/**
+ * @brief Frame producer consumed by the encoder loop
+ *
+ * @ref init runs on the main thread, @ref bind, @ref grab and @ref release on
+ * the capture thread. Tear down happens in the destructor, on the main thread
+ * once the capture thread is joined. */
+class captureSource {
+ public:
+  virtual ~captureSource() {}
+
+  virtual bool init(const captureConfig &cfg) = 0;
+  virtual bool bind() { return true; }
+  virtual void release() {}
+  virtual bool grab(captureFrame &out) = 0;
+
+  virtual AVPixelFormat format() const = 0;
+  virtual const char   *name() const   = 0;
+
+  /**
+   * @brief number of display outputs the backend can capture, valid after @ref init */
+  virtual int output_count() const { return 1; }
+
+  /**
+   * @brief region of the X screen the frames show, valid after @ref init
+   * @return false if the source does not capture a screen */
+  virtual bool screen_area(int &x, int &y, int &width, int &height) const { return false; }
+};
@@ -0,0 +1,55 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "captureSource.hpp"
+
+#define SYNTHETIC_POOL 16
+
+/**
+ * @brief desktop activity reproduced by the synthetic source */
+enum syntheticScenario {
+  SCENARIO_SCROLL,  //!< terminal-like text scrolling up 4 px per frame
+  SCENARIO_DRAG,    //!< a window dragged across the desktop
+  SCENARIO_NOISE,   //!< full screen random noise, worst case for the encoder
+  SCENARIO_CURSOR,  //!< static desktop with a blinking text cursor
+  SCENARIO_STATIC   //!< nothing ever changes after the first frame
+};
+
+/**
+ * @brief Deterministic capture source for benchmarks without a display
+ *
+ * Every frame of the scenario is rendered at init into a pool of
+ * pre-allocated buffers, @ref grab only paces to the requested rate and
+ * returns the next buffer of the pool, so generation never shows up in a
+ * profile of the encode path. Supports YUV444P and NV12. */
+class captureSynthetic : public captureSource {
+ public:
+  captureSynthetic(syntheticScenario scenario, int fps, int pool = SYNTHETIC_POOL);
+
+  bool init(const captureConfig &cfg) override;
+  bool grab(captureFrame &out) override;
+
+  AVPixelFormat format() const override { return cfg.format; }
+  const char   *name() const override { return "synthetic"; }
+
+  static bool parse_scenario(const char *name, syntheticScenario &out);
+
+ private:
+  syntheticScenario scenario;
+  int               fps;
+  int               poolSize;
+  captureConfig     cfg;
+
+  std::vector<std::vector<uint8_t>> pool;
+
+  uint64_t tick      = 0;
+  uint64_t startUs   = 0;
+  int      lastIndex = -1;
+
+  int  index_of(uint64_t t) const;
+  void fill_rect(std::vector<uint8_t> &buf, int x, int y, int w, int h, uint8_t Y, uint8_t U, uint8_t V) const;
+  void render(std::vector<uint8_t> &buf, int n) const;
+  void planes(std::vector<uint8_t> &buf, captureFrame &out) const;
+};
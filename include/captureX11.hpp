@@ -0,0 +1,59 @@
+#pragma once
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
+
+#include <vector>
+
+#include "captureSource.hpp"
+
+/**
+ * @brief X11 backend for hosts without NvFBC, works under Xvfb
+ *
+ * The root window is read through one MIT-SHM segment allocated at init.
+ * XDamage tells which rows changed since the previous grab, only those rows
+ * are read back and converted to YUV444P or NV12. The cursor is never captured.
+ * Each instance captures the top left corner of one RandR output and uses its
+ * own X connection, so outputs can be captured from different threads. */
+class captureX11 : public captureSource {
+ public:
+  ~captureX11();
+
+  bool init(const captureConfig &cfg) override;
+  bool grab(captureFrame &out) override;
+
+  AVPixelFormat format() const override { return cfg.format; }
+  const char   *name() const override { return "x11"; }
+  int           output_count() const override { return outputCount; }
+  bool          screen_area(int &x, int &y, int &width, int &height) const override {
+    x      = originX;
+    y      = originY;
+    width  = cfg.width;
+    height = cfg.height;
+    return true;
+  }
+
+ private:
+  Display        *display = NULL;
+  Window          root;
+  XImage         *image = NULL;
+  XShmSegmentInfo shminfo;
+  bool            attached = false;
+  int             damageEvent, damageError;
+  Damage          damage = 0;
+  XserverRegion   region = 0;
+  captureConfig   cfg;
+  int             outputCount = 0;
+  int             originX     = 0;  //!< position of the captured output in the root window
+  int             originY     = 0;
+
+  std::vector<uint8_t> yuv;
+  bool                 first        = true;
+  uint64_t             lastGrabUs   = 0;
+  uint64_t             damagedSince = 0;
+
+  bool find_output(int screen);
+  bool wait_damage(uint64_t deadline_us);
+  void read_rows(int top, int bottom);
+};
@@ -0,0 +1,75 @@
+#pragma once
+#include <X11/Xlib.h>
+
+#include <atomic>
+#include <boost/asio.hpp>
+#include <boost/thread/thread.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+#include "protocol.hpp"
+
+/**
+ * @brief Out of band cursor channel
+ *
+ * When the cursor is left out of the captured frames, pointer moves no longer
+ * produce new frames. This server polls the pointer position, follows shape
+ * changes through XFixes and sends both on PORT_CURSOR, the client draws the
+ * cursor itself. Every connected client gets the state, a client may connect
+ * and leave at any time. Shapes are sent once per client, then referred to by
+ * hash. */
+class cursorServer {
+ public:
+  /**
+   * @brief region of the X screen shown by one stream */
+  struct area {
+    int stream, x, y, width, height;
+  };
+
+  cursorServer(const std::vector<area> &areas, int period_ms);
+  ~cursorServer();
+  cursorServer(const cursorServer &)            = delete;
+  cursorServer &operator=(const cursorServer &) = delete;
+
+  bool start();
+  void print_stats(FILE *out) const;
+
+ private:
+  std::vector<area> areas;
+  int               periodMs;
+
+  Display *display = NULL;
+  Window   root;
+  int      fixesEvent, fixesError;
+
+  /**
+   * @brief connection of one viewer and the shapes it already has */
+  struct client {
+    std::unique_ptr<boost::asio::ip::tcp::socket> socket;
+    std::unordered_set<uint32_t>                  sentShapes;
+  };
+
+  boost::asio::io_context                         io_context;
+  std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor;
+  boost::thread                                   th_cursor;
+  std::atomic<bool>                               quit{false};
+
+  std::vector<client>   clients;  //!< owned by the cursor thread
+  cursor_packet_t       state{};
+  std::vector<uint32_t> pixels;  //!< ARGB of the current shape
+
+  std::atomic<uint64_t> moves{0};
+  std::atomic<uint64_t> shapes{0};
+  std::atomic<uint64_t> cachedShapes{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<int>      connected{0};
+
+  void run();
+  void accept_clients();
+  void fetch_shape();
+  bool locate(int rootX, int rootY);
+  bool send(client &c, bool with_pixels);
+};
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#define DIRTY_BLOCK 64
+
+/**
+ * @brief rectangle in pixel, right and bottom excluded */
+struct dirtyRect {
+  int left, top, right, bottom;
+};
+
+/**
+ * @brief Block level change detection between consecutive captured frames
+ *
+ * NvFBC can not generate diff maps for the YUV buffer formats, so the map is
+ * computed here by comparing every block against a copy of the previous frame.
+ * Only the rows of changed blocks are copied back into the reference. */
+class dirtyMap {
+ public:
+  dirtyMap(int width, int height, int nb_planes, int block = DIRTY_BLOCK);
+
+  size_t update(const uint8_t *const *data, const int *linesize);
+  int    attach(AVFrame *av_frame, size_t max_blocks) const;
+  void   invalidate() { first = true; }
+
+  const std::vector<dirtyRect> &blocks() const { return dirty; }
+  size_t                        total_blocks() const { return (size_t)blocks_w * blocks_h; }
+
+ private:
+  int  width, height, nb_planes, block;
+  int  blocks_w, blocks_h;
+  bool first = true;
+
+  std::vector<uint8_t>   reference;
+  std::vector<dirtyRect> dirty;
+};
@@ -0,0 +1,66 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+/**
+ * @brief Latest frame wins hand-off from the decode thread to the present thread
+ *
+ * Three frames rotate between the two threads: the decoder fills the back
+ * one, the presenter shows the front one and the middle one is exchanged
+ * atomically by both, flagged while it holds a frame not taken yet. Neither
+ * side waits for the other: a frame published over a flagged one replaces
+ * it, the replaced frame is counted as skipped. */
+class frameMailbox {
+ public:
+  frameMailbox() {
+    for (AVFrame *&frame : frames) frame = av_frame_alloc();
+  }
+  ~frameMailbox() {
+    for (AVFrame *&frame : frames) av_frame_free(&frame);
+  }
+  frameMailbox(const frameMailbox &)            = delete;
+  frameMailbox &operator=(const frameMailbox &) = delete;
+
+  /**
+   * @brief Hand a decoded frame to the presenter, decode thread only
+   * @param[in,out] frame its reference moves into the mailbox, it is left empty
+   * @param[in] decoded_us when it was decoded, given back by @ref take
+   * @return true if it replaced a frame that was never taken */
+  bool publish(AVFrame *frame, uint64_t decoded_us) {
+    av_frame_unref(frames[back]);
+    av_frame_move_ref(frames[back], frame);
+    stamps[back]      = decoded_us;
+    unsigned previous = middle.exchange(back | FRESH, std::memory_order_acq_rel);
+    if (previous & FRESH) nSkipped.fetch_add(1, std::memory_order_relaxed);
+    back = previous & ~FRESH;
+    return previous & FRESH;
+  }
+
+  /**
+   * @brief Newest frame not taken yet, present thread only
+   * @param[out] decoded_us when it was decoded
+   * @return NULL if nothing was published since the last take, else a frame valid until the next take */
+  AVFrame *take(uint64_t &decoded_us) {
+    // Only take clears the flag, it cannot go away between the load and the exchange
+    if (!(middle.load(std::memory_order_acquire) & FRESH)) return NULL;
+    front      = middle.exchange(front, std::memory_order_acq_rel) & ~FRESH;
+    decoded_us = stamps[front];
+    return frames[front];
+  }
+
+  uint64_t skipped() const { return nSkipped.load(std::memory_order_relaxed); }
+
+ private:
+  static const unsigned FRESH = 4;  //!< set on middle while it holds a frame not taken yet
+
+  AVFrame              *frames[3];
+  uint64_t              stamps[3] = {0, 0, 0};
+  unsigned              back      = 0;  //!< owned by the decode thread
+  std::atomic<unsigned> middle{1};
+  unsigned              front = 2;  //!< owned by the present thread
+  std::atomic<uint64_t> nSkipped{0};
+};
@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+#include <libswscale/swscale.h>
+}
+
+/**
+ * @brief Client render stage: decoded frames to RGB32, without allocating per frame
+ *
+ * Each stream keeps its SwsContext, rebuilt only when the source size, the
+ * destination size or the pixel format changes, that is on a resize or a
+ * new stream format. Frames are scaled straight into the caller memory,
+ * usually the window surface, or into an RGB32 frame of a fixed pool. */
+class frameRenderer {
+ public:
+  explicit frameRenderer(int pool_frames);
+  ~frameRenderer();
+  frameRenderer(const frameRenderer &)            = delete;
+  frameRenderer &operator=(const frameRenderer &) = delete;
+
+  void scale(int stream, const AVFrame *frame, uint8_t *dst, int pitch, int dst_width, int dst_height);
+
+  AVFrame *acquire(int width, int height);
+  void     release(AVFrame *frame);
+
+  uint64_t rebuilds() const { return nRebuilds; }
+
+ private:
+  /**
+   * @brief scaler of one stream and the geometry it was built for */
+  struct scaler {
+    SwsContext   *ctx = NULL;
+    int           src_w = 0, src_h = 0, dst_w = 0, dst_h = 0;
+    AVPixelFormat format = AV_PIX_FMT_NONE;
+  };
+
+  std::map<int, scaler>  scalers;
+  std::vector<AVFrame *> pool;  //!< every frame of the pool, free or not
+  std::vector<AVFrame *> idle;
+  uint64_t               nRebuilds = 0;
+};
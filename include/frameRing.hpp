@@ -0,0 +1,177 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief what the producer does when the consumer falls behind */
+enum class ringPolicy {
+  BLOCK,       //!< wait until the consumer frees a slot
+  DROP_OLDEST  //!< keep producing, the oldest entry is evicted, the consumer only takes the newest one
+};
+
+/**
+ * @brief Bounded single-producer/single-consumer ring of pre-allocated slots
+ *
+ * The ring stores capacity + 1 slots: the one at head is never visible to the
+ * consumer, so the producer can always fill it, even when the ring is full.
+ * Slots are owned by the caller, the ring only hands them back and forth.
+ *
+ * With ringPolicy::DROP_OLDEST the producer evicts the oldest entry of a full
+ * ring, both sides move the tail with a compare and swap. The consumer takes
+ * entries out with @ref take_newest: one more slot is held by the consumer and
+ * exchanged with the slot it takes, the producer never refills an entry still
+ * being consumed. Head and tail count entries and never wrap, a slot is an
+ * index modulo the ring size, so a stale tail can not be swapped. */
+template <typename T>
+class frameRing {
+ private:
+  static const size_t NONE = SIZE_MAX;
+
+  // Producer and consumer indices live on their own cache lines. Padding is
+  // used instead of alignas so the ring can be heap allocated in C++14
+  std::vector<T>      slots;
+  size_t              ring;  //!< slots in the ring, the last one is held by the consumer with DROP_OLDEST
+  char                pad0[64];
+  std::atomic<size_t> head{0};
+  char                pad1[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail{0};
+  std::atomic<size_t> taking{NONE};  //!< slot exchanged by take_newest, the producer does not fill it meanwhile
+  char                pad2[64 - 2 * sizeof(std::atomic<size_t>)];
+
+  std::atomic<uint64_t> pushed{0};
+  std::atomic<uint64_t> full{0};
+  std::atomic<uint64_t> occupancy_sum{0};
+  std::atomic<uint64_t> max_occupancy{0};
+  char                  pad3[64 - 4 * sizeof(std::atomic<uint64_t>)];
+  std::atomic<uint64_t> dropped{0};
+
+  T &at(size_t i) { return slots[i % ring]; }
+
+  void publish(size_t h) {
+    head.store(h + 1, std::memory_order_release);
+
+    uint64_t occ = size();
+    pushed.fetch_add(1, std::memory_order_relaxed);
+    occupancy_sum.fetch_add(occ, std::memory_order_relaxed);
+    if (occ > max_occupancy.load(std::memory_order_relaxed)) max_occupancy.store(occ, std::memory_order_relaxed);
+  }
+
+ public:
+  /**
+   * @brief snapshot of the ring counters */
+  struct counters {
+    uint64_t pushed        = 0;  //!< entries published by the producer
+    uint64_t full          = 0;  //!< publish attempts that found the ring full
+    uint64_t dropped       = 0;  //!< entries evicted by the producer or skipped by the consumer
+    uint64_t max_occupancy = 0;
+    double   avg_occupancy = 0;  //!< sampled on every publish
+  };
+
+  /**
+   * @param[in] storage pre-allocated slots, its size is the ring capacity + 1, + 2 with DROP_OLDEST
+   * @param[in] policy DROP_OLDEST keeps the last slot for the consumer */
+  explicit frameRing(std::vector<T> storage, ringPolicy policy = ringPolicy::BLOCK)
+      : slots(std::move(storage)), ring(slots.size() - (policy == ringPolicy::DROP_OLDEST ? 1 : 0)) {}
+  frameRing(const frameRing &)            = delete;
+  frameRing &operator=(const frameRing &) = delete;
+
+  size_t capacity() const { return ring - 1; }
+  size_t size() const {
+    size_t t = tail.load(std::memory_order_acquire);
+    return head.load(std::memory_order_acquire) - t;
+  }
+  const std::vector<T> &storage() const { return slots; }
+
+  /**
+   * @brief producer side, slot to fill before calling @ref push */
+  T &write_slot() {
+    size_t slot = head.load(std::memory_order_relaxed) % ring;
+    // Lasts the few instructions of the exchange in take_newest
+    while (taking.load() == slot) std::this_thread::yield();
+    return slots[slot];
+  }
+
+  /**
+   * @brief producer side, publish the write slot
+   * @return false if the ring is full, the write slot is left untouched */
+  bool push() {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == capacity()) {
+      full.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    publish(h);
+    return true;
+  }
+
+  /**
+   * @brief producer side, publish the write slot, evicting the oldest entry of a full ring, DROP_OLDEST only
+   * @return false if an entry was evicted */
+  bool push_evict() {
+    size_t h       = head.load(std::memory_order_relaxed);
+    size_t t       = tail.load();
+    bool   evicted = false;
+    if (h - t == capacity()) {
+      full.fetch_add(1, std::memory_order_relaxed);
+      // Fails only when the consumer took entries meanwhile, there is room either way
+      evicted = tail.compare_exchange_strong(t, t + 1);
+      if (evicted) dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    publish(h);
+    return !evicted;
+  }
+
+  /**
+   * @brief consumer side, oldest published slot
+   * @return nullptr if the ring is empty */
+  T *read_slot() {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) return nullptr;
+    return &at(t);
+  }
+
+  /**
+   * @brief consumer side, give the read slot back to the producer */
+  void pop() { tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+  /**
+   * @brief consumer side, take the newest entry out of the ring and skip the older ones, DROP_OLDEST only
+   * @return the entry, kept by the consumer until its next take, nullptr if the ring is empty
+   *
+   * The entry is exchanged with the one taken before, which goes back to the
+   * producer. When the producer evicts at the same time the tail moved, the
+   * take starts over. */
+  T *take_newest() {
+    for (;;) {
+      size_t t = tail.load();
+      size_t h = head.load(std::memory_order_acquire);
+      if (t == h) return nullptr;
+
+      // Announced before the tail moves, the producer may reach the slot right after
+      taking.store((h - 1) % ring);
+      if (!tail.compare_exchange_strong(t, h)) {
+        taking.store(NONE);
+        continue;
+      }
+      std::swap(at(h - 1), slots[ring]);
+      taking.store(NONE);
+
+      if (h - 1 > t) dropped.fetch_add(h - 1 - t, std::memory_order_relaxed);
+      return &slots[ring];
+    }
+  }
+
+  counters stats() const {
+    counters c;
+    c.pushed        = pushed.load(std::memory_order_relaxed);
+    c.full          = full.load(std::memory_order_relaxed);
+    c.dropped       = dropped.load(std::memory_order_relaxed);
+    c.max_occupancy = max_occupancy.load(std::memory_order_relaxed);
+    c.avg_occupancy = c.pushed ? (double)occupancy_sum.load(std::memory_order_relaxed) / c.pushed : 0;
+    return c;
+  }
+};
@@ -0,0 +1,64 @@
+#pragma once
+#include <boost/thread/thread.hpp>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+}
+
+/**
+ * @brief Bilinear downscale stage between capture and encode
+ *
+ * Every destination row only depends on the source, so the rows of each
+ * plane are split in horizontal slices scaled in parallel: the caller thread
+ * takes the first slice and threads - 1 workers the others. Handles YUV444P
+ * and NV12, the interleaved UV plane of NV12 is scaled as two channels. */
+class frameScaler {
+ public:
+  frameScaler(int src_width, int src_height, int dst_width, int dst_height, AVPixelFormat format, int threads);
+  ~frameScaler();
+  frameScaler(const frameScaler &)            = delete;
+  frameScaler &operator=(const frameScaler &) = delete;
+
+  size_t scale(const uint8_t *const *data, const int *linesize, AVFrame *dst);
+
+  int src_width() const { return srcW; }
+  int src_height() const { return srcH; }
+
+ private:
+  /**
+   * @brief source column and weight of one destination column of a plane */
+  struct plane {
+    int                   src_w, src_h, dst_w, dst_h, channels;
+    std::vector<int>      x0;  //!< left source sample, in bytes from the row start
+    std::vector<uint16_t> fx;  //!< weight of the right sample, in 1/256
+  };
+
+  int                srcW, srcH, dstW, dstH;
+  AVPixelFormat      format;
+  std::vector<plane> planes;
+
+  // Job shared with the workers, guarded by lock
+  const uint8_t *const *src_data     = nullptr;
+  const int            *src_linesize = nullptr;
+  AVFrame              *dst_frame    = nullptr;
+  uint64_t              generation   = 0;
+  int                   pending      = 0;
+  bool                  quit         = false;
+  int                   slices;
+
+  std::mutex                 lock;
+  std::condition_variable    start_cv;
+  std::condition_variable    done_cv;
+  std::vector<boost::thread> workers;
+
+  void worker(int slice);
+  void scale_slice(int slice);
+  static void scale_rows(const plane &p, const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int begin,
+                         int end);
+};
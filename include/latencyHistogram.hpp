@@ -0,0 +1,222 @@
+#pragma once
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <atomic>
+#include <boost/thread/thread.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+//! @brief 2^LATENCY_SUB_BITS linear buckets per power of two, about 3% relative error
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+//! @brief values up to 2^LATENCY_MAX_BITS us (~19 h), larger ones land in the last bucket
+#define LATENCY_MAX_BITS 36
+#define LATENCY_BUCKETS (LATENCY_SUB + (LATENCY_MAX_BITS - LATENCY_SUB_BITS) * LATENCY_SUB)
+
+/**
+ * @brief Log-linear (HDR style) histogram of latencies in microseconds
+ *
+ * Values below LATENCY_SUB are exact, above every power of two is split in
+ * LATENCY_SUB linear buckets. There is one writer per histogram: counters are
+ * updated with relaxed load/store, without locks or read-modify-write, and can
+ * be read from any thread while the owner records. */
+class latencyHistogram {
+ private:
+  std::atomic<uint64_t> buckets[LATENCY_BUCKETS];
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> sum{0};
+  std::atomic<uint64_t> max{0};
+
+  static void add(std::atomic<uint64_t> &a, uint64_t v) {
+    a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+  }
+
+  static int bucket_of(uint64_t us) {
+    if (us < LATENCY_SUB) return (int)us;
+    int magnitude = 63 - __builtin_clzll(us);
+    if (magnitude >= LATENCY_MAX_BITS) return LATENCY_BUCKETS - 1;
+    int shift = magnitude - LATENCY_SUB_BITS;
+    return LATENCY_SUB + shift * LATENCY_SUB + (int)((us >> shift) - LATENCY_SUB);
+  }
+  static uint64_t lower_bound(int b) {
+    if (b < LATENCY_SUB) return b;
+    int shift = (b - LATENCY_SUB) / LATENCY_SUB;
+    return (uint64_t)((b - LATENCY_SUB) % LATENCY_SUB + LATENCY_SUB) << shift;
+  }
+  static uint64_t upper_bound(int b) {
+    if (b < LATENCY_SUB) return b + 1;
+    int shift = (b - LATENCY_SUB) / LATENCY_SUB;
+    return (uint64_t)((b - LATENCY_SUB) % LATENCY_SUB + LATENCY_SUB + 1) << shift;
+  }
+
+ public:
+  latencyHistogram() {
+    for (auto &b : buckets) b.store(0, std::memory_order_relaxed);
+  }
+  latencyHistogram(const latencyHistogram &)            = delete;
+  latencyHistogram &operator=(const latencyHistogram &) = delete;
+
+  /**
+   * @brief owner thread only */
+  void record(uint64_t us) {
+    add(buckets[bucket_of(us)], 1);
+    add(count, 1);
+    add(sum, us);
+    if (us > max.load(std::memory_order_relaxed)) max.store(us, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief add the counters of another histogram, read while its owner may be recording */
+  void merge(const latencyHistogram &other) {
+    for (int b = 0; b < LATENCY_BUCKETS; b++) add(buckets[b], other.buckets[b].load(std::memory_order_relaxed));
+    add(count, other.count.load(std::memory_order_relaxed));
+    add(sum, other.sum.load(std::memory_order_relaxed));
+    uint64_t m = other.max.load(std::memory_order_relaxed);
+    if (m > max.load(std::memory_order_relaxed)) max.store(m, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief monotonic clock in microseconds, the time base of every stage */
+  static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  uint64_t samples() const { return count.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief highest value equivalent to the requested percentile, within the bucket precision
+   * @param[in] p percentile between 0 and 100 */
+  uint64_t percentile(double p) const {
+    uint64_t top  = max.load(std::memory_order_relaxed);
+    uint64_t rank = (uint64_t)(samples() * p / 100.0);
+    uint64_t seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+      seen += buckets[b].load(std::memory_order_relaxed);
+      if (seen > rank) return upper_bound(b) - 1 < top ? upper_bound(b) - 1 : top;
+    }
+    return top;
+  }
+
+  double mean() const { return samples() ? (double)sum.load(std::memory_order_relaxed) / samples() : 0.0; }
+
+  /**
+   * @brief one line summary: samples, mean, p50, p99, p99.9 and max */
+  void print(FILE *out, const char *name) const {
+    fprintf(out, "%s: %lu samples, mean %.1f us, p50 %lu us, p99 %lu us, p99.9 %lu us, max %lu us\n", name, samples(),
+            mean(), percentile(50), percentile(99), percentile(99.9), max.load(std::memory_order_relaxed));
+  }
+
+  /**
+   * @brief csv dump, a "summary,name,samples,mean_us,p50_us,p99_us,p999_us,max_us" line then one
+   * "bucket,name,low_us,high_us,count" line per non empty bucket, high excluded */
+  void dump(FILE *out, const char *name) const {
+    fprintf(out, "summary,%s,%lu,%.1f,%lu,%lu,%lu,%lu\n", name, samples(), mean(), percentile(50), percentile(99),
+            percentile(99.9), max.load(std::memory_order_relaxed));
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+      uint64_t n = buckets[b].load(std::memory_order_relaxed);
+      if (n) fprintf(out, "bucket,%s,%lu,%lu,%lu\n", name, lower_bound(b), upper_bound(b), n);
+    }
+  }
+};
+
+/**
+ * @brief Process wide set of named histograms, one per stage and per thread
+ *
+ * A thread registers its histogram once, usually through a function local
+ * static thread_local pointer, then records without locking. Histograms live
+ * until the process exits, readers merge the ones sharing a name. */
+class latencyRegistry {
+ private:
+  std::mutex                                                          lock;
+  std::deque<std::pair<std::string, std::unique_ptr<latencyHistogram>>> histograms;
+
+ public:
+  static latencyRegistry &instance() {
+    static latencyRegistry registry;
+    return registry;
+  }
+
+  /**
+   * @brief new histogram owned by the registry, to be recorded by the calling thread only
+   * @param[in] name stage name, histograms with the same name are merged in the output */
+  latencyHistogram *create(const std::string &name) {
+    std::lock_guard<std::mutex> guard(lock);
+    histograms.emplace_back(name, std::unique_ptr<latencyHistogram>(new latencyHistogram()));
+    return histograms.back().second.get();
+  }
+
+  /**
+   * @brief same as above for a per-output stage, named "<stage>:<stream>" */
+  latencyHistogram *create(const std::string &stage, int stream) {
+    return create(stage + ":" + std::to_string(stream));
+  }
+
+  /**
+   * @brief apply fn(name, merged histogram) to every stage, sorted by name */
+  template <typename F>
+  void for_each(F fn) {
+    std::map<std::string, std::unique_ptr<latencyHistogram>> merged;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      for (auto &h : histograms) {
+        auto &m = merged[h.first];
+        if (!m) m.reset(new latencyHistogram());
+        m->merge(*h.second);
+      }
+    }
+    for (auto &m : merged) fn(m.first.c_str(), *m.second);
+  }
+
+  void print(FILE *out) {
+    for_each([out](const char *name, const latencyHistogram &h) { h.print(out, name); });
+  }
+
+  /**
+   * @brief write every stage to path, through a temporary file renamed over
+   * it so a reader never sees a partial dump
+   * @return false if the file could not be written */
+  bool dump(const char *path) {
+    std::string tmp = std::string(path) + ".tmp";
+    FILE       *out = fopen(tmp.c_str(), "w");
+    if (out == NULL) {
+      fprintf(stderr, "Could not open '%s'\n", tmp.c_str());
+      return false;
+    }
+    for_each([out](const char *name, const latencyHistogram &h) { h.dump(out, name); });
+    fclose(out);
+    return rename(tmp.c_str(), path) == 0;
+  }
+
+  /**
+   * @brief dump to path (stdout if NULL) every time the process gets SIGUSR1
+   *
+   * Must run on the main thread before any other thread is created: SIGUSR1
+   * is blocked in the caller, threads inherit the mask, and a dedicated thread
+   * takes the signal with sigwait so the dump does not run in a handler */
+  void dump_on_signal(const char *path) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    boost::thread([this, path, set]() {
+      for (;;) {
+        int sig;
+        if (sigwait(&set, &sig) != 0) return;
+        if (path)
+          dump(path);
+        else
+          print(stdout);
+      }
+    }).detach();
+  }
+};
@@ -1,12 +1,19 @@
 #pragma once
 //! @brief tcp socket port for AV packet
+#include <cstddef>
 #include <cstdint>
 extern const char *REMOTE_IP;
 #define PORT_AV 3200
 #define PORT_XDO 3201
+#define PORT_CURSOR 3202
+//! @brief size of the text requests sent by the client
 #define PKTSIZE 64
 #define VSIZEW 1920
 #define VSIZEH 1080
+//! @brief stream ids go from 0 to MAX_OUTPUTS - 1, one per captured output
+#define MAX_OUTPUTS 16
+//! @brief subscription sent by the client, every stream
+#define ALL_OUTPUTS -1
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -19,29 +26,165 @@ extern "C" {
 #include "libswscale/swscale.h"
 }
 
+//! @brief "RDV1" read as a little-endian uint32, first field of every video packet header
+#define HEADER_MAGIC 0x31564452u
+#define HEADER_VERSION 1
+//! @brief bytes of a version 1 header on the wire
+#define HEADER_SIZE 40
+//! @brief largest payload a reader accepts, above an uncompressed 4K yuv444p frame
+#define MAX_PAYLOAD (32 * 1024 * 1024)
+//! @brief capture times of the frames in flight in one encoder, by pts
+#define ENCODE_TIMING_SLOTS 64
+
+enum frame_type_t : uint8_t { FRAME_P = 0, FRAME_IDR = 1 };
+
+/**
+ * @brief header in front of every video packet on PORT_AV
+ *
+ * The wire layout is fixed and little-endian whatever the host, see
+ * write_header and read_header:
+ *
+ *   offset  size  field
+ *        0     4  magic, HEADER_MAGIC
+ *        4     2  version, HEADER_VERSION
+ *        6     2  header size, HEADER_SIZE for version 1
+ *        8     2  stream
+ *       10     1  frame type, frame_type_t
+ *       11     1  reserved, 0
+ *       12     2  width
+ *       14     2  height
+ *       16     4  sequence, per stream, a gap means packets were dropped
+ *       20     4  encode duration in us
+ *       24     8  capture time in us, server CLOCK_MONOTONIC
+ *       32     4  payload size
+ *       36     4  reserved, 0
+ *
+ * A reader skips the bytes of a larger header size, newer versions only
+ * append fields. */
+struct packet_header_t {
+  uint16_t     stream       = 0;
+  frame_type_t frame_type   = FRAME_P;
+  uint16_t     width        = 0;
+  uint16_t     height       = 0;
+  uint32_t     sequence     = 0;
+  uint32_t     encode_us    = 0;
+  uint64_t     capture_us   = 0;
+  uint32_t     payload_size = 0;
+};
+
+void write_header(const packet_header_t &header, uint8_t *out);
+int  read_header(const uint8_t *in, packet_header_t &header);
+
+class latencyHistogram;
+
+/**
+ * @brief capture time and encode start of the frames in flight in an encoder
+ *
+ * The capture time travels with the AVFrame in its opaque field, the packet
+ * gets it back through its pts: x264 with zerolatency keeps pts order. */
+struct encodeTiming {
+  uint64_t capture_us[ENCODE_TIMING_SLOTS]{};
+  uint64_t start_us[ENCODE_TIMING_SLOTS]{};
+  uint32_t encode_us[ENCODE_TIMING_SLOTS]{};
+
+  //! @brief the frame is handed to avcodec_send_frame
+  void sent(const AVFrame *frame, uint64_t now) {
+    int slot         = frame->pts % ENCODE_TIMING_SLOTS;
+    capture_us[slot] = (uint64_t)(uintptr_t)frame->opaque;
+    start_us[slot]   = now;
+  }
+  //! @brief avcodec_receive_packet returned the packet of the frame
+  void received(const AVPacket *pkt, uint64_t now) {
+    int slot        = pkt->pts % ENCODE_TIMING_SLOTS;
+    encode_us[slot] = now - start_us[slot];
+  }
+  //! @brief fill the timing fields of a header
+  void fill(const AVPacket *pkt, packet_header_t &header) const {
+    int slot          = pkt->pts % ENCODE_TIMING_SLOTS;
+    header.capture_us = capture_us[slot];
+    header.encode_us  = encode_us[slot];
+  }
+};
+
+//! @brief "RDU1" read as a little-endian uint32, first field of every datagram of the UDP transport
+#define DATAGRAM_MAGIC 0x31554452u
+//! @brief bytes of a datagram header on the wire
+#define DATAGRAM_HEADER_SIZE 16
+//! @brief payload bytes of a data datagram
+#define DATAGRAM_PAYLOAD_SIZE 1200
+//! @brief largest datagram, a fec one: its parity covers whole data datagrams. Fits a 1280 bytes IPv6 MTU
+#define DATAGRAM_MAX_SIZE (2 * DATAGRAM_HEADER_SIZE + DATAGRAM_PAYLOAD_SIZE)
+//! @brief sequence numbers in one NACK datagram
+#define DATAGRAM_MAX_NACKS 64
+
+enum datagram_type_t : uint8_t {
+  DATAGRAM_DATA      = 0,  //!< fragment of a video packet, server -> client
+  DATAGRAM_FEC       = 1,  //!< XOR of a group of data datagrams, server -> client
+  DATAGRAM_NACK      = 2,  //!< sequences to send again, client -> server
+  DATAGRAM_KEYFRAME  = 3,  //!< recovery failed, the client waits for a keyframe of the stream
+  DATAGRAM_SUBSCRIBE = 4,  //!< the PKTSIZE text request, repeated as a keep-alive
+};
+
+/**
+ * @brief header in front of every datagram of the UDP transport on PORT_AV
+ *
+ * A video packet, header included, is cut into fragments of at most
+ * DATAGRAM_PAYLOAD_SIZE bytes, numbered by a per stream datagram sequence:
+ *
+ *   offset  size  field
+ *        0     4  magic, DATAGRAM_MAGIC
+ *        4     1  type, datagram_type_t
+ *        5     1  stream
+ *        6     2  payload size
+ *        8     4  data: datagram sequence, fec: sequence of the first datagram of the group
+ *       12     2  data: fragment index in the packet, fec: datagrams in the group
+ *       14     2  data: fragments of the packet
+ *
+ * A fec payload is the XOR of the whole data datagrams of its group, each
+ * zero padded to the longest: with one datagram of the group missing, XOR
+ * of the others and the fec payload gives it back, header included. A nack
+ * payload is a list of little-endian uint32 sequences. */
+struct datagram_header_t {
+  datagram_type_t type      = DATAGRAM_DATA;
+  uint8_t         stream    = 0;
+  uint16_t        length    = 0;
+  uint32_t        sequence  = 0;
+  uint16_t        fragment  = 0;
+  uint16_t        fragments = 0;
+};
+
+void write_datagram_header(const datagram_header_t &header, uint8_t *out);
+bool read_datagram_header(const uint8_t *in, size_t size, datagram_header_t &header);
+void put_u32(uint8_t *out, uint32_t value);
+uint32_t get_u32(const uint8_t *in);
+
 class videoThreadParams {
  public:
-  AVFrame        *frame;
-  AVPacket       *pkt;
-  AVCodecContext *ctx;
+  AVFrame          *frame;
+  AVPacket         *pkt;
+  AVCodecContext   *ctx;
+  int               stream;
+  encodeTiming      timing;
+  latencyHistogram *send_frame;      //!< avcodec_send_frame of the stream, shared with its capturePipeline
+  latencyHistogram *receive_packet;  //!< avcodec_receive_packet of the stream, shared with its capturePipeline
   videoThreadParams(const videoThreadParams &x) {
-    pkt   = av_packet_clone(x.pkt);
-    frame = av_frame_clone(x.frame);
-    ctx   = x.ctx;
+    pkt            = av_packet_clone(x.pkt);
+    frame          = av_frame_clone(x.frame);
+    ctx            = x.ctx;
+    stream         = x.stream;
+    send_frame     = x.send_frame;
+    receive_packet = x.receive_packet;
   }
   videoThreadParams() {
-    frame = nullptr;
-    pkt   = nullptr;
-    ctx   = nullptr;
+    frame          = nullptr;
+    pkt            = nullptr;
+    ctx            = nullptr;
+    stream         = 0;
+    send_frame     = nullptr;
+    receive_packet = nullptr;
   }
 };
 
-struct image_metadata_t {
-  int    width            = 0;
-  int    height           = 0;
-  size_t image_size_bytes = 0;
-};
-
 typedef struct mouse {
   uint16_t x = 0;
   uint16_t y = 0;
@@ -59,3 +202,20 @@ struct xdo_packet_t {
   mouse_t    mouse;
   keyboard_t key;
 };
+
+/**
+ * @brief remote cursor state, sent on PORT_CURSOR when the cursor is not captured
+ *
+ * Shapes are keyed by hash, the pixels follow the packet only the first time
+ * a shape is sent: size bytes of premultiplied ARGB, width x height. */
+struct cursor_packet_t {
+  uint8_t  visible;  //!< 0 when the pointer is outside every captured output
+  uint8_t  reserved;
+  uint16_t stream;  //!< output the pointer is on
+  uint16_t x, y;    //!< position in 1/65535 of the output area
+  uint16_t area_w;  //!< size of the output area in screen pixels, scales the shape
+  uint16_t area_h;
+  uint16_t width, height, xhot, yhot;
+  uint32_t hash;  //!< key of the current shape
+  uint32_t size;  //!< bytes of pixels following the packet, 0 if the shape was already sent
+};
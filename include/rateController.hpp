@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "tcpServer.hpp"
+
+//! @brief time between two decisions
+#define RATE_INTERVAL_MS 250
+//! @brief decisions over budget at the lowest bitrate before the frame rate or the size is lowered
+#define RATE_DEGRADE_INTERVALS 2
+//! @brief time spent well under budget before a lowered frame rate or size is restored
+#define RATE_UPGRADE_HOLD_MS 3000
+
+/**
+ * @brief Adaptive bitrate for one stream, keeps the queuing delay under a latency budget
+ *
+ * Every RATE_INTERVAL_MS the capture thread hands the last @ref linkSample
+ * of its stream. Over budget the bitrate is cut to 3/4, and never above 9/10
+ * of the delivered rate; under half the budget it grows by 1/16. When the
+ * lowest bitrate is still too much, the controller halves the frame rate,
+ * then lowers the encoded size, and restores them once the link has been
+ * clear for RATE_UPGRADE_HOLD_MS. The encoder runs in ABR mode with a VBV
+ * buffer holding the budget worth of bits, so a single frame can not queue
+ * more than the budget either.
+ *
+ * Every decision is written to the log as a csv line, see @ref log_header. */
+class rateController {
+ public:
+  struct config {
+    int   budget_ms = 0;  //!< 0 disables the controller
+    int   min_kbps  = 300;
+    int   max_kbps  = 20000;
+    FILE *log       = NULL;
+  };
+
+  rateController(const config &cfg, int stream);
+
+  bool update(uint64_t now_us, const linkSample &link);
+
+  int64_t bit_rate() const { return (int64_t)kbps * 1000; }
+  int     buffer_size() const { return (int)((int64_t)kbps * cfg.budget_ms); }
+  int     frame_divider() const { return levels[level].divider; }
+  int     scale_percent() const { return levels[level].scale; }
+
+  static void apply(AVCodecContext *ctx, int64_t bit_rate, int buffer_size);
+  static void log_header(FILE *log);
+
+ private:
+  /**
+   * @brief one step of the degradation ladder */
+  struct step {
+    int divider;  //!< one captured frame in divider is encoded
+    int scale;    //!< encoded size in percent of the requested one
+  };
+  static const step levels[];
+  static const int  nLevels;
+
+  config   cfg;
+  int      stream;
+  int      kbps;
+  int      level         = 0;
+  int      overloaded    = 0;  //!< consecutive decisions over budget at min_kbps
+  uint64_t nextUs        = 0;
+  uint64_t clearSinceUs  = 0;  //!< start of the current run under half the budget, 0 if not in one
+
+  void log(uint64_t now_us, const linkSample &link, const char *action) const;
+};
@@ -1,48 +1,266 @@
 #pragma once
+#include <atomic>
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
 #include <boost/asio/executor_work_guard.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/thread/thread.hpp>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
 #include <iostream>
+#include <list>
+#include <map>
 #include <memory>
+#include <array>
+#include <mutex>
+#include <string>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavcodec/packet.h>
 }
 
+#include "latencyHistogram.hpp"
 #include "protocol.hpp"
+#include "uringWriter.hpp"
 
+class udpServerAV;
+
+//! @brief packets of one stream a viewer may have queued before it is resynchronized on a keyframe
+#define VIEWER_QUEUE_PACKETS 15
+//! @brief every viewer of a stream has this many packets queued: the uplink is the bottleneck, skip frames
+#define THROTTLE_QUEUE_PACKETS 4
+//! @brief minimum time between two keyframes forced for the same stream
+#define KEYFRAME_MIN_INTERVAL_MS 1000
+//! @brief period of the link sampling done by the network thread
+#define LINK_SAMPLE_MS 50
+//! @brief delivered rate assumed when nothing left the queues, bounds the delay estimate
+#define LINK_MIN_RATE_BPS 64000
+//! @brief a GOP larger than this is not cached, new viewers of the stream wait for a forced keyframe
+#define GOP_CACHE_BYTES (8 * 1024 * 1024)
+//! @brief payload size from which --zerocopy is worth its page pinning and completion, see enable_zerocopy
+#define ZEROCOPY_MIN_BYTES 16384
+
+/**
+ * @brief state of the link to the least delayed viewer of a stream */
+struct linkSample {
+  uint64_t delay_us     = 0;  //!< time to drain what is queued at the delivered rate
+  uint64_t rate_bps     = 0;  //!< rate at which bytes leave the socket send queue, smoothed
+  uint64_t queued_bytes = 0;  //!< still in our viewer queue
+  uint64_t kernel_bytes = 0;  //!< in the socket send queue, unsent or unacknowledged (TIOCOUTQ)
+  int      viewers      = 0;
+};
+
+/**
+ * @brief Encoded packet shared by every viewer of its stream, freed with the last reference */
+struct sharedPacket {
+  AVPacket                         *pkt;  //!< new reference to the encoder buffer, not a copy
+  std::array<uint8_t, HEADER_SIZE>  header;
+  int                               stream;
+  bool                              key;
+  uint64_t                          queued_us;  //!< when the encoder handed it over
+  uringWriter                      *pool = NULL;  //!< header and payload are also in slot of this pool
+  int                               slot = -1;
+
+  sharedPacket() : pkt(av_packet_alloc()) {}
+  ~sharedPacket() {
+    if (pool) pool->release(slot);
+    av_packet_free(&pkt);
+  }
+  sharedPacket(const sharedPacket &)            = delete;
+  sharedPacket &operator=(const sharedPacket &) = delete;
+};
+
+/**
+ * @brief Video server, encodes once and broadcasts to every connected viewer
+ *
+ * Viewers are accepted at any time on PORT_AV. The encoder threads hand each
+ * packet to @ref send_packet, which takes a reference on it and returns: the
+ * network thread appends it to the queue of every viewer subscribed to the
+ * stream and writes each queue on its own. A viewer that falls behind loses
+ * its queued packets of the stream and waits for the next keyframe, the
+ * others are not slowed down. A new viewer first gets the cached GOP of
+ * each stream, the last keyframe and the packets since, and decodes right
+ * away. Without a cache, or when it asks for it, it waits for a keyframe
+ * forced like for a resynchronizing viewer, see @ref take_keyframe_request.
+ * When every viewer
+ * is behind, @ref queue_depth tells the capture thread to skip frames.
+ *
+ * The first viewer picks the encoded size, it is shared by every viewer.
+ * With @ref enable_udp the packets also go to the peers of a udpServerAV.
+ *
+ * Packets are written with sendmsg, header and payload gathered from the
+ * shared buffers. With @ref enable_zerocopy the large ones are sent with
+ * MSG_ZEROCOPY: the kernel reads the encoder buffer itself, so the packet
+ * is kept until its completion comes back on the socket error queue.
+ * With @ref enable_uring they are written through a uringWriter instead,
+ * one submission for every viewer of a packet. */
 class tcpServerAV {
  private:
-  boost::asio::io_context                       io_context;
-  boost::asio::ip::tcp::acceptor               *acceptor;
-  std::unique_ptr<boost::asio::ip::tcp::socket> socket;
-  // std::unique_ptr<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> work;
+  /**
+   * @brief one connected client, only touched by the network thread */
+  struct viewer {
+    boost::asio::ip::tcp::socket                    socket;
+    std::array<char, PKTSIZE + 1>                   request{};
+    int                                             subscription = ALL_OUTPUTS;
+    std::deque<std::shared_ptr<const sharedPacket>> queue;  //!< front is being written when writing is set
+    int                                             queued[MAX_OUTPUTS]{};
+    bool                                            waitKey[MAX_OUTPUTS];
+    int                                             burst[MAX_OUTPUTS]{};  //!< cached packets at the front
+    bool                                            started[MAX_OUTPUTS]{};  //!< first keyframe written
+    uint64_t                                        joinedUs = 0;
+    bool                                            writing = false;
+    int                                             id;
+    uint64_t                                        queuedBytes = 0;
+    uint64_t                                        written     = 0;  //!< bytes handed to the kernel
+    uint64_t                                        delivered   = 0;  //!< bytes that left the send queue
+    linkSample                                      link;
+    size_t                                          frontSent     = 0;  //!< bytes of the front packet sent
+    bool                                            zerocopy      = false;  //!< SO_ZEROCOPY accepted
+    uint32_t                                        zerocopyNext  = 0;  //!< id of the next MSG_ZEROCOPY send
+    int64_t                                         frontZerocopy = -1;  //!< last id used by the front packet
+    int                                             chainError    = 0;  //!< io_uring error in the current write
+
+    //! @brief packets sent with MSG_ZEROCOPY by their last id, kept until the kernel is done with them
+    std::deque<std::pair<uint32_t, std::shared_ptr<const sharedPacket>>> pinned;
+
+    viewer(boost::asio::io_context &io, int id) : socket(io), id(id) {
+      for (bool &w : waitKey) w = true;
+    }
+    bool wants(int stream) const { return subscription == ALL_OUTPUTS || subscription == stream; }
+  };
+
+  boost::asio::io_context                                                   io_context;
+  boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work;
+  boost::asio::ip::tcp::acceptor                                            acceptor;
+  boost::thread                                                             th_network;
+  boost::asio::steady_timer                                                 sampleTimer;
+  uint64_t                                                                  lastSampleUs = 0;
+  clockid_t                                                                 networkClock;  //!< cpu time of th_network
+
+  std::list<std::shared_ptr<viewer>>     viewers;
+  int                                    nextViewer = 0;
+  udpServerAV                           *udp        = NULL;
+  uringWriter                           *uring      = NULL;
+  std::map<int, std::shared_ptr<viewer>> uringWriting;  //!< viewers with io_uring writes in flight, by id
+  latencyHistogram                      *writeLatency;  //!< queued -> written, recorded by the network thread
+  latencyHistogram                      *joinLatency;  //!< subscription -> first keyframe written, per viewer
+
+  // Last keyframe of each stream and the packets since, for the next viewers
+  std::deque<std::shared_ptr<const sharedPacket>> gop[MAX_OUTPUTS];
+  uint64_t                                        gopBytes[MAX_OUTPUTS]{};
+
+  std::atomic<uint64_t> bytes_sent[MAX_OUTPUTS]{};  //!< encoded bytes, counted once whatever the viewers
+  std::atomic<int>      watchers[MAX_OUTPUTS]{};
+  std::atomic<int>      depth[MAX_OUTPUTS]{};  //!< packets queued by the least loaded viewer of each stream
+  std::atomic<int>      posted[MAX_OUTPUTS]{};  //!< handed over by the encoder, not yet queued for the viewers
+  std::atomic<uint32_t> sequence[MAX_OUTPUTS]{};
+
+  // linkSample of each stream, published by the network thread
+  std::atomic<uint64_t> linkDelay[MAX_OUTPUTS]{};
+  std::atomic<uint64_t> linkRate[MAX_OUTPUTS]{};
+  std::atomic<uint64_t> linkQueued[MAX_OUTPUTS]{};
+  std::atomic<uint64_t> linkKernel[MAX_OUTPUTS]{};
+  std::atomic<bool>     keyframeRequest[MAX_OUTPUTS]{};
+  std::atomic<uint64_t> lastKeyframeUs[MAX_OUTPUTS]{};  //!< written by the encoder thread of each stream
+
+  std::atomic<uint64_t> bytes_written{0};
+  std::atomic<uint64_t> packets_dropped{0};
+  std::atomic<uint64_t> resyncs{0};
+  std::atomic<uint64_t> keyframes_forced{0};
+  std::atomic<int>      connected{0};
+  std::atomic<uint64_t> zerocopy_sends{0};
+  std::atomic<uint64_t> zerocopy_copied{0};  //!< completed, but the kernel had to copy (loopback, no sg NIC)
+  std::atomic<uint64_t> zerocopy_fallbacks{0};  //!< large enough, sent by copy: no SO_ZEROCOPY or ENOBUFS
+  std::atomic<uint64_t> copy_sends{0};
+  std::atomic<uint64_t> send_calls{0};  //!< sendmsg system calls, EAGAIN included
+
+  // Size asked by the first viewer, 0 for native
+  std::mutex              sizeLock;
+  std::condition_variable sizeReady;
+  bool                    firstViewer = false;
+  int                     requestW    = 0;
+  int                     requestH    = 0;
 
   static tcpServerAV *instance;
+  static std::mutex   instanceLock;
+  static int          udpPort;
+  static int          udpFecGroup;
+  static size_t       zerocopyMin;
+  static bool         useUring;
 
-  tcpServerAV() {
-    acceptor = new boost::asio::ip::tcp::acceptor(io_context,
-                                                  boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), PORT_AV));
+  tcpServerAV();
 
-    socket = std::make_unique<boost::asio::ip::tcp::socket>(acceptor->accept(io_context));
+  void start_accept();
+  void read_subscription(std::shared_ptr<viewer> v);
+  void fan_out(std::shared_ptr<const sharedPacket> packet);
+  void enqueue(std::shared_ptr<viewer> v, const std::shared_ptr<const sharedPacket> &packet);
+  void write_next(std::shared_ptr<viewer> v);
+  void wait_writable(std::shared_ptr<viewer> v);
+  void reap_zerocopy(viewer &v);
+  void written(std::shared_ptr<viewer> v);
+  void uring_write(std::shared_ptr<viewer> v);
+  void uring_done(uint64_t user_data, int res);
+  void drop(std::shared_ptr<viewer> v, const boost::system::error_code &error);
+  void update_depth(int stream);
+  void sample_links();
+  void cache_gop(const std::shared_ptr<const sharedPacket> &packet);
+  void burst_gop(std::shared_ptr<viewer> v);
+  int  subscribed(const std::string &name, const char *request, bool &burst);
+  void unsubscribed(int subscription);
+  void request_keyframe(int stream) { keyframeRequest[stream] = true; }
 
-    // work =
-    // std::make_unique<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>>(boost::asio::make_work_guard(io_context));
+  friend class udpServerAV;
 
-    std::cout << "Success" << std::endl;
+  template <typename F>
+  static void for_streams(int subscription, F fn) {
+    for (int s = 0; s < MAX_OUTPUTS; s++)
+      if (subscription == ALL_OUTPUTS || subscription == s) fn(s);
   }
 
  public:
   static tcpServerAV *getInstance() {
+    // Every output has its own capture thread, the first one waits for a viewer
+    std::lock_guard<std::mutex> lock(instanceLock);
     if (instance == nullptr) {
       instance = new tcpServerAV();
     }
     return instance;
   }
+  /**
+   * @brief Also serve UDP peers on port, before the first @ref getInstance
+   * @param[in] fec_group data datagrams covered by one fec datagram, 0 for none */
+  static void enable_udp(int port, int fec_group) {
+    udpPort     = port;
+    udpFecGroup = fec_group;
+  }
+  /**
+   * @brief Send the payloads of at least min_bytes with MSG_ZEROCOPY, before the first @ref getInstance
+   * @param[in] min_bytes smaller packets are copied, pinning their pages costs more, see ZEROCOPY_MIN_BYTES */
+  static void enable_zerocopy(size_t min_bytes) { zerocopyMin = min_bytes; }
+  /**
+   * @brief Write to the viewers through io_uring, before the first @ref getInstance.
+   * Falls back to epoll if the kernel does not allow it */
+  static void enable_uring() { useUring = true; }
+
+  uint64_t sent_bytes(int stream) const { return bytes_sent[stream]; }
+  //! @brief true if at least one viewer receives the stream, otherwise there is no need to encode it
+  bool     watched(int stream) const { return watchers[stream] > 0; }
+  //! @brief packets of the stream not written yet to the least loaded viewer, see THROTTLE_QUEUE_PACKETS
+  int      queue_depth(int stream) const { return depth[stream] + posted[stream]; }
+  void     requested_size(int &width, int &height) {
+    std::unique_lock<std::mutex> lock(sizeLock);
+    sizeReady.wait(lock, [this]() { return firstViewer; });
+    width  = requestW;
+    height = requestH;
+  }
 
+  linkSample link_sample(int stream) const;
+  bool       keyframe_due(int stream) const;
+  bool take_keyframe_request(int stream);
   int  send_frame(videoThreadParams *video_param);
+  int  send_packet(AVPacket *pkt, packet_header_t header);
   void encode_send(videoThreadParams *video_param);
+  void print_stats(FILE *out) const;
 };
@@ -0,0 +1,53 @@
+#pragma once
+#include <SDL.h>
+
+#include <cstdint>
+#include <map>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+}
+
+#include "frameRenderer.hpp"
+
+/**
+ * @brief Client present stage on the SDL renderer: decoder planes straight into streaming textures
+ *
+ * yuv420p frames are uploaded to an IYUV texture and nv12 frames to an NV12
+ * texture, at the stream size: the renderer converts the color and scales to
+ * the window, on the GPU or in the software renderer. Other formats, such as
+ * the yuv444p of the High 4:4:4 streams, fall back to an RGB32 conversion on
+ * the cpu into an ARGB8888 texture, still at the stream size.
+ *
+ * The renderer is not thread safe: every call comes from the present thread. */
+class texturePresenter {
+ public:
+  explicit texturePresenter(SDL_Renderer *renderer);
+  ~texturePresenter();
+  texturePresenter(const texturePresenter &)            = delete;
+  texturePresenter &operator=(const texturePresenter &) = delete;
+
+  void upload(int tile, const AVFrame *frame);
+  void draw(int tile, const SDL_FRect &dst);
+  void overlay(uint32_t hash, const uint32_t *argb, int width, int height, const SDL_Rect &dst);
+  void present();
+
+  uint64_t fallbacks() const { return nFallbacks; }
+
+ private:
+  /**
+   * @brief streaming texture of one tile and the frames it was created for */
+  struct tileTexture {
+    SDL_Texture  *texture = NULL;
+    int           width = 0, height = 0;
+    AVPixelFormat format = AV_PIX_FMT_NONE;
+  };
+
+  SDL_Renderer              *renderer;
+  frameRenderer              converter{0};  //!< RGB32 fallback, one scaler per tile
+  std::map<int, tileTexture> tiles;
+  SDL_Texture               *cursor     = NULL;
+  uint32_t                   cursorHash = 0;
+  uint64_t                   nFallbacks = 0;  //!< frames converted on the cpu
+};
@@ -0,0 +1,119 @@
+#pragma once
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "protocol.hpp"
+
+//! @brief a gap shorter than this is taken for reordering, no NACK yet
+#define UDP_REORDER_MS 3
+//! @brief time between two NACKs of the same datagram
+#define UDP_NACK_INTERVAL_MS 40
+//! @brief NACKs sent for one datagram before waiting for the recovery timeout
+#define UDP_NACK_RETRIES 3
+//! @brief a datagram still missing after this long is lost, the stream waits for a keyframe
+#define UDP_RECOVERY_MS 250
+//! @brief time between two subscriptions, the server forgets a silent peer
+#define UDP_KEEPALIVE_MS 1000
+//! @brief time between two keyframe requests of the same stream
+#define UDP_KEYFRAME_RETRY_MS 500
+//! @brief nothing received for this long, the server is gone
+#define UDP_SERVER_TIMEOUT_MS 10000
+
+/**
+ * @brief Impairment applied to the received datagrams, to test recovery on loopback
+ *
+ * Each datagram is dropped with probability loss_percent, the others are
+ * held for delay_ms plus a uniform 0..jitter_ms, which also reorders them. */
+struct lossInjector {
+  double       loss_percent = 0;
+  int          delay_ms     = 0;
+  int          jitter_ms    = 0;
+  std::mt19937 rng{1};
+
+  bool enabled() const { return loss_percent > 0 || delay_ms > 0 || jitter_ms > 0; }
+  bool drop() { return loss_percent > 0 && std::uniform_real_distribution<double>(0, 100)(rng) < loss_percent; }
+  uint64_t delay_us() {
+    uint64_t jitter = jitter_ms > 0 ? std::uniform_int_distribution<int>(0, jitter_ms * 1000)(rng) : 0;
+    return (uint64_t)delay_ms * 1000 + jitter;
+  }
+};
+
+/**
+ * @brief Client side of the UDP transport, gives back the video packets in order
+ *
+ * Datagrams are kept by sequence until their packet is complete. A gap in
+ * the sequence is NACKed after UDP_REORDER_MS, then every
+ * UDP_NACK_INTERVAL_MS, and repaired from a fec datagram when it is the only
+ * one missing in its group. When a datagram is still missing after
+ * UDP_RECOVERY_MS the packets up to it are dropped and the stream waits for
+ * the keyframe it asks the server for: the frames in between would not
+ * decode. */
+class udpReceiver {
+ public:
+  udpReceiver(const std::string &ip, uint16_t port, const char *request, const lossInjector &injector);
+
+  bool receive(packet_header_t &header, AVPacket *pkt);
+  void print_stats(FILE *out) const;
+
+ private:
+  struct missing {
+    uint64_t since_us;
+    uint64_t nacked_us = 0;
+    int      nacks     = 0;
+  };
+
+  /**
+   * @brief reassembly state of one stream, sequences are unwrapped to 64 bit */
+  struct stream {
+    bool                                      started = false;
+    bool                                      waitKey = true;
+    uint64_t                                  next    = 0;  //!< first sequence not given back yet
+    uint64_t                                  highest = 0;
+    std::map<uint64_t, std::vector<uint8_t>>  datagrams;
+    std::map<uint64_t, missing>               gaps;
+    std::map<uint64_t, std::vector<uint8_t>>  fec;  //!< parity by first sequence, its size is in fecCount
+    std::map<uint64_t, int>                   fecCount;
+    uint64_t                                  keyframe_asked_us = 0;
+
+    uint64_t unwrap(uint32_t sequence) const { return highest + (int32_t)(sequence - (uint32_t)highest); }
+  };
+
+  boost::asio::io_context        io;
+  boost::asio::ip::udp::socket   socket;
+  boost::asio::ip::udp::endpoint server;
+  std::string                    request;
+  lossInjector                   injector;
+
+  stream                                        streams[MAX_OUTPUTS];
+  std::multimap<uint64_t, std::vector<uint8_t>> delayed;  //!< held by the injector, by release time
+  uint64_t                                      subscribed_us = 0;
+  uint64_t                                      last_rx_us    = 0;
+  int                                           nextStream    = 0;
+
+  uint64_t datagrams       = 0;
+  uint64_t duplicates      = 0;  //!< already received or given up, usually a late retransmission
+  uint64_t nacks           = 0;  //!< sequences asked again
+  uint64_t fec_repaired    = 0;
+  uint64_t gaps_lost       = 0;  //!< datagrams given up after UDP_RECOVERY_MS
+  uint64_t packets_skipped = 0;  //!< complete packets dropped while waiting for a keyframe
+  uint64_t keyframes_asked = 0;
+  uint64_t injected_drops  = 0;
+
+  void send_control(datagram_type_t type, int s, const uint8_t *payload, size_t size);
+  void process(const uint8_t *data, size_t size, uint64_t now);
+  void extend(stream &st, uint64_t sequence, uint64_t now);
+  void add_data(stream &st, uint64_t sequence, const uint8_t *data, size_t size, uint64_t now);
+  void repair(stream &st, int s, uint64_t now);
+  void recover(stream &st, int s, uint64_t now);
+  bool deliver(stream &st, packet_header_t &header, AVPacket *pkt);
+  void wait(uint64_t now);
+};
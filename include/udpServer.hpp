@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <vector>
+
+#include "protocol.hpp"
+
+class tcpServerAV;
+struct sharedPacket;
+
+//! @brief data datagrams of each stream kept for retransmission
+#define UDP_HISTORY_DATAGRAMS 2048
+//! @brief a peer that sent nothing for this long, not even its keep-alive, is forgotten
+#define UDP_PEER_TIMEOUT_MS 5000
+
+/**
+ * @brief UDP side of the video server, on the network thread of tcpServerAV
+ *
+ * A peer subscribes with the same text request as a TCP viewer, in a
+ * DATAGRAM_SUBSCRIBE repeated as a keep-alive. Every packet handed to the
+ * TCP viewers is also cut in datagrams and sent once to each peer of its
+ * stream, with a fec datagram every fec_group data datagrams if enabled.
+ * There is no queue: a datagram the kernel can not take is lost like one
+ * on the link. Lost datagrams come back in a NACK and are sent again from
+ * the history, a DATAGRAM_KEYFRAME asks the encoder for a keyframe. */
+class udpServerAV {
+ public:
+  udpServerAV(tcpServerAV &server, boost::asio::io_context &io, int port, int fec_group);
+
+  void send(const sharedPacket &packet);
+  void print_stats(FILE *out) const;
+
+ private:
+  struct peer {
+    boost::asio::ip::udp::endpoint endpoint;
+    int                            subscription;
+    uint64_t                       last_us;  //!< last datagram received from the peer
+  };
+
+  /**
+   * @brief last UDP_HISTORY_DATAGRAMS data datagrams of a stream, by sequence */
+  struct history {
+    std::vector<std::vector<uint8_t>> datagrams;
+    std::vector<uint32_t>             sequences;
+    uint32_t                          next = 0;  //!< sequence of the next data datagram
+  };
+
+  /**
+   * @brief fec datagram being built for a stream */
+  struct fecGroup {
+    std::vector<uint8_t> parity;
+    uint32_t             first = 0;
+    int                  count = 0;
+  };
+
+  tcpServerAV                   &server;
+  boost::asio::ip::udp::socket   socket;
+  boost::asio::steady_timer      expireTimer;
+  boost::asio::ip::udp::endpoint sender;
+  std::vector<uint8_t>           received;
+  int                            fecGroupSize;
+
+  std::list<peer> peers;
+  history         sent[MAX_OUTPUTS];
+  fecGroup        fec[MAX_OUTPUTS];
+
+  std::atomic<uint64_t> datagrams_sent{0};
+  std::atomic<uint64_t> datagrams_dropped{0};  //!< the kernel send buffer was full
+  std::atomic<uint64_t> fec_sent{0};
+  std::atomic<uint64_t> retransmitted{0};
+  std::atomic<uint64_t> nacks_late{0};  //!< asked for datagrams already out of the history
+  std::atomic<uint64_t> keyframes_asked{0};
+  std::atomic<int>      nPeers{0};
+
+  void receive();
+  void handle(size_t size);
+  void expire();
+  void broadcast(int stream, const uint8_t *datagram, size_t size);
+  void send_to(const boost::asio::ip::udp::endpoint &to, const uint8_t *datagram, size_t size);
+  void flush_fec(int stream);
+  peer *find(const boost::asio::ip::udp::endpoint &endpoint);
+};
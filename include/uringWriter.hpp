@@ -0,0 +1,91 @@
+#pragma once
+#include <linux/io_uring.h>
+
+#include <atomic>
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+//! @brief submission queue entries, the completion queue is twice as large
+#define URING_ENTRIES 256
+//! @brief slots of the registered packet pool
+#define URING_POOL_SLOTS 64
+//! @brief header and payload that fit in a slot are written from the pool, the others from the packet
+#define URING_SLOT_BYTES (256 * 1024)
+
+/**
+ * @brief Socket writes batched over io_uring, for the network thread of tcpServerAV
+ *
+ * @ref write only fills a submission queue entry, @ref submit hands every
+ * queued entry to the kernel in a single io_uring_enter: the server queues
+ * a packet for all its viewers, then submits once. A write may be linked to
+ * the next one, which then starts only once it completed in full.
+ *
+ * Packets copied in a slot of the pool are written with IORING_OP_WRITE_FIXED
+ * from memory registered once, the kernel does not map the pages of each
+ * write. The completion queue is signaled on an eventfd waited on by the
+ * io_context, completions go to the callback given to the constructor. The
+ * ring is used through the raw system calls, there is no liburing. */
+class uringWriter {
+ public:
+  //! @brief user_data given to @ref write and its result, bytes written or -errno
+  typedef std::function<void(uint64_t user_data, int res)> completion;
+
+  uringWriter(boost::asio::io_context &io, completion done);
+  ~uringWriter();
+  uringWriter(const uringWriter &)            = delete;
+  uringWriter &operator=(const uringWriter &) = delete;
+
+  static bool available();
+
+  int      acquire(size_t size);
+  void     release(int slot);
+  uint8_t *slot_data(int slot) { return pool + (size_t)slot * URING_SLOT_BYTES; }
+
+  void write(int fd, const uint8_t *data, size_t size, int slot, bool link, uint64_t user_data);
+  void submit();
+  void print_stats(FILE *out) const;
+
+ private:
+  int      ringFd = -1;
+  uint8_t *sqRing = NULL;
+  uint8_t *cqRing = NULL;
+  size_t   sqRingSize;
+  size_t   cqRingSize;
+
+  // Shared with the kernel
+  unsigned      *sqHead;
+  unsigned      *sqTail;
+  unsigned      *sqMask;
+  unsigned      *sqArray;
+  io_uring_sqe  *sqes;
+  size_t         sqesSize;
+  unsigned      *cqHead;
+  unsigned      *cqTail;
+  unsigned      *cqMask;
+  io_uring_cqe  *cqes;
+  unsigned       queued = 0;      //!< entries filled since the last submit
+  bool           linked = false;  //!< the last entry is linked, its room was made with the previous one
+
+  boost::asio::posix::stream_descriptor event;
+  uint64_t                              eventCount;
+  completion                            done;
+
+  uint8_t         *pool  = NULL;
+  bool             fixed = false;  //!< the pool is registered, slots are written with WRITE_FIXED
+  std::mutex       poolLock;       //!< slots are taken by the encoder threads, given back by the network thread
+  std::vector<int> freeSlots;
+
+  std::atomic<uint64_t> submits{0};
+  std::atomic<uint64_t> entries{0};
+  std::atomic<uint64_t> fixed_writes{0};
+  std::atomic<uint64_t> pool_misses{0};  //!< packets too large or pool empty, written from the packet
+
+  void          make_room(unsigned count);
+  io_uring_sqe *next_sqe();
+  void          wait_completions();
+  unsigned      reap();
+};
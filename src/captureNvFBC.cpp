@@ -0,0 +1,319 @@
+#include "../include/captureNvFBC.hpp"
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <iostream>
+
+/**
+ * @brief Load the NvFBC library, create a capture session and set it up
+ * @param[in] config capture parameters
+ * @return false if any NvFBC step failed, the error is printed on stderr
+ *
+ * Runs on the main thread, which releases the FBC context at the end so the
+ * capture thread can bind it */
+bool captureNvFBC::init(const captureConfig &config) {
+  PNVFBCCREATEINSTANCE NvFBCCreateInstance_ptr = NULL;
+
+  NVFBCSTATUS fbcStatus;
+
+  NVFBC_CREATE_HANDLE_PARAMS          createHandleParams;
+  NVFBC_GET_STATUS_PARAMS             statusParams;
+  NVFBC_CREATE_CAPTURE_SESSION_PARAMS createCaptureParams;
+  NVFBC_TOSYS_SETUP_PARAMS            setupParams;
+  NVFBC_RELEASE_CONTEXT_PARAMS        releaseParams;
+
+  cfg = config;
+
+  if (cfg.format != AV_PIX_FMT_YUV444P && cfg.format != AV_PIX_FMT_NV12) {
+    fprintf(stderr, "NvFBC can only capture to YUV444P or NV12\n");
+    return false;
+  }
+
+  /*
+   * Dynamically load the NvFBC library.
+   */
+  libNVFBC = dlopen(LIB_NVFBC_NAME, RTLD_NOW);
+  if (libNVFBC == NULL) {
+    fprintf(stderr, "Unable to open '%s'\n", LIB_NVFBC_NAME);
+    return false;
+  }
+
+  /*
+   * Resolve the 'NvFBCCreateInstance' symbol that will allow us to get
+   * the API function pointers.
+   */
+  NvFBCCreateInstance_ptr = (PNVFBCCREATEINSTANCE)dlsym(libNVFBC, "NvFBCCreateInstance");
+  if (NvFBCCreateInstance_ptr == NULL) {
+    fprintf(stderr, "Unable to resolve symbol 'NvFBCCreateInstance'\n");
+    return false;
+  }
+
+  /*
+   * Create an NvFBC instance.
+   *
+   * API function pointers are accessible through pFn.
+   */
+  memset(&pFn, 0, sizeof(pFn));
+
+  pFn.dwVersion = NVFBC_VERSION;
+
+  fbcStatus = NvFBCCreateInstance_ptr(&pFn);
+  if (fbcStatus != NVFBC_SUCCESS) {
+    fprintf(stderr, "Unable to create NvFBC instance (status: %d)\n", fbcStatus);
+    return false;
+  }
+
+  /*
+   * Create a session handle that is used to identify the client.
+   */
+  memset(&createHandleParams, 0, sizeof(createHandleParams));
+
+  createHandleParams.dwVersion = NVFBC_CREATE_HANDLE_PARAMS_VER;
+
+  fbcStatus = pFn.nvFBCCreateHandle(&fbcHandle, &createHandleParams);
+  if (fbcStatus != NVFBC_SUCCESS) {
+    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
+    return false;
+  }
+  handleCreated = true;
+
+  /*
+   * Get information about the state of the display driver.
+   *
+   * This call is optional but helps the application decide what it should
+   * do.
+   */
+  memset(&statusParams, 0, sizeof(statusParams));
+
+  statusParams.dwVersion = NVFBC_GET_STATUS_PARAMS_VER;
+
+  fbcStatus = pFn.nvFBCGetStatus(fbcHandle, &statusParams);
+  if (fbcStatus != NVFBC_SUCCESS) {
+    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
+    return false;
+  }
+
+  if (statusParams.bCanCreateNow == NVFBC_FALSE) {
+    fprintf(stderr,
+            "It is not possible to create a capture session "
+            "on this system.\n");
+    return false;
+  }
+
+  auto display = [statusParams](std::ostream &os) {
+    os << "Name of connected display\n";
+    for (uint32_t i = 0; i < statusParams.dwOutputNum; i++) {
+      os << "Display: " << statusParams.outputs[i].name << "    \tid: " << i << std::endl;
+    }
+  };
+  if (cfg.output == 0) display(std::cout);
+
+  outputCount = statusParams.dwOutputNum;
+  if (cfg.output < 0 || cfg.output >= outputCount) {
+    fprintf(stderr, "Output %d does not exist, %d outputs are connected\n", cfg.output, outputCount);
+    return false;
+  }
+
+  memset(&createCaptureParams, 0, sizeof(createCaptureParams));
+
+  createCaptureParams.dwVersion        = NVFBC_CREATE_CAPTURE_SESSION_PARAMS_VER;
+  createCaptureParams.eCaptureType     = NVFBC_CAPTURE_TO_SYS;
+  createCaptureParams.bWithCursor      = cfg.with_cursor ? NVFBC_TRUE : NVFBC_FALSE;
+  createCaptureParams.frameSize.w      = cfg.width;  // 0 keeps the output size
+  createCaptureParams.frameSize.h      = cfg.height;
+  createCaptureParams.eTrackingType    = NVFBC_TRACKING_OUTPUT;
+  createCaptureParams.dwOutputId       = statusParams.outputs[cfg.output].dwId;
+  trackedBox                           = statusParams.outputs[cfg.output].trackedBox;
+  createCaptureParams.dwSamplingRateMs = cfg.sampling_ms;
+  createCaptureParams.bPushModel       = cfg.push_model ? NVFBC_TRUE : NVFBC_FALSE;
+
+  fbcStatus = pFn.nvFBCCreateCaptureSession(fbcHandle, &createCaptureParams);
+  if (fbcStatus != NVFBC_SUCCESS) {
+    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
+    return false;
+  }
+  sessionCreated = true;
+
+  /*
+   * Set up the capture session.
+   *
+   * The ppBuffer structure member will be allocated of the proper size by
+   * the NvFBC library.
+   */
+  memset(&setupParams, 0, sizeof(setupParams));
+
+  setupParams.dwVersion     = NVFBC_TOSYS_SETUP_PARAMS_VER;
+  setupParams.eBufferFormat = cfg.format == AV_PIX_FMT_NV12 ? NVFBC_BUFFER_FORMAT_NV12 : NVFBC_BUFFER_FORMAT_YUV444P;
+  setupParams.ppBuffer      = (void **)&frame;
+  setupParams.bWithDiffMap  = NVFBC_FALSE;
+
+  fbcStatus = pFn.nvFBCToSysSetUp(fbcHandle, &setupParams);
+  if (fbcStatus != NVFBC_SUCCESS) {
+    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
+    return false;
+  }
+
+  /*
+   * The main thread is about to hand work over the worker thread,
+   * release the FBC context.
+   */
+  memset(&releaseParams, 0, sizeof(releaseParams));
+
+  releaseParams.dwVersion = NVFBC_RELEASE_CONTEXT_PARAMS_VER;
+
+  fbcStatus = pFn.nvFBCReleaseContext(fbcHandle, &releaseParams);
+  if (fbcStatus != NVFBC_SUCCESS) {
+    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * @brief Bind the FBC context to the calling thread */
+bool captureNvFBC::bind() {
+  NVFBCSTATUS               fbcStatus;
+  NVFBC_BIND_CONTEXT_PARAMS bindParams;
+
+  memset(&bindParams, 0, sizeof(bindParams));
+  bindParams.dwVersion = NVFBC_BIND_CONTEXT_PARAMS_VER;
+
+  fbcStatus = pFn.nvFBCBindContext(fbcHandle, &bindParams);
+  if (fbcStatus != NVFBC_SUCCESS) {
+    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Release the FBC context from the calling thread */
+void captureNvFBC::release() {
+  NVFBCSTATUS                  fbcStatus;
+  NVFBC_RELEASE_CONTEXT_PARAMS releaseParams;
+
+  memset(&releaseParams, 0, sizeof(releaseParams));
+
+  releaseParams.dwVersion = NVFBC_RELEASE_CONTEXT_PARAMS_VER;
+
+  fbcStatus = pFn.nvFBCReleaseContext(fbcHandle, &releaseParams);
+  if (fbcStatus != NVFBC_SUCCESS) fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
+}
+
+/**
+ * @brief Grab one frame into the NvFBC system buffer
+ * @param[out] out planes of the YUV444P or NV12 buffer and grab information
+ * @return false if the grab failed */
+bool captureNvFBC::grab(captureFrame &out) {
+  NVFBCSTATUS                   fbcStatus;
+  NVFBC_TOSYS_GRAB_FRAME_PARAMS grabParams;
+  NVFBC_FRAME_GRAB_INFO         frameInfo;
+
+  memset(&grabParams, 0, sizeof(grabParams));
+  memset(&frameInfo, 0, sizeof(frameInfo));
+
+  grabParams.dwVersion = NVFBC_TOSYS_GRAB_FRAME_PARAMS_VER;
+
+  /*
+   * Use blocking calls.
+   *
+   * The application will wait for new frames.  New frames are generated
+   * when the mouse cursor moves or when the screen if refreshed.
+   */
+  grabParams.dwFlags     = cfg.force_refresh ? NVFBC_TOSYS_GRAB_FLAGS_FORCE_REFRESH : NVFBC_TOSYS_GRAB_FLAGS_NOFLAGS;
+  grabParams.dwTimeoutMs = cfg.timeout_ms;
+
+  /*
+   * In push model do not wait if the display server already produced a
+   * frame we have not seen yet.
+   */
+  if (cfg.push_model) grabParams.dwFlags = NVFBC_TOSYS_GRAB_FLAGS_NOWAIT_IF_NEW_FRAME_READY;
+
+  /*
+   * This structure will contain information about the captured frame.
+   */
+  grabParams.pFrameGrabInfo = &frameInfo;
+
+  /*
+   * Capture a new frame.
+   */
+  fbcStatus = pFn.nvFBCToSysGrabFrame(fbcHandle, &grabParams);
+  if (fbcStatus != NVFBC_SUCCESS) {
+    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
+    return false;
+  }
+
+  // Planes are packed one after the other, NV12 has a single interleaved
+  // half height UV plane after the luma. At native size the frame follows
+  // mode changes and NvFBC reallocates the buffer
+  size_t plane = (size_t)frameInfo.dwWidth * frameInfo.dwHeight;
+  int    count = cfg.format == AV_PIX_FMT_NV12 ? 2 : 3;
+  for (int i = 0; i < count; i++) {
+    out.data[i]     = frame + i * plane;
+    out.linesize[i] = frameInfo.dwWidth;
+  }
+  out.width        = frameInfo.dwWidth;
+  out.height       = frameInfo.dwHeight;
+  out.byte_size    = frameInfo.dwByteSize;
+  out.is_new       = frameInfo.bIsNewFrame == NVFBC_TRUE;
+  // NvFBC stamps the frames on its own clock, brought to CLOCK_MONOTONIC by the
+  // offset seen at the first grab, which the grab returned right after
+  if (!timestampBase) {
+    timestampOffsetUs = (int64_t)monotonic_us() - (int64_t)frameInfo.ulTimestampUs;
+    timestampBase     = true;
+  }
+  int64_t stamp    = (int64_t)frameInfo.ulTimestampUs + timestampOffsetUs;
+  out.timestamp_us = stamp > 0 ? stamp : 0;
+
+  return true;
+}
+
+captureNvFBC::~captureNvFBC() {
+  NVFBCSTATUS                          fbcStatus;
+  NVFBC_BIND_CONTEXT_PARAMS            bindParams;
+  NVFBC_DESTROY_CAPTURE_SESSION_PARAMS destroyCaptureParams;
+  NVFBC_DESTROY_HANDLE_PARAMS          destroyHandleParams;
+
+  if (!handleCreated) return;
+
+  /*
+   * The main thread takes back the FBC context.
+   */
+  memset(&bindParams, 0, sizeof(bindParams));
+
+  bindParams.dwVersion = NVFBC_BIND_CONTEXT_PARAMS_VER;
+
+  fbcStatus = pFn.nvFBCBindContext(fbcHandle, &bindParams);
+  if (fbcStatus != NVFBC_SUCCESS) {
+    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
+    return;
+  }
+
+  /*
+   * Destroy capture session, tear down resources.
+   */
+  if (sessionCreated) {
+    memset(&destroyCaptureParams, 0, sizeof(destroyCaptureParams));
+
+    destroyCaptureParams.dwVersion = NVFBC_DESTROY_CAPTURE_SESSION_PARAMS_VER;
+
+    fbcStatus = pFn.nvFBCDestroyCaptureSession(fbcHandle, &destroyCaptureParams);
+    if (fbcStatus != NVFBC_SUCCESS) {
+      fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
+      return;
+    }
+  }
+
+  /*
+   * Destroy session handle, tear down more resources.
+   */
+  memset(&destroyHandleParams, 0, sizeof(destroyHandleParams));
+
+  destroyHandleParams.dwVersion = NVFBC_DESTROY_HANDLE_PARAMS_VER;
+
+  fbcStatus = pFn.nvFBCDestroyHandle(fbcHandle, &destroyHandleParams);
+  if (fbcStatus != NVFBC_SUCCESS) fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
+}
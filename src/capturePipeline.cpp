@@ -0,0 +1,212 @@
+#include "../include/capturePipeline.hpp"
+
+#include <boost/thread/thread.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+}
+
+#include "../include/rateController.hpp"
+#include "../include/tcpServer.hpp"
+
+static std::vector<AVFrame *> alloc_frames(AVCodecContext *ctx, size_t n) {
+  std::vector<AVFrame *> v(n + 1);
+  for (auto &f : v) {
+    f         = av_frame_alloc();
+    f->width  = ctx->width;
+    f->height = ctx->height;
+    f->format = ctx->pix_fmt;
+    if (av_frame_get_buffer(f, 0) < 0) {
+      fprintf(stderr, "Could not allocate the pipeline frame slots\n");
+      exit(1);
+    }
+  }
+  return v;
+}
+
+static std::vector<AVPacket *> alloc_packets(size_t n) {
+  std::vector<AVPacket *> v(n + 1);
+  for (auto &p : v) p = av_packet_alloc();
+  return v;
+}
+
+capturePipeline::capturePipeline(AVCodecContext *ctx, const config &cfg)
+    : ctx(ctx),
+      cfg(cfg),
+      frames(alloc_frames(ctx, cfg.frame_slots + (cfg.policy == ringPolicy::DROP_OLDEST ? 1 : 0)), cfg.policy),
+      packets(alloc_packets(cfg.packet_slots)) {}
+
+capturePipeline::~capturePipeline() {
+  stop();
+  for (AVFrame *f : frames.storage()) av_frame_free(&f);
+  for (AVPacket *p : packets.storage()) av_packet_free(&p);
+}
+
+void capturePipeline::start() {
+  running  = true;
+  encoding = true;
+  boost::thread(&capturePipeline::encode_loop, this).swap(th_encode);
+  boost::thread(&capturePipeline::send_loop, this).swap(th_send);
+}
+
+/**
+ * @brief Stop the encoder and network threads once the rings are drained */
+void capturePipeline::stop() {
+  if (!running.exchange(false)) return;
+  signal(framesChanged);
+  th_encode.join();
+  th_send.join();
+}
+
+/**
+ * @brief Sleep until ready() holds, it is checked again on every @ref signal of changed */
+template <typename F>
+void capturePipeline::wait(std::condition_variable &changed, F ready) {
+  std::unique_lock<std::mutex> guard(wakeLock);
+  changed.wait(guard, ready);
+}
+
+/**
+ * @brief Wake the stages waiting on a ring, after the ring changed
+ *
+ * Taking the lock orders the change before a waiter that checked its
+ * condition and is about to sleep, the wakeup is not lost */
+void capturePipeline::signal(std::condition_variable &changed) {
+  { std::lock_guard<std::mutex> guard(wakeLock); }
+  changed.notify_all();
+}
+
+/**
+ * @brief Hand the filled capture slot to the encoder thread
+ * @return false if the oldest frame was evicted because the encoder is behind
+ *
+ * With ringPolicy::BLOCK the capture thread waits for a free slot, with
+ * ringPolicy::DROP_OLDEST it never waits: a full ring loses its oldest frame
+ * and the encoder takes the newest one, skipping the others */
+bool capturePipeline::publish() {
+  bool kept = true;
+  if (cfg.policy == ringPolicy::DROP_OLDEST) {
+    kept = frames.push_evict();
+  } else {
+    while (!frames.push()) {
+      capture_waits++;
+      wait(framesChanged, [this]() { return frames.size() < frames.capacity(); });
+    }
+  }
+  signal(framesChanged);
+  return kept;
+}
+
+/**
+ * @brief New bitrate and VBV buffer, applied by the encoder thread before its next frame
+ * @param[in] bit_rate, buffer_size see rateController::apply */
+void capturePipeline::set_rate(int64_t bit_rate, int buffer_size) {
+  bufferSize = buffer_size;
+  bitRate    = bit_rate;
+}
+
+/**
+ * @brief Encoder stage: frame ring -> avcodec -> packet ring */
+void capturePipeline::encode_loop() {
+  tcpServerAV *server = tcpServerAV::getInstance();
+  int64_t      pts    = 0;
+
+  while (running || frames.size()) {
+    // The newest frame is kept by the encoder, the older ones are skipped
+    AVFrame **slot = cfg.policy == ringPolicy::DROP_OLDEST ? frames.take_newest() : frames.read_slot();
+    if (slot == nullptr) {
+      encode_idle++;
+      wait(framesChanged, [this]() { return frames.size() || !running; });
+      continue;
+    }
+
+    int64_t rate = bitRate.exchange(0);
+    if (rate) rateController::apply(ctx, rate, bufferSize);
+
+    (*slot)->pts       = pts++;
+    (*slot)->pict_type = server->take_keyframe_request(cfg.stream) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    uint64_t start = latencyHistogram::now_us();
+    timing.sent(*slot, start);
+    int ret = avcodec_send_frame(ctx, *slot);
+    if (ret < 0) {
+      fprintf(stderr, "Error sending a frame for encoding\n");
+      exit(1);
+    }
+    cfg.send_frame->record(latencyHistogram::now_us() - start);
+
+    while (ret >= 0) {
+      start = latencyHistogram::now_us();
+      ret   = avcodec_receive_packet(ctx, packets.write_slot());
+      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+        break;
+      else if (ret < 0) {
+        fprintf(stderr, "Error during encoding\n");
+        exit(1);
+      }
+      uint64_t now = latencyHistogram::now_us();
+      cfg.receive_packet->record(now - start);
+      timing.received(packets.write_slot(), now);
+
+      // Encoded packets are never dropped, P-frames depend on each other
+      while (!packets.push()) {
+        encode_waits++;
+        wait(packetsChanged, [this]() { return packets.size() < packets.capacity(); });
+      }
+      signal(packetsChanged);
+    }
+
+    // libx264 copies the picture on input, the slot can be refilled
+    if (cfg.policy == ringPolicy::BLOCK) {
+      frames.pop();
+      signal(framesChanged);
+    }
+  }
+
+  encoding = false;
+  signal(packetsChanged);
+}
+
+/**
+ * @brief Network stage: packet ring -> tcpServerAV */
+void capturePipeline::send_loop() {
+  tcpServerAV *server = tcpServerAV::getInstance();
+
+  while (encoding || packets.size()) {
+    AVPacket **slot = packets.read_slot();
+    if (slot == nullptr) {
+      send_idle++;
+      wait(packetsChanged, [this]() { return packets.size() || !encoding; });
+      continue;
+    }
+
+    packet_header_t header;
+    header.stream = cfg.stream;
+    header.width  = ctx->width;
+    header.height = ctx->height;
+    timing.fill(*slot, header);
+    server->send_packet(*slot, header);
+    av_packet_unref(*slot);
+    packets.pop();
+    signal(packetsChanged);
+  }
+}
+
+/**
+ * @brief Print ring occupancy and stall counters for every stage
+ *
+ * A full frame ring or many capture waits point at the encoder, a full packet
+ * ring or many encode waits point at the network */
+void capturePipeline::print_stats(FILE *out) const {
+  auto f = frames.stats();
+  auto p = packets.stats();
+
+  fprintf(out, "pipeline: frames  %lu in, %lu dropped, %lu full, occupancy avg %.2f max %lu/%zu, capture waits %lu\n",
+          f.pushed, f.dropped, f.full, f.avg_occupancy, f.max_occupancy, frames.capacity(), capture_waits.load());
+  fprintf(out, "pipeline: packets %lu in, %lu full, occupancy avg %.2f max %lu/%zu, encode waits %lu\n", p.pushed,
+          p.full, p.avg_occupancy, p.max_occupancy, packets.capacity(), encode_waits.load());
+  fprintf(out, "pipeline: idle waits encoder %lu, network %lu\n", encode_idle.load(), send_idle.load());
+}
@@ -0,0 +1,188 @@
+#include "../include/captureSynthetic.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#define TEXT_LINE 16
+#define SCROLL_STEP 4
+#define BLINK_MS 530
+
+static const char *scenarioNames[] = {"scroll", "drag", "noise", "cursor", "static"};
+
+/**
+ * @param[in] scenario content to generate
+ * @param[in] fps rate at which @ref grab returns frames
+ * @param[in] pool number of pre-rendered frames, animated scenarios loop over them */
+captureSynthetic::captureSynthetic(syntheticScenario scenario, int fps, int pool)
+    : scenario(scenario), fps(fps > 0 ? fps : 60), poolSize(pool > 0 ? pool : SYNTHETIC_POOL) {}
+
+bool captureSynthetic::parse_scenario(const char *name, syntheticScenario &out) {
+  for (int i = 0; i <= SCENARIO_STATIC; i++) {
+    if (strcmp(name, scenarioNames[i]) == 0) {
+      out = (syntheticScenario)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Allocate the pool and render every frame of the scenario
+ * @return false if the pixel format is not supported */
+bool captureSynthetic::init(const captureConfig &config) {
+  cfg = config;
+  if (cfg.width == 0 || cfg.height == 0) {
+    cfg.width  = VSIZEW;
+    cfg.height = VSIZEH;
+  }
+
+  size_t size;
+  if (cfg.format == AV_PIX_FMT_YUV444P) {
+    size = (size_t)cfg.width * cfg.height * 3;
+  } else if (cfg.format == AV_PIX_FMT_NV12) {
+    size = (size_t)cfg.width * cfg.height * 3 / 2;
+  } else {
+    fprintf(stderr, "The synthetic source only produces YUV444P and NV12\n");
+    return false;
+  }
+
+  // Scenarios that never move need a single frame, the cursor two
+  int n = poolSize;
+  if (scenario == SCENARIO_STATIC) n = 1;
+  if (scenario == SCENARIO_CURSOR) n = 2;
+
+  pool.assign(n, std::vector<uint8_t>(size));
+  for (int i = 0; i < n; i++) render(pool[i], i);
+
+  printf("Synthetic %s source: %dx%d %s at %d fps, %d frames (%zu MB) pre-rendered\n", scenarioNames[scenario],
+         cfg.width, cfg.height, cfg.format == AV_PIX_FMT_NV12 ? "nv12" : "yuv444p", fps, n, n * size >> 20);
+  return true;
+}
+
+/**
+ * @brief Fill a rectangle clipped to the frame with one color */
+void captureSynthetic::fill_rect(std::vector<uint8_t> &buf, int x, int y, int w, int h, uint8_t Y, uint8_t U,
+                                 uint8_t V) const {
+  int x0 = std::max(x, 0), x1 = std::min(x + w, cfg.width);
+  int y0 = std::max(y, 0), y1 = std::min(y + h, cfg.height);
+  if (x0 >= x1 || y0 >= y1) return;
+
+  size_t   plane = (size_t)cfg.width * cfg.height;
+  uint8_t *luma  = &buf[0];
+  for (int r = y0; r < y1; r++) memset(&luma[(size_t)r * cfg.width + x0], Y, x1 - x0);
+
+  if (cfg.format == AV_PIX_FMT_YUV444P) {
+    for (int r = y0; r < y1; r++) {
+      memset(&buf[plane + (size_t)r * cfg.width + x0], U, x1 - x0);
+      memset(&buf[2 * plane + (size_t)r * cfg.width + x0], V, x1 - x0);
+    }
+  } else {
+    // NV12: interleaved UV plane at half resolution
+    for (int r = y0 / 2; r < (y1 + 1) / 2; r++) {
+      uint8_t *uv = &buf[plane + (size_t)r * cfg.width];
+      for (int c = x0 / 2; c < (x1 + 1) / 2; c++) {
+        uv[2 * c]     = U;
+        uv[2 * c + 1] = V;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Render frame n of the scenario into buf */
+void captureSynthetic::render(std::vector<uint8_t> &buf, int n) const {
+  // Desktop background
+  fill_rect(buf, 0, 0, cfg.width, cfg.height, 60, 150, 110);
+
+  switch (scenario) {
+    case SCENARIO_NOISE: {
+      uint32_t seed = 0x9e3779b9u * (n + 1);
+      for (uint8_t &px : buf) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        px = 16 + seed % 220;
+      }
+      break;
+    }
+    case SCENARIO_DRAG: {
+      int w = cfg.width / 3, h = cfg.height / 3;
+      int x = (int)((int64_t)(cfg.width - w) * n / poolSize);
+      int y = cfg.height / 4 + (int)((int64_t)cfg.height / 4 * n / poolSize);
+      fill_rect(buf, x, y, w, h, 235, 128, 128);
+      fill_rect(buf, x, y, w, 24, 90, 160, 100);
+      for (int line = 40; line < h - 8; line += TEXT_LINE)
+        fill_rect(buf, x + 12, y + line, (w - 24) * (1 + line % 5) / 6, 8, 40, 128, 128);
+      break;
+    }
+    case SCENARIO_SCROLL:
+    case SCENARIO_CURSOR:
+    case SCENARIO_STATIC: {
+      // Text lines whose length depends on the line number, shifted up as they scroll
+      int offset = scenario == SCENARIO_SCROLL ? n * SCROLL_STEP : 0;
+      fill_rect(buf, 0, 0, cfg.width, cfg.height, 16, 128, 128);
+      for (int y = -(offset % TEXT_LINE); y < cfg.height; y += TEXT_LINE) {
+        uint32_t line = (y + offset) / TEXT_LINE;
+        uint32_t hash = line * 2654435761u;
+        for (int x = 8, word = 0; x < cfg.width - 8 && word < 4 + (int)(hash % 12); word++) {
+          int len = 8 * (2 + (hash >> (word % 24)) % 7);
+          fill_rect(buf, x, y + 4, len, 9, 200, 128, 128);
+          x += len + 8;
+        }
+      }
+      if (scenario == SCENARIO_CURSOR && n == 1) fill_rect(buf, 8, cfg.height - TEXT_LINE + 2, 8, 12, 235, 128, 128);
+      break;
+    }
+  }
+}
+
+/**
+ * @brief Index of the pool frame shown at tick t */
+int captureSynthetic::index_of(uint64_t t) const {
+  switch (scenario) {
+    case SCENARIO_STATIC:
+      return 0;
+    case SCENARIO_CURSOR:
+      return (int)(t * 1000 / fps / BLINK_MS % 2);
+    default:
+      return (int)(t % pool.size());
+  }
+}
+
+void captureSynthetic::planes(std::vector<uint8_t> &buf, captureFrame &out) const {
+  size_t plane = (size_t)cfg.width * cfg.height;
+
+  out.data[0]     = &buf[0];
+  out.linesize[0] = cfg.width;
+  if (cfg.format == AV_PIX_FMT_YUV444P) {
+    out.data[1]     = &buf[plane];
+    out.data[2]     = &buf[2 * plane];
+    out.linesize[1] = out.linesize[2] = cfg.width;
+  } else {
+    out.data[1]     = &buf[plane];
+    out.linesize[1] = cfg.width;
+  }
+  out.width     = cfg.width;
+  out.height    = cfg.height;
+  out.byte_size = buf.size();
+}
+
+/**
+ * @brief Wait for the next frame period and return the matching pool frame */
+bool captureSynthetic::grab(captureFrame &out) {
+  uint64_t now = monotonic_us();
+  if (startUs == 0) startUs = now;
+
+  uint64_t due = startUs + tick * 1000000 / fps;
+  if (due > now) usleep(due - now);
+
+  int index = index_of(tick++);
+  planes(pool[index], out);
+  out.is_new       = index != lastIndex;
+  out.timestamp_us = due;
+  lastIndex        = index;
+  return true;
+}
@@ -0,0 +1,294 @@
+#include "../include/captureX11.hpp"
+
+#include <X11/Xutil.h>
+#include <X11/extensions/Xrandr.h>
+#include <stdio.h>
+#include <sys/ipc.h>
+#include <sys/select.h>
+#include <sys/shm.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Locate the requested output in the root window
+ * @param[in] screen X screen the root window belongs to
+ * @return false if the output does not exist or is smaller than the capture size
+ *
+ * Outputs are the connected RandR outputs driven by a CRTC, in server order.
+ * Without RandR the whole screen is output 0 */
+bool captureX11::find_output(int screen) {
+  int width  = DisplayWidth(display, screen);
+  int height = DisplayHeight(display, screen);
+  int event, error;
+
+  outputCount = 1;
+  if (XRRQueryExtension(display, &event, &error)) {
+    XRRScreenResources *res = XRRGetScreenResourcesCurrent(display, root);
+    int                 n   = 0;
+    for (int i = 0; res && i < res->noutput; i++) {
+      XRROutputInfo *output = XRRGetOutputInfo(display, res, res->outputs[i]);
+      if (output && output->connection == RR_Connected && output->crtc) {
+        if (n == cfg.output) {
+          XRRCrtcInfo *crtc = XRRGetCrtcInfo(display, res, output->crtc);
+          if (crtc) {
+            originX = crtc->x;
+            originY = crtc->y;
+            width   = crtc->width;
+            height  = crtc->height;
+            XRRFreeCrtcInfo(crtc);
+          }
+        }
+        n++;
+      }
+      if (output) XRRFreeOutputInfo(output);
+    }
+    if (res) XRRFreeScreenResources(res);
+    if (n) outputCount = n;
+  }
+
+  if (cfg.output < 0 || cfg.output >= outputCount) {
+    fprintf(stderr, "Output %d does not exist, %d outputs are connected\n", cfg.output, outputCount);
+    return false;
+  }
+  if (cfg.width == 0 || cfg.height == 0) {
+    // Native size, even so NV12 chroma covers whole pixel pairs
+    cfg.width  = width & ~1;
+    cfg.height = height & ~1;
+  }
+  if (width < cfg.width || height < cfg.height) {
+    fprintf(stderr, "Output %d is %dx%d, smaller than the capture size %dx%d\n", cfg.output, width, height,
+            cfg.width, cfg.height);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Open the display, attach the shared segment and start tracking damage
+ * @param[in] config capture parameters, the captured area is the top left
+ * width x height corner of the selected output
+ * @return false if the display, the output or one of the extensions is missing */
+bool captureX11::init(const captureConfig &config) {
+  int fixesEvent, fixesError;
+
+  cfg = config;
+
+  if ((cfg.format != AV_PIX_FMT_YUV444P && cfg.format != AV_PIX_FMT_NV12) || cfg.height % 2) {
+    fprintf(stderr, "The X11 backend converts to YUV444P or NV12 with an even height\n");
+    return false;
+  }
+
+  display = XOpenDisplay(NULL);
+  if (display == NULL) {
+    fprintf(stderr, "Unable to open the X display\n");
+    return false;
+  }
+
+  int screen = DefaultScreen(display);
+  root       = RootWindow(display, screen);
+
+  if (!XShmQueryExtension(display) || !XDamageQueryExtension(display, &damageEvent, &damageError) ||
+      !XFixesQueryExtension(display, &fixesEvent, &fixesError)) {
+    fprintf(stderr, "The X server lacks MIT-SHM, DAMAGE or XFIXES\n");
+    return false;
+  }
+
+  if (!find_output(screen)) return false;
+
+  image = XShmCreateImage(display, DefaultVisual(display, screen), DefaultDepth(display, screen), ZPixmap, NULL,
+                          &shminfo, cfg.width, cfg.height);
+  if (image == NULL || image->bits_per_pixel != 32 || image->red_mask != 0xff0000 || image->blue_mask != 0xff ||
+      image->byte_order != LSBFirst) {
+    fprintf(stderr, "Unsupported X visual, a 32 bpp little endian BGRX root window is required\n");
+    return false;
+  }
+
+  shminfo.shmid = shmget(IPC_PRIVATE, (size_t)image->bytes_per_line * image->height, IPC_CREAT | 0600);
+  if (shminfo.shmid < 0) {
+    perror("shmget");
+    return false;
+  }
+  shminfo.shmaddr = image->data = (char *)shmat(shminfo.shmid, NULL, 0);
+  shminfo.readOnly = False;
+
+  attached = XShmAttach(display, &shminfo);
+  XSync(display, False);
+  // The segment goes away with the last detach
+  shmctl(shminfo.shmid, IPC_RMID, NULL);
+  if (!attached) {
+    fprintf(stderr, "XShmAttach failed\n");
+    return false;
+  }
+
+  damage = XDamageCreate(display, root, XDamageReportNonEmpty);
+  region = XFixesCreateRegion(display, NULL, 0);
+
+  yuv.resize((size_t)cfg.width * cfg.height * (cfg.format == AV_PIX_FMT_NV12 ? 3 : 6) / 2);
+
+  printf("Capturing %dx%d+%d+%d from the X display %s\n", cfg.width, cfg.height, originX, originY,
+         DisplayString(display));
+  return true;
+}
+
+/**
+ * @brief Drain X events until a damage notification arrives
+ * @param[in] deadline_us monotonic deadline, 0 waits forever
+ * @return true if the screen was damaged, false on timeout */
+bool captureX11::wait_damage(uint64_t deadline_us) {
+  for (;;) {
+    while (XPending(display)) {
+      XEvent ev;
+      XNextEvent(display, &ev);
+      if (ev.type == damageEvent + XDamageNotify && damagedSince == 0) damagedSince = monotonic_us();
+    }
+    if (damagedSince) return true;
+
+    struct timeval  tv;
+    struct timeval *timeout = NULL;
+    if (deadline_us) {
+      uint64_t now = monotonic_us();
+      if (now >= deadline_us) return false;
+      tv.tv_sec  = (deadline_us - now) / 1000000;
+      tv.tv_usec = (deadline_us - now) % 1000000;
+      timeout    = &tv;
+    }
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(ConnectionNumber(display), &fds);
+    XFlush(display);
+    select(ConnectionNumber(display) + 1, &fds, NULL, NULL, timeout);
+  }
+}
+
+/**
+ * @brief Read full width rows [top, bottom) into the shared segment and convert them
+ *
+ * XShmGetImage writes at image->data - shmaddr with a stride derived from the
+ * image width, so a band of the full width image lands in place. For NV12
+ * the band is widened to even rows so every chroma sample is complete */
+void captureX11::read_rows(int top, int bottom) {
+  if (cfg.format == AV_PIX_FMT_NV12) {
+    top &= ~1;
+    bottom = (bottom + 1) & ~1;
+  }
+
+  XImage band = *image;
+  band.height = bottom - top;
+  band.data   = image->data + (size_t)top * image->bytes_per_line;
+  XShmGetImage(display, root, &band, originX, originY + top, AllPlanes);
+
+  size_t   plane = (size_t)cfg.width * cfg.height;
+  uint8_t *Y     = &yuv[0];
+  uint8_t *U     = &yuv[plane];
+  uint8_t *V     = &yuv[2 * plane];
+
+  // BT.601 limited range, the encoder default
+  for (int y = top; y < bottom; y++) {
+    const uint8_t *src = (const uint8_t *)image->data + (size_t)y * image->bytes_per_line;
+    size_t         row = (size_t)y * cfg.width;
+    for (int x = 0; x < cfg.width; x++, src += 4) {
+      int b = src[0], g = src[1], r = src[2];
+
+      Y[row + x] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+      if (cfg.format == AV_PIX_FMT_NV12) continue;
+      U[row + x] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+      V[row + x] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+  }
+  if (cfg.format != AV_PIX_FMT_NV12) return;
+
+  // NV12 chroma from the average of every 2x2 block
+  for (int y = top; y < bottom; y += 2) {
+    const uint8_t *s0 = (const uint8_t *)image->data + (size_t)y * image->bytes_per_line;
+    const uint8_t *s1 = s0 + image->bytes_per_line;
+    uint8_t       *uv = &yuv[plane + (size_t)y / 2 * cfg.width];
+    for (int x = 0; x + 1 < cfg.width; x += 2, s0 += 8, s1 += 8) {
+      int b = (s0[0] + s0[4] + s1[0] + s1[4] + 2) >> 2;
+      int g = (s0[1] + s0[5] + s1[1] + s1[5] + 2) >> 2;
+      int r = (s0[2] + s0[6] + s1[2] + s1[6] + 2) >> 2;
+
+      uv[x]     = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+      uv[x + 1] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+  }
+}
+
+/**
+ * @brief Wait for damage, then read back and convert only the damaged rows
+ * @param[out] out YUV444P or NV12 planes and grab information
+ * @return false if the X connection failed */
+bool captureX11::grab(captureFrame &out) {
+  // Outside push model the screen is sampled at most every sampling_ms
+  if (!cfg.push_model && lastGrabUs) {
+    uint64_t next = lastGrabUs + (uint64_t)cfg.sampling_ms * 1000;
+    uint64_t now  = monotonic_us();
+    if (next > now) usleep(next - now);
+  }
+
+  uint64_t deadline = cfg.timeout_ms ? monotonic_us() + (uint64_t)cfg.timeout_ms * 1000 : 0;
+  bool     damaged  = first || wait_damage(deadline);
+  bool     drained  = damaged;
+
+  if (first) {
+    XDamageSubtract(display, damage, None, None);
+    read_rows(0, cfg.height);
+  } else if (damaged) {
+    int n = 0;
+    XDamageSubtract(display, damage, None, region);
+    XRectangle *rects = XFixesFetchRegion(display, region, &n);
+
+    // Damage is reported for the whole root window, keep what hits this output
+    std::vector<std::pair<int, int>> bands;
+    for (int i = 0; i < n; i++) {
+      int top    = std::max<int>(rects[i].y - originY, 0);
+      int bottom = std::min<int>(rects[i].y + rects[i].height - originY, cfg.height);
+      int left   = rects[i].x - originX;
+      int right  = left + rects[i].width;
+      if (top < bottom && left < cfg.width && right > 0) bands.push_back({top, bottom});
+    }
+    if (rects) XFree(rects);
+    damaged = !bands.empty();
+
+    std::sort(bands.begin(), bands.end());
+    for (size_t i = 0; i < bands.size();) {
+      int top = bands[i].first, bottom = bands[i].second;
+      for (i++; i < bands.size() && bands[i].first <= bottom; i++) bottom = std::max(bottom, bands[i].second);
+      read_rows(top, bottom);
+    }
+  }
+
+  size_t plane = (size_t)cfg.width * cfg.height;
+  int    count = cfg.format == AV_PIX_FMT_NV12 ? 2 : 3;
+  for (int i = 0; i < count; i++) {
+    out.data[i]     = &yuv[i * plane];
+    out.linesize[i] = cfg.width;
+  }
+  out.width        = cfg.width;
+  out.height       = cfg.height;
+  out.byte_size    = yuv.size();
+  out.is_new       = damaged;
+  out.timestamp_us = first ? monotonic_us() : damagedSince;
+
+  if (drained) damagedSince = 0;
+  first      = false;
+  lastGrabUs = monotonic_us();
+  return true;
+}
+
+captureX11::~captureX11() {
+  if (display == NULL) return;
+
+  if (region) XFixesDestroyRegion(display, region);
+  if (damage) XDamageDestroy(display, damage);
+  if (attached) XShmDetach(display, &shminfo);
+  if (image) {
+    if (image->data) shmdt(image->data);
+    image->data = NULL;
+    XDestroyImage(image);
+  }
+  XCloseDisplay(display);
+}
@@ -0,0 +1,186 @@
+#include "../include/cursorServer.hpp"
+
+#include <X11/extensions/Xfixes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <array>
+#include <iostream>
+
+/**
+ * @param[in] areas region of the screen shown by every captured stream
+ * @param[in] period_ms pointer polling period */
+cursorServer::cursorServer(const std::vector<area> &areas, int period_ms) : areas(areas), periodMs(period_ms) {}
+
+cursorServer::~cursorServer() {
+  quit = true;
+  if (th_cursor.joinable()) th_cursor.join();
+  if (display) XCloseDisplay(display);
+}
+
+/**
+ * @brief Open the X display, listen on PORT_CURSOR and start the cursor thread
+ * @return false if the display or XFIXES is missing */
+bool cursorServer::start() {
+  display = XOpenDisplay(NULL);
+  if (display == NULL) {
+    fprintf(stderr, "The cursor channel needs an X display\n");
+    return false;
+  }
+  root = DefaultRootWindow(display);
+
+  if (!XFixesQueryExtension(display, &fixesEvent, &fixesError)) {
+    fprintf(stderr, "The X server lacks XFIXES, the cursor shape can not be followed\n");
+    return false;
+  }
+  XFixesSelectCursorInput(display, root, XFixesDisplayCursorNotifyMask);
+
+  acceptor = std::make_unique<boost::asio::ip::tcp::acceptor>(
+      io_context, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), PORT_CURSOR));
+  // Polled by the cursor thread between two pointer reads
+  acceptor->non_blocking(true);
+
+  th_cursor = boost::thread(&cursorServer::run, this);
+  return true;
+}
+
+/**
+ * @brief Read the current cursor image and compute its key
+ *
+ * The key is a FNV-1a hash of the hot spot, the size and the pixels */
+void cursorServer::fetch_shape() {
+  XFixesCursorImage *image = XFixesGetCursorImage(display);
+  if (image == NULL) return;
+
+  // XFixes hands the pixels as unsigned long, only the low 32 bits are used
+  pixels.resize((size_t)image->width * image->height);
+  for (size_t i = 0; i < pixels.size(); i++) pixels[i] = (uint32_t)image->pixels[i];
+
+  state.width  = image->width;
+  state.height = image->height;
+  state.xhot   = image->xhot;
+  state.yhot   = image->yhot;
+  XFree(image);
+
+  uint32_t hash = 2166136261u;
+  auto     mix  = [&hash](const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) hash = (hash ^ data[i]) * 16777619u;
+  };
+  mix((const uint8_t *)&state.width, 4 * sizeof(uint16_t));
+  mix((const uint8_t *)pixels.data(), pixels.size() * sizeof(uint32_t));
+  state.hash = hash;
+}
+
+/**
+ * @brief Find the stream the pointer is on
+ * @param[in] rootX, rootY pointer position in the root window
+ * @return false if the pointer is outside every captured area */
+bool cursorServer::locate(int rootX, int rootY) {
+  for (const area &a : areas) {
+    if (rootX < a.x || rootY < a.y || rootX >= a.x + a.width || rootY >= a.y + a.height) continue;
+    state.visible = 1;
+    state.stream  = a.stream;
+    state.x       = (uint16_t)((int64_t)(rootX - a.x) * 65535 / a.width);
+    state.y       = (uint16_t)((int64_t)(rootY - a.y) * 65535 / a.height);
+    state.area_w  = a.width;
+    state.area_h  = a.height;
+    return true;
+  }
+  state.visible = 0;
+  return false;
+}
+
+/**
+ * @brief Send the current state to one client
+ * @param[in,out] c client, remembers the shapes it got
+ * @param[in] with_pixels append the shape, done once per shape and client
+ * @return false if the client went away */
+bool cursorServer::send(client &c, bool with_pixels) {
+  boost::system::error_code error;
+
+  state.size = with_pixels ? pixels.size() * sizeof(uint32_t) : 0;
+
+  std::array<boost::asio::const_buffer, 2> buffers{boost::asio::buffer(&state, sizeof(state)),
+                                                   boost::asio::buffer(pixels.data(), state.size)};
+  boost::asio::write(*c.socket, buffers, error);
+  if (error) {
+    std::cout << "Cursor client left: " << error.message() << std::endl;
+    return false;
+  }
+
+  moves++;
+  bytes += sizeof(state) + state.size;
+  if (with_pixels) {
+    shapes++;
+    c.sentShapes.insert(state.hash);
+  }
+  return true;
+}
+
+/**
+ * @brief Take every pending connection, without waiting */
+void cursorServer::accept_clients() {
+  for (;;) {
+    boost::system::error_code error;
+    client                    c;
+    c.socket = std::make_unique<boost::asio::ip::tcp::socket>(io_context);
+    acceptor->accept(*c.socket, error);
+    if (error) return;
+
+    // Writes block, a cursor update is small and the period long
+    c.socket->non_blocking(false);
+    c.socket->set_option(boost::asio::ip::tcp::no_delay(true));
+    clients.push_back(std::move(c));
+    connected++;
+    std::cout << "Cursor client connected" << std::endl;
+  }
+}
+
+/**
+ * @brief Cursor thread: poll the pointer every periodMs and send the state to
+ * every client when it changed, a new client gets it right away */
+void cursorServer::run() {
+  fetch_shape();
+  bool shapeChanged = true;
+
+  while (!quit) {
+    accept_clients();
+
+    while (XPending(display)) {
+      XEvent ev;
+      XNextEvent(display, &ev);
+      if (ev.type == fixesEvent + XFixesCursorNotify) shapeChanged = true;
+    }
+    if (shapeChanged) fetch_shape();
+
+    Window       rootReturn, child;
+    int          rootX, rootY, winX, winY;
+    unsigned int mask;
+    XQueryPointer(display, root, &rootReturn, &child, &rootX, &rootY, &winX, &winY, &mask);
+
+    cursor_packet_t before = state;
+    locate(rootX, rootY);
+    bool changed = memcmp(&before, &state, sizeof(state)) != 0;
+
+    // A client that never got the shape, new ones included, gets its pixels
+    for (auto c = clients.begin(); c != clients.end();) {
+      bool newShape = c->sentShapes.count(state.hash) == 0;
+      if (shapeChanged && !newShape) cachedShapes++;
+      if ((newShape || changed) && !send(*c, newShape)) {
+        c = clients.erase(c);
+        connected--;
+      } else {
+        ++c;
+      }
+    }
+    shapeChanged = false;
+
+    usleep(periodMs * 1000);
+  }
+}
+
+void cursorServer::print_stats(FILE *out) const {
+  fprintf(out, "cursor: %d clients, %lu updates, %lu shapes sent, %lu shapes from cache, %lu bytes\n",
+          connected.load(), moves.load(), shapes.load(), cachedShapes.load(), bytes.load());
+}
@@ -0,0 +1,93 @@
+#include "../include/dirtyMap.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+/**
+ * @param[in] width frame width in pixel
+ * @param[in] height frame height in pixel
+ * @param[in] nb_planes number of full resolution planes to compare
+ * @param[in] block side of a square block in pixel */
+dirtyMap::dirtyMap(int width, int height, int nb_planes, int block)
+    : width(width),
+      height(height),
+      nb_planes(nb_planes),
+      block(block),
+      blocks_w((width + block - 1) / block),
+      blocks_h((height + block - 1) / block),
+      reference((size_t)width * height * nb_planes) {}
+
+/**
+ * @brief Compare a frame against the previous one and update the dirty list
+ * @param[in] data plane pointers, every plane is width x height bytes
+ * @param[in] linesize plane strides
+ * @return number of dirty blocks, every block is dirty on the first call */
+size_t dirtyMap::update(const uint8_t *const *data, const int *linesize) {
+  dirty.clear();
+
+  for (int by = 0; by < blocks_h; by++) {
+    int top    = by * block;
+    int bottom = top + block < height ? top + block : height;
+
+    for (int bx = 0; bx < blocks_w; bx++) {
+      int    left    = bx * block;
+      int    right   = left + block < width ? left + block : width;
+      size_t row_len = right - left;
+      bool   changed = first;
+
+      for (int p = 0; p < nb_planes && !changed; p++) {
+        const uint8_t *ref = &reference[(size_t)p * width * height];
+        for (int y = top; y < bottom && !changed; y++)
+          changed = memcmp(&data[p][(size_t)y * linesize[p] + left], &ref[(size_t)y * width + left], row_len) != 0;
+      }
+      if (!changed) continue;
+
+      for (int p = 0; p < nb_planes; p++) {
+        uint8_t *ref = &reference[(size_t)p * width * height];
+        for (int y = top; y < bottom; y++)
+          memcpy(&ref[(size_t)y * width + left], &data[p][(size_t)y * linesize[p] + left], row_len);
+      }
+      dirty.push_back({left, top, right, bottom});
+    }
+  }
+
+  first = false;
+  return dirty.size();
+}
+
+/**
+ * @brief Expose the dirty blocks to the encoder as region of interest side data
+ * @param[in,out] av_frame frame about to be encoded, previous ROI are removed
+ * @param[in] max_blocks above this many dirty blocks no ROI is attached
+ * @return 0 on success, a negative AVERROR otherwise
+ *
+ * Changed blocks get a small negative quantizer offset so the encoder spends
+ * its bits where the picture actually moved. Blocks are mapped to the frame
+ * size when the frame was downscaled from the captured one */
+int dirtyMap::attach(AVFrame *av_frame, size_t max_blocks) const {
+  av_frame_remove_side_data(av_frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+  if (dirty.empty() || dirty.size() > max_blocks) return 0;
+
+  AVFrameSideData *sd =
+      av_frame_new_side_data(av_frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, dirty.size() * sizeof(AVRegionOfInterest));
+  if (sd == NULL) return AVERROR(ENOMEM);
+
+  int64_t frameW = av_frame->width ? av_frame->width : width;
+  int64_t frameH = av_frame->height ? av_frame->height : height;
+
+  AVRegionOfInterest *roi = (AVRegionOfInterest *)sd->data;
+  for (const dirtyRect &r : dirty) {
+    roi->self_size = sizeof(AVRegionOfInterest);
+    roi->left      = r.left * frameW / width;
+    roi->top       = r.top * frameH / height;
+    roi->right     = r.right * frameW / width;
+    roi->bottom    = r.bottom * frameH / height;
+    roi->qoffset   = (AVRational){-1, 10};
+    roi++;
+  }
+  return 0;
+}
@@ -0,0 +1,77 @@
+#include "../include/frameRenderer.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+/**
+ * @param[in] pool_frames RGB32 frames of the pool, allocated on first use at the size asked */
+frameRenderer::frameRenderer(int pool_frames) {
+  for (int i = 0; i < pool_frames; i++) {
+    AVFrame *frame = av_frame_alloc();
+    if (frame == NULL) {
+      fprintf(stderr, "Could not allocate the render pool\n");
+      exit(1);
+    }
+    pool.push_back(frame);
+    idle.push_back(frame);
+  }
+}
+
+frameRenderer::~frameRenderer() {
+  for (auto &s : scalers) sws_freeContext(s.second.ctx);
+  for (AVFrame *frame : pool) av_frame_free(&frame);
+}
+
+/**
+ * @brief Convert a decoded frame to RGB32 at the destination size
+ * @param[in] stream the scaler of this stream is reused while the geometry holds
+ * @param[out] dst first pixel of the destination, pitch bytes per row
+ * @param[in] dst_width, dst_height size of the destination rectangle */
+void frameRenderer::scale(int stream, const AVFrame *frame, uint8_t *dst, int pitch, int dst_width, int dst_height) {
+  scaler &s = scalers[stream];
+  if (s.ctx == NULL || s.src_w != frame->width || s.src_h != frame->height || s.dst_w != dst_width ||
+      s.dst_h != dst_height || s.format != frame->format) {
+    sws_freeContext(s.ctx);
+    s.ctx = sws_getContext(frame->width, frame->height, (AVPixelFormat)frame->format, dst_width, dst_height,
+                           AV_PIX_FMT_RGB32, SWS_POINT, NULL, NULL, NULL);
+    if (s.ctx == NULL) {
+      fprintf(stderr, "Could not create the scaler for %dx%d\n", dst_width, dst_height);
+      exit(1);
+    }
+    s.src_w  = frame->width;
+    s.src_h  = frame->height;
+    s.dst_w  = dst_width;
+    s.dst_h  = dst_height;
+    s.format = (AVPixelFormat)frame->format;
+    nRebuilds++;
+  }
+
+  sws_scale(s.ctx, frame->data, frame->linesize, 0, frame->height, &dst, &pitch);
+}
+
+/**
+ * @brief Take an RGB32 frame of the pool, its buffer is reallocated only if the size changed
+ * @return NULL when every frame is in use */
+AVFrame *frameRenderer::acquire(int width, int height) {
+  if (idle.empty()) return NULL;
+  AVFrame *frame = idle.back();
+  idle.pop_back();
+
+  if (frame->width != width || frame->height != height) {
+    av_frame_unref(frame);
+    frame->format = AV_PIX_FMT_RGB32;
+    frame->width  = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+      fprintf(stderr, "Could not allocate a %dx%d render frame\n", width, height);
+      exit(1);
+    }
+  }
+  return frame;
+}
+
+/**
+ * @brief Give back a frame taken with @ref acquire, its buffer is kept */
+void frameRenderer::release(AVFrame *frame) { idle.push_back(frame); }
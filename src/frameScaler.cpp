@@ -0,0 +1,140 @@
+#include "../include/frameScaler.hpp"
+
+#include <stdlib.h>
+
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+/**
+ * @param[in] src_width, src_height size of the captured frames
+ * @param[in] dst_width, dst_height size of the encoded frames, even for NV12
+ * @param[in] format YUV444P or NV12, the same on both sides
+ * @param[in] threads number of slices scaled in parallel, the caller included */
+frameScaler::frameScaler(int src_width, int src_height, int dst_width, int dst_height, AVPixelFormat format,
+                         int threads)
+    : srcW(src_width), srcH(src_height), dstW(dst_width), dstH(dst_height), format(format) {
+  if (format == AV_PIX_FMT_NV12) {
+    planes.push_back({srcW, srcH, dstW, dstH, 1});
+    planes.push_back({srcW / 2, srcH / 2, dstW / 2, dstH / 2, 2});
+  } else {
+    for (int i = 0; i < 3; i++) planes.push_back({srcW, srcH, dstW, dstH, 1});
+  }
+
+  // Sample centers are aligned, x0 + 1 always stays inside the source row
+  for (plane &p : planes) {
+    for (int x = 0; x < p.dst_w; x++) {
+      double sx = std::max(0.0, (x + 0.5) * p.src_w / p.dst_w - 0.5);
+      int    x0 = std::min((int)sx, p.src_w - 2);
+      int    fx = std::min(256, (int)((sx - x0) * 256 + 0.5));
+      p.x0.push_back(x0 * p.channels);
+      p.fx.push_back(fx);
+    }
+  }
+
+  slices = std::max(1, std::min(threads, dstH / 16));
+  for (int i = 1; i < slices; i++) workers.emplace_back(&frameScaler::worker, this, i);
+}
+
+frameScaler::~frameScaler() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    quit = true;
+  }
+  start_cv.notify_all();
+  for (boost::thread &th : workers) th.join();
+}
+
+/**
+ * @brief Scale the captured planes into an encoder frame
+ * @param[in] data, linesize planes of the captured frame, src_width x src_height
+ * @param[out] dst frame of dst_width x dst_height, made writable if needed
+ * @return number of bytes written */
+size_t frameScaler::scale(const uint8_t *const *data, const int *linesize, AVFrame *dst) {
+  if (av_frame_make_writable(dst) < 0) exit(1);
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    src_data     = data;
+    src_linesize = linesize;
+    dst_frame    = dst;
+    pending      = slices - 1;
+    generation++;
+  }
+  start_cv.notify_all();
+
+  scale_slice(0);
+
+  std::unique_lock<std::mutex> guard(lock);
+  done_cv.wait(guard, [this]() { return pending == 0; });
+
+  return av_image_get_buffer_size(format, dstW, dstH, 1);
+}
+
+void frameScaler::worker(int slice) {
+  uint64_t seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      start_cv.wait(guard, [this, seen]() { return quit || generation != seen; });
+      if (quit) return;
+      seen = generation;
+    }
+
+    scale_slice(slice);
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (--pending == 0) done_cv.notify_one();
+  }
+}
+
+/**
+ * @brief Scale the rows of every plane that belong to one slice */
+void frameScaler::scale_slice(int slice) {
+  for (size_t i = 0; i < planes.size(); i++) {
+    const plane &p     = planes[i];
+    int          begin = (int)((int64_t)p.dst_h * slice / slices);
+    int          end   = (int)((int64_t)p.dst_h * (slice + 1) / slices);
+    scale_rows(p, src_data[i], src_linesize[i], dst_frame->data[i], dst_frame->linesize[i], begin, end);
+  }
+}
+
+/**
+ * @brief Bilinear interpolation of destination rows [begin, end) of one plane
+ *
+ * Weights are in 1/256, the two horizontal passes and the vertical one fit in
+ * 32 bits. The channel count is a template parameter so the inner loop unrolls */
+template <int CH>
+static void bilinear_rows(const int *x_index, const uint16_t *x_weight, int src_h, int dst_w, int dst_h,
+                          const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int begin, int end) {
+  for (int y = begin; y < end; y++) {
+    double sy = std::max(0.0, (y + 0.5) * src_h / dst_h - 0.5);
+    int    y0 = std::min((int)sy, src_h - 2);
+    int    fy = std::min(256, (int)((sy - y0) * 256 + 0.5));
+
+    const uint8_t *r0  = src + (size_t)y0 * src_stride;
+    const uint8_t *r1  = r0 + src_stride;
+    uint8_t       *out = dst + (size_t)y * dst_stride;
+
+    for (int x = 0; x < dst_w; x++) {
+      int x0 = x_index[x];
+      int fx = x_weight[x];
+      for (int c = 0; c < CH; c++) {
+        int top    = r0[x0 + c] * (256 - fx) + r0[x0 + CH + c] * fx;
+        int bottom = r1[x0 + c] * (256 - fx) + r1[x0 + CH + c] * fx;
+
+        out[x * CH + c] = (top * (256 - fy) + bottom * fy + 32768) >> 16;
+      }
+    }
+  }
+}
+
+void frameScaler::scale_rows(const plane &p, const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+                             int begin, int end) {
+  if (p.channels == 2)
+    bilinear_rows<2>(&p.x0[0], &p.fx[0], p.src_h, p.dst_w, p.dst_h, src, src_stride, dst, dst_stride, begin, end);
+  else
+    bilinear_rows<1>(&p.x0[0], &p.fx[0], p.src_h, p.dst_w, p.dst_h, src, src_stride, dst, dst_stride, begin, end);
+}
@@ -0,0 +1,143 @@
+/**
+ * @brief Microbenchmark of the video packet header, binary against the former text format
+ *
+ * Both formats carry the same fields. For each one the benchmark builds and
+ * parses --iterations headers and prints the time and the heap allocations
+ * per operation; operator new is counted for the whole process.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <array>
+#include <atomic>
+#include <new>
+#include <sstream>
+#include <string>
+
+#include "../include/latencyHistogram.hpp"
+#include "../include/protocol.hpp"
+
+#define BENCH_ITERATIONS 1000000
+
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size ? size : 1);
+  if (p == NULL) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+/**
+ * @brief header as the server used to build it, "WxH@stream size e" padded with '0' to PKTSIZE */
+static void write_text(const packet_header_t &header, std::string &out) {
+  std::stringstream header_stream;
+  header_stream << header.width << 'x' << header.height << '@' << header.stream << " "
+                << std::to_string(header.payload_size) << 'e' << std::endl;
+  out = header_stream.str();
+  out.append(PKTSIZE - out.size(), '0');
+}
+
+/**
+ * @brief header as the client used to parse it */
+static void read_text(const char *buffer, packet_header_t &header) {
+  std::string data_buff_str = std::string(buffer);
+
+  int x_pos      = data_buff_str.find("x");
+  int stream_pos = data_buff_str.find('@');
+  int end_pos    = data_buff_str.find(' ');
+  int end_size   = data_buff_str.find('e', end_pos);
+
+  header.width        = std::stoi(data_buff_str.substr(0, x_pos));
+  header.height       = std::stoi(data_buff_str.substr(x_pos + 1, end_pos));
+  header.stream       = std::stoi(data_buff_str.substr(stream_pos + 1, end_pos));
+  header.payload_size = std::stoi(data_buff_str.substr(end_pos + 1, end_size));
+}
+
+/**
+ * @brief time and allocations of n calls to fn
+ * @param[in] name printed with the results */
+template <typename F>
+static void run(const char *name, int n, F fn) {
+  uint64_t allocs = allocations.load();
+  uint64_t start  = latencyHistogram::now_us();
+  for (int i = 0; i < n; i++) fn(i);
+  uint64_t elapsed = latencyHistogram::now_us() - start;
+  allocs           = allocations.load() - allocs;
+
+  printf("%-14s %8.1f ns/op, %5.2f allocations/op\n", name, elapsed * 1000.0 / n, (double)allocs / n);
+}
+
+static void usage(const char *pname) {
+  printf("Usage: %s [options]\n", pname);
+  printf("\n");
+  printf("Options:\n");
+  printf("  --help|-h\t\tThis message\n");
+  printf("  --iterations|-n <n>\tHeaders built and parsed per format (default: %d)\n", BENCH_ITERATIONS);
+}
+
+int main(int argc, char *argv[]) {
+  static struct option longopts[] = {
+      {"iterations", required_argument, NULL, 'n'}, {"help", no_argument, NULL, 'h'}, {NULL, 0, NULL, 0}};
+
+  int n = BENCH_ITERATIONS;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hn:", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 'n':
+        n = atoi(optarg);
+        break;
+      case 'h':
+      default:
+        usage(argv[0]);
+        return EXIT_SUCCESS;
+    }
+  }
+  if (n <= 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  packet_header_t header;
+  header.stream     = 1;
+  header.width      = 1920;
+  header.height     = 1080;
+  header.encode_us  = 4200;
+  header.capture_us = latencyHistogram::now_us();
+
+  // Results are folded in a checksum so the loops are not optimized away
+  uint64_t checksum = 0;
+
+  std::string text;
+  text.reserve(PKTSIZE + 1);
+  run("text write", n, [&](int i) {
+    header.payload_size = 10000 + i % 50000;
+    write_text(header, text);
+    checksum += text[3];
+  });
+
+  packet_header_t parsed;
+  run("text read", n, [&](int i) {
+    read_text(text.c_str(), parsed);
+    checksum += parsed.payload_size;
+  });
+
+  std::array<uint8_t, HEADER_SIZE> raw;
+  run("binary write", n, [&](int i) {
+    header.sequence     = i;
+    header.payload_size = 10000 + i % 50000;
+    write_header(header, raw.data());
+    checksum += raw[16];
+  });
+
+  run("binary read", n, [&](int i) {
+    checksum += read_header(raw.data(), parsed);
+    checksum += parsed.payload_size;
+  });
+
+  printf("header size: text %d bytes, binary %d bytes (checksum %lu)\n", PKTSIZE, HEADER_SIZE, checksum);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,641 @@
+/**
+ * @brief Network impairment proxy, puts a bad link between videoCapture and videoStream on one box
+ *
+ * The proxy listens on --listen, TCP and UDP, and relays every connection
+ * and UDP peer to --target. Both directions go through an emulated link:
+ * a bottleneck of --rate kbit/s with --queue-ms of buffer, shared by every
+ * connection and peer like the last hop of a real link, then --delay plus
+ * a uniform 0..--jitter. TCP bytes keep their order and a full bottleneck
+ * stops reading, like a real buffer pushes back on the sender; datagrams are
+ * dropped by a full bottleneck, lost with --loss percent and held back with
+ * --reorder percent so the next ones overtake them.
+ *
+ * A --profile is a list of phases played in a loop, link conditions change
+ * at each phase boundary; --script reads the phases from a file. Every
+ * second a report line gives the phase and what the link did, the
+ * "downstream_delay" and "upstream_delay" histograms are printed on exit.
+ *
+ *   videoCapture --udp &
+ *   linkProxy --profile hotel-wifi --report wifi.csv &
+ *   videoStream --host 127.0.0.1 --port 3300 --stats
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <boost/asio.hpp>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../include/latencyHistogram.hpp"
+#include "../include/protocol.hpp"
+
+#define PROXY_PORT 3300
+#define PROXY_CHUNK 65536
+//! @brief extra hold of a datagram picked for reordering
+#define PROXY_REORDER_MS 10
+
+/**
+ * @brief link conditions for a while */
+struct linkPhase {
+  std::string name;
+  int         duration_ms     = 0;  //!< 0 for a profile with a single phase
+  int         delay_ms        = 0;
+  int         jitter_ms       = 0;
+  int         rate_kbps       = 0;  //!< 0 for no bottleneck
+  int         queue_ms        = 200;  //!< bottleneck buffer, in time at rate_kbps
+  double      loss_percent    = 0;  //!< datagrams only, TCP retransmits
+  double      reorder_percent = 0;  //!< datagrams only
+};
+
+struct linkProfile {
+  const char            *name;
+  std::vector<linkPhase> phases;
+};
+
+// name, duration, delay, jitter, rate, queue, loss, reorder
+static const linkProfile profiles[] = {
+    {"perfect", {{"clear", 0, 0, 0, 0, 200, 0, 0}}},
+    {"dsl", {{"steady", 0, 15, 2, 8000, 200, 0, 0}}},
+    {"lte",
+     {{"good", 6000, 35, 8, 20000, 150, 0.2, 0.1},
+      {"cell-edge", 3000, 60, 20, 4000, 300, 1, 0.5},
+      {"handover", 500, 150, 50, 500, 500, 5, 1}}},
+    {"hotel-wifi",
+     {{"quiet", 5000, 20, 10, 6000, 400, 0.5, 0.2},
+      {"busy", 4000, 60, 40, 1500, 800, 2, 1},
+      {"stall", 800, 300, 100, 200, 1000, 10, 0}}},
+    {"3g", {{"hspa", 0, 100, 30, 1500, 600, 1, 0.5}}},
+    {"satellite", {{"geo", 0, 300, 10, 10000, 500, 0.5, 0}}},
+};
+
+/**
+ * @brief what the link did in one direction */
+struct directionStats {
+  uint64_t bytes_in     = 0;
+  uint64_t bytes_out    = 0;
+  uint64_t chunks_out   = 0;
+  uint64_t lost         = 0;  //!< datagrams dropped by --loss
+  uint64_t overflowed   = 0;  //!< datagrams dropped by a full bottleneck
+  uint64_t reordered    = 0;
+  uint64_t paused       = 0;  //!< times a TCP reader stopped on a full bottleneck
+  uint64_t queued_bytes = 0;  //!< in the link now
+};
+
+enum direction { DOWNSTREAM = 0, UPSTREAM = 1 };
+static const char *directionNames[] = {"downstream", "upstream"};
+
+static boost::asio::io_context        io;
+static boost::asio::ip::tcp::endpoint targetTcp;
+static boost::asio::ip::udp::endpoint targetUdp;
+static std::vector<linkPhase>         phases;
+static size_t                         phaseIndex = 0;
+static uint64_t                       phaseStartUs;
+static uint64_t                       startUs;
+static int                            durationS = 0;
+static std::mt19937                   rng{1};
+static directionStats                 totals[2];
+static directionStats                 lastReport[2];
+static latencyHistogram              *linkDelay[2];
+static FILE                          *report = NULL;
+
+class linkPipe;
+
+/**
+ * @brief bottleneck of one direction, every connection and peer queues in it */
+struct linkBottleneck {
+  uint64_t             free_us = 0;  //!< busy until then
+  std::set<linkPipe *> waiting;  //!< stream pipes that stopped reading on a full buffer
+};
+static linkBottleneck bottleneck[2];
+
+static const linkPhase &phase() { return phases[phaseIndex]; }
+
+static double uniform(double max) { return std::uniform_real_distribution<double>(0, max)(rng); }
+
+/**
+ * @brief One direction of the emulated link
+ *
+ * Chunks leave the bottleneck of the direction at the phase rate, then wait
+ * the delay and the jitter before output is called with them. A stream pipe
+ * releases in order and output calls its completion once the bytes are
+ * written, the next chunk waits for it. */
+class linkPipe {
+ public:
+  typedef std::function<void(const std::vector<uint8_t> &, std::function<void()>)> outputFn;
+
+  linkPipe(direction dir, bool datagram, outputFn output)
+      : dir(dir), datagram(datagram), output(output), timer(io) {}
+  ~linkPipe() { bottleneck[dir].waiting.erase(this); }
+
+  std::function<void()> resume;  //!< stream pipe: called once it has room again after push returned false
+
+  /**
+   * @brief Hand a chunk to the link
+   * @return false if a stream pipe is over its buffer, stop reading until resume */
+  bool push(std::vector<uint8_t> &&chunk) {
+    const linkPhase &p   = phase();
+    uint64_t         now = latencyHistogram::now_us();
+    directionStats  &st  = totals[dir];
+    linkBottleneck  &b   = bottleneck[dir];
+    st.bytes_in += chunk.size();
+
+    if (datagram && uniform(100) < p.loss_percent) {
+      st.lost++;
+      return true;
+    }
+
+    uint64_t ready = now;
+    if (p.rate_kbps > 0) {
+      uint64_t start = std::max(now, b.free_us);
+      uint64_t done  = start + chunk.size() * 8 * 1000 / p.rate_kbps;
+      // A full buffer drops datagrams at its tail
+      if (datagram && done - now > (uint64_t)p.queue_ms * 1000) {
+        st.overflowed++;
+        return true;
+      }
+      b.free_us = done;
+      ready     = done;
+    }
+
+    uint64_t release = ready + (uint64_t)p.delay_ms * 1000 + (uint64_t)uniform(p.jitter_ms * 1000);
+    if (datagram) {
+      if (uniform(100) < p.reorder_percent) {
+        release += PROXY_REORDER_MS * 1000;
+        st.reordered++;
+      }
+    } else {
+      // Jitter delays the bytes, it never reorders them
+      release     = std::max(release, lastRelease);
+      lastRelease = release;
+    }
+
+    st.queued_bytes += chunk.size();
+    queue.emplace(release, entry{now, std::move(chunk)});
+    schedule();
+
+    bool room = datagram || p.rate_kbps == 0 || b.free_us - now <= (uint64_t)p.queue_ms * 1000;
+    if (!room) {
+      st.paused++;
+      b.waiting.insert(this);
+    }
+    return room;
+  }
+
+ private:
+  struct entry {
+    uint64_t             arrival_us;
+    std::vector<uint8_t> data;
+  };
+
+  direction                      dir;
+  bool                           datagram;
+  outputFn                       output;
+  boost::asio::steady_timer      timer;
+  std::multimap<uint64_t, entry> queue;  //!< by release time
+  uint64_t                       lastRelease = 0;
+  bool                           writing     = false;
+  std::vector<uint8_t>           sending;  //!< handed to output, kept until its completion
+
+  /**
+   * @brief restart the readers of the direction once its bottleneck has room, whichever pipe they stopped on */
+  void resume_waiting() {
+    linkBottleneck &b = bottleneck[dir];
+    if (b.waiting.empty() || b.free_us > latencyHistogram::now_us() + (uint64_t)phase().queue_ms * 1000) return;
+
+    // A resumed reader may fill the bottleneck again and wait once more
+    std::set<linkPipe *> waiting;
+    waiting.swap(b.waiting);
+    for (linkPipe *pipe : waiting)
+      if (pipe->resume) pipe->resume();
+  }
+
+  void schedule() {
+    if (writing || queue.empty()) return;
+    uint64_t now = latencyHistogram::now_us();
+    if (queue.begin()->first > now) {
+      timer.expires_after(std::chrono::microseconds(queue.begin()->first - now));
+      timer.async_wait([this](const boost::system::error_code &error) {
+        if (!error) schedule();
+      });
+      return;
+    }
+
+    auto front = queue.begin();
+    sending    = std::move(front->second.data);
+    linkDelay[dir]->record(now - front->second.arrival_us);
+    queue.erase(front);
+    totals[dir].queued_bytes -= sending.size();
+
+    writing = true;
+    output(sending, [this]() {
+      writing = false;
+      totals[dir].bytes_out += sending.size();
+      totals[dir].chunks_out++;
+      resume_waiting();
+      schedule();
+    });
+  }
+};
+
+/**
+ * @brief A relayed TCP connection, ends when either side closes */
+class tcpSession : public std::enable_shared_from_this<tcpSession> {
+ public:
+  boost::asio::ip::tcp::socket client;
+  boost::asio::ip::tcp::socket server;
+
+  tcpSession() : client(io), server(io) {}
+
+  void start() {
+    auto self = shared_from_this();
+    server.async_connect(targetTcp, [this, self](const boost::system::error_code &error) {
+      if (error) {
+        fprintf(stderr, "Could not connect to the target: %s\n", error.message().c_str());
+        close();
+        return;
+      }
+      boost::system::error_code ignored;
+      client.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+      server.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+
+      down = std::make_unique<linkPipe>(DOWNSTREAM, false, writer(client));
+      up   = std::make_unique<linkPipe>(UPSTREAM, false, writer(server));
+      down->resume = [this, self]() { read(server, *down, downBuffer); };
+      up->resume   = [this, self]() { read(client, *up, upBuffer); };
+      read(server, *down, downBuffer);
+      read(client, *up, upBuffer);
+    });
+  }
+
+ private:
+  std::unique_ptr<linkPipe> down, up;
+  std::vector<uint8_t>      downBuffer = std::vector<uint8_t>(PROXY_CHUNK);
+  std::vector<uint8_t>      upBuffer   = std::vector<uint8_t>(PROXY_CHUNK);
+  bool                      closed     = false;
+
+  linkPipe::outputFn writer(boost::asio::ip::tcp::socket &to) {
+    auto self = shared_from_this();
+    return [this, self, &to](const std::vector<uint8_t> &data, std::function<void()> done) {
+      // The chunk is owned by the pipe until done is called
+      boost::asio::async_write(to, boost::asio::buffer(data),
+                               [this, self, done](const boost::system::error_code &error, std::size_t) {
+                                 if (error) {
+                                   close();
+                                   return;
+                                 }
+                                 done();
+                               });
+    };
+  }
+
+  void read(boost::asio::ip::tcp::socket &from, linkPipe &pipe, std::vector<uint8_t> &buffer) {
+    if (closed) return;
+    auto self = shared_from_this();
+    from.async_read_some(boost::asio::buffer(buffer), [this, self, &from, &pipe, &buffer](
+                                                          const boost::system::error_code &error, std::size_t size) {
+      if (error) {
+        close();
+        return;
+      }
+      if (pipe.push(std::vector<uint8_t>(buffer.begin(), buffer.begin() + size))) read(from, pipe, buffer);
+    });
+  }
+
+  void close() {
+    if (closed) return;
+    closed = true;
+    boost::system::error_code ignored;
+    client.close(ignored);
+    server.close(ignored);
+
+    // The pipes hold the session through their output, let it go once this handler returns
+    auto self = shared_from_this();
+    boost::asio::post(io, [self]() {
+      self->down.reset();
+      self->up.reset();
+    });
+  }
+};
+
+/**
+ * @brief Relays the datagrams of every UDP peer, each gets its own socket to the target */
+class udpRelay {
+ public:
+  explicit udpRelay(int port) : socket(io, boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), port)) {
+    receive();
+  }
+
+ private:
+  struct peer {
+    boost::asio::ip::udp::endpoint endpoint;
+    boost::asio::ip::udp::socket   socket;
+    std::vector<uint8_t>           buffer = std::vector<uint8_t>(PROXY_CHUNK);
+    std::unique_ptr<linkPipe>      down, up;
+
+    peer(const boost::asio::ip::udp::endpoint &endpoint) : endpoint(endpoint), socket(io) {}
+  };
+
+  boost::asio::ip::udp::socket                                     socket;
+  boost::asio::ip::udp::endpoint                                   sender;
+  std::vector<uint8_t>                                             buffer = std::vector<uint8_t>(PROXY_CHUNK);
+  std::map<boost::asio::ip::udp::endpoint, std::unique_ptr<peer>> peers;
+
+  void receive() {
+    socket.async_receive_from(boost::asio::buffer(buffer), sender,
+                              [this](const boost::system::error_code &error, std::size_t size) {
+                                if (!error) {
+                                  peer &p = find(sender);
+                                  p.up->push(std::vector<uint8_t>(buffer.begin(), buffer.begin() + size));
+                                }
+                                receive();
+                              });
+  }
+
+  peer &find(const boost::asio::ip::udp::endpoint &endpoint) {
+    std::unique_ptr<peer> &p = peers[endpoint];
+    if (p) return *p;
+
+    p = std::make_unique<peer>(endpoint);
+    p->socket.connect(targetUdp);
+    peer *raw = p.get();
+    p->down   = std::make_unique<linkPipe>(
+        DOWNSTREAM, true, [this, raw](const std::vector<uint8_t> &data, std::function<void()> done) {
+          boost::system::error_code ignored;
+          socket.send_to(boost::asio::buffer(data), raw->endpoint, 0, ignored);
+          done();
+        });
+    p->up = std::make_unique<linkPipe>(
+        UPSTREAM, true, [raw](const std::vector<uint8_t> &data, std::function<void()> done) {
+          // The target may not listen yet, the peer sends again
+          boost::system::error_code ignored;
+          raw->socket.send(boost::asio::buffer(data), 0, ignored);
+          done();
+        });
+    printf("UDP peer %s:%d\n", endpoint.address().to_string().c_str(), endpoint.port());
+    receive_target(*raw);
+    return *p;
+  }
+
+  void receive_target(peer &p) {
+    p.socket.async_receive(boost::asio::buffer(p.buffer), [this, &p](const boost::system::error_code &error,
+                                                                      std::size_t size) {
+      if (error == boost::asio::error::operation_aborted) return;
+      if (!error) p.down->push(std::vector<uint8_t>(p.buffer.begin(), p.buffer.begin() + size));
+      receive_target(p);
+    });
+  }
+};
+
+static void start_accept(boost::asio::ip::tcp::acceptor &acceptor) {
+  auto session = std::make_shared<tcpSession>();
+  acceptor.async_accept(session->client, [&acceptor, session](const boost::system::error_code &error) {
+    if (!error) {
+      printf("TCP connection from %s\n", session->client.remote_endpoint().address().to_string().c_str());
+      session->start();
+    }
+    start_accept(acceptor);
+  });
+}
+
+static void print_phase() {
+  const linkPhase &p = phase();
+  printf("phase %s: delay %d ms, jitter %d ms, rate %d kbit/s, queue %d ms, loss %.1f%%, reorder %.1f%%\n",
+         p.name.c_str(), p.delay_ms, p.jitter_ms, p.rate_kbps, p.queue_ms, p.loss_percent, p.reorder_percent);
+}
+
+/**
+ * @brief Once a second: next phase if its time is up, then a report line per direction */
+static void tick(boost::asio::steady_timer &timer) {
+  uint64_t now = latencyHistogram::now_us();
+  if (phase().duration_ms && now - phaseStartUs >= (uint64_t)phase().duration_ms * 1000) {
+    phaseIndex   = (phaseIndex + 1) % phases.size();
+    phaseStartUs = now;
+    print_phase();
+  }
+
+  double elapsed = (now - startUs) / 1e6;
+  for (int d = 0; d < 2; d++) {
+    const directionStats &t = totals[d], &l = lastReport[d];
+    if (report)
+      fprintf(report, "%.1f,%s,%s,%d,%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", elapsed, directionNames[d],
+              phase().name.c_str(), phase().rate_kbps, phase().delay_ms, (t.bytes_in - l.bytes_in) * 8 / 1000,
+              (t.bytes_out - l.bytes_out) * 8 / 1000, t.queued_bytes, t.lost - l.lost, t.overflowed - l.overflowed,
+              t.reordered - l.reordered, t.paused - l.paused);
+    lastReport[d] = t;
+  }
+  if (report) fflush(report);
+
+  if (durationS && elapsed >= durationS) {
+    io.stop();
+    return;
+  }
+  timer.expires_after(std::chrono::seconds(1));
+  timer.async_wait([&timer](const boost::system::error_code &error) {
+    if (!error) tick(timer);
+  });
+}
+
+/**
+ * @brief Read the phases of --script: one "name duration_ms delay_ms jitter_ms rate_kbps
+ * queue_ms loss_percent reorder_percent" line per phase, '#' starts a comment
+ * @return false if the file can not be read or has no phase */
+static bool load_script(const char *path) {
+  FILE *in = fopen(path, "r");
+  if (in == NULL) return false;
+
+  char line[256];
+  while (fgets(line, sizeof(line), in)) {
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+
+    char      name[64];
+    linkPhase p;
+    int       n = sscanf(line, "%63s %d %d %d %d %d %lf %lf", name, &p.duration_ms, &p.delay_ms, &p.jitter_ms,
+                         &p.rate_kbps, &p.queue_ms, &p.loss_percent, &p.reorder_percent);
+    if (n <= 0) continue;
+    if (n < 8) {
+      fprintf(stderr, "%s: expected 8 fields in \"%s\"\n", path, name);
+      fclose(in);
+      return false;
+    }
+    p.name = name;
+    phases.push_back(p);
+  }
+  fclose(in);
+  return !phases.empty();
+}
+
+static void usage(const char *pname) {
+  printf("Usage: %s [options]\n", pname);
+  printf("\n");
+  printf("Options:\n");
+  printf("  --help|-h\t\tThis message\n");
+  printf("  --listen|-l <port>\tTCP and UDP port the client connects to (default: %d)\n", PROXY_PORT);
+  printf("  --target|-t <ip:port>\tServer to relay to (default: 127.0.0.1:%d)\n", PORT_AV);
+  printf("  --profile|-p <name>\tLink profile:");
+  for (const linkProfile &profile : profiles) printf(" %s", profile.name);
+  printf(" (default: perfect)\n");
+  printf("  --script|-s <f>\tPhases read from <f>, one \"name duration_ms delay_ms jitter_ms rate_kbps\n"
+         "\t\t\tqueue_ms loss_percent reorder_percent\" per line, played in a loop\n");
+  printf("  --delay|-d <ms>\tOne way delay, overrides the profile\n");
+  printf("  --jitter|-j <ms>\tUniform extra delay, overrides the profile\n");
+  printf("  --rate|-r <kbit/s>\tBottleneck rate of a direction, shared by all the connections and peers, 0 for\n"
+         "\t\t\tnone, overrides the profile\n");
+  printf("  --queue|-q <ms>\tBottleneck buffer, overrides the profile\n");
+  printf("  --loss|-x <pct>\tDatagrams lost, overrides the profile\n");
+  printf("  --reorder|-o <pct>\tDatagrams held back %d ms, overrides the profile\n", PROXY_REORDER_MS);
+  printf("  --report|-R <f>\tWrite a csv line per second and direction to <f>\n");
+  printf("  --duration|-T <s>\tStop after <s> seconds (default: run until interrupted)\n");
+}
+
+int main(int argc, char *argv[]) {
+  static struct option longopts[] = {{"listen", required_argument, NULL, 'l'},
+                                     {"target", required_argument, NULL, 't'},
+                                     {"profile", required_argument, NULL, 'p'},
+                                     {"script", required_argument, NULL, 's'},
+                                     {"delay", required_argument, NULL, 'd'},
+                                     {"jitter", required_argument, NULL, 'j'},
+                                     {"rate", required_argument, NULL, 'r'},
+                                     {"queue", required_argument, NULL, 'q'},
+                                     {"loss", required_argument, NULL, 'x'},
+                                     {"reorder", required_argument, NULL, 'o'},
+                                     {"report", required_argument, NULL, 'R'},
+                                     {"duration", required_argument, NULL, 'T'},
+                                     {"help", no_argument, NULL, 'h'},
+                                     {NULL, 0, NULL, 0}};
+
+  int         listenPort = PROXY_PORT;
+  std::string target     = "127.0.0.1:" + std::to_string(PORT_AV);
+  const char *profile    = "perfect";
+  const char *script     = NULL;
+  const char *reportPath = NULL;
+  // Overrides applied to every phase, negative when not given
+  int    delay = -1, jitter = -1, rate = -1, queue = -1;
+  double loss = -1, reorder = -1;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hl:t:p:s:d:j:r:q:x:o:R:T:", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 'l':
+        listenPort = atoi(optarg);
+        break;
+      case 't':
+        target = optarg;
+        break;
+      case 'p':
+        profile = optarg;
+        break;
+      case 's':
+        script = optarg;
+        break;
+      case 'd':
+        delay = atoi(optarg);
+        break;
+      case 'j':
+        jitter = atoi(optarg);
+        break;
+      case 'r':
+        rate = atoi(optarg);
+        break;
+      case 'q':
+        queue = atoi(optarg);
+        break;
+      case 'x':
+        loss = atof(optarg);
+        break;
+      case 'o':
+        reorder = atof(optarg);
+        break;
+      case 'R':
+        reportPath = optarg;
+        break;
+      case 'T':
+        durationS = atoi(optarg);
+        break;
+      case 'h':
+      default:
+        usage(argv[0]);
+        return EXIT_SUCCESS;
+    }
+  }
+
+  if (script) {
+    if (!load_script(script)) {
+      fprintf(stderr, "Could not read the phases of %s\n", script);
+      return EXIT_FAILURE;
+    }
+  } else {
+    for (const linkProfile &p : profiles)
+      if (strcmp(p.name, profile) == 0) phases = p.phases;
+    if (phases.empty()) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  for (linkPhase &p : phases) {
+    if (delay >= 0) p.delay_ms = delay;
+    if (jitter >= 0) p.jitter_ms = jitter;
+    if (rate >= 0) p.rate_kbps = rate;
+    if (queue >= 0) p.queue_ms = queue;
+    if (loss >= 0) p.loss_percent = loss;
+    if (reorder >= 0) p.reorder_percent = reorder;
+  }
+
+  size_t colon = target.rfind(':');
+  boost::system::error_code error;
+  auto address = boost::asio::ip::make_address(target.substr(0, colon), error);
+  if (colon == std::string::npos || error) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  int targetPort = atoi(target.c_str() + colon + 1);
+  targetTcp      = boost::asio::ip::tcp::endpoint(address, targetPort);
+  targetUdp      = boost::asio::ip::udp::endpoint(address, targetPort);
+
+  if (reportPath) {
+    report = fopen(reportPath, "w");
+    if (report == NULL) {
+      fprintf(stderr, "Could not open %s\n", reportPath);
+      return EXIT_FAILURE;
+    }
+    fprintf(report, "time_s,direction,phase,rate_kbps,delay_ms,in_kbps,out_kbps,queued_bytes,lost,overflowed,"
+                    "reordered,paused\n");
+  }
+
+  linkDelay[DOWNSTREAM] = latencyRegistry::instance().create("downstream_delay");
+  linkDelay[UPSTREAM]   = latencyRegistry::instance().create("upstream_delay");
+
+  boost::asio::ip::tcp::acceptor acceptor(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), listenPort));
+  udpRelay                       relay(listenPort);
+  start_accept(acceptor);
+
+  boost::asio::signal_set signals(io, SIGINT, SIGTERM);
+  signals.async_wait([](const boost::system::error_code &, int) { io.stop(); });
+
+  startUs = phaseStartUs = latencyHistogram::now_us();
+  boost::asio::steady_timer timer(io);
+  tick(timer);
+
+  printf("Relaying port %d to %s\n", listenPort, target.c_str());
+  print_phase();
+  io.run();
+
+  for (int d = 0; d < 2; d++) {
+    const directionStats &t = totals[d];
+    printf("%s: %lu bytes in, %lu bytes out in %lu chunks, %lu lost, %lu overflowed, %lu reordered, "
+           "%lu reader pauses\n",
+           directionNames[d], t.bytes_in, t.bytes_out, t.chunks_out, t.lost, t.overflowed, t.reordered, t.paused);
+  }
+  latencyRegistry::instance().print(stdout);
+  if (report) fclose(report);
+  fflush(stdout);
+  // Sessions still hold sockets and pending handlers
+  _exit(EXIT_SUCCESS);
+}
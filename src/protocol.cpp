@@ -1,2 +1,89 @@
 #include "protocol.hpp"
 const char* REMOTE_IP = "84.247.209.68";
+
+static inline void put_le(uint8_t *out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) out[i] = (uint8_t)(value >> (8 * i));
+}
+
+static inline uint64_t get_le(const uint8_t *in, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) value |= (uint64_t)in[i] << (8 * i);
+  return value;
+}
+
+/**
+ * @brief Serialize a video packet header, see packet_header_t for the layout
+ * @param[in] header fields to write
+ * @param[out] out HEADER_SIZE bytes */
+void write_header(const packet_header_t &header, uint8_t *out) {
+  put_le(out + 0, HEADER_MAGIC, 4);
+  put_le(out + 4, HEADER_VERSION, 2);
+  put_le(out + 6, HEADER_SIZE, 2);
+  put_le(out + 8, header.stream, 2);
+  out[10] = header.frame_type;
+  out[11] = 0;
+  put_le(out + 12, header.width, 2);
+  put_le(out + 14, header.height, 2);
+  put_le(out + 16, header.sequence, 4);
+  put_le(out + 20, header.encode_us, 4);
+  put_le(out + 24, header.capture_us, 8);
+  put_le(out + 32, header.payload_size, 4);
+  put_le(out + 36, 0, 4);
+}
+
+/**
+ * @brief Parse a video packet header
+ * @param[in] in HEADER_SIZE bytes read from the stream
+ * @param[out] header parsed fields
+ * @return size of the whole header, more than HEADER_SIZE if a newer version
+ * appended fields to skip, or 0 if the bytes are not a header, the stream is
+ * out of range or the payload larger than MAX_PAYLOAD */
+int read_header(const uint8_t *in, packet_header_t &header) {
+  int size = (int)get_le(in + 6, 2);
+  if (get_le(in, 4) != HEADER_MAGIC || get_le(in + 4, 2) < HEADER_VERSION || size < HEADER_SIZE) return 0;
+
+  header.stream       = (uint16_t)get_le(in + 8, 2);
+  header.frame_type   = in[10] == FRAME_IDR ? FRAME_IDR : FRAME_P;
+  header.width        = (uint16_t)get_le(in + 12, 2);
+  header.height       = (uint16_t)get_le(in + 14, 2);
+  header.sequence     = (uint32_t)get_le(in + 16, 4);
+  header.encode_us    = (uint32_t)get_le(in + 20, 4);
+  header.capture_us   = get_le(in + 24, 8);
+  header.payload_size = (uint32_t)get_le(in + 32, 4);
+  // The client indexes its per stream state with the stream and allocates the payload
+  return header.stream < MAX_OUTPUTS && header.payload_size <= MAX_PAYLOAD ? size : 0;
+}
+
+/**
+ * @brief Serialize a datagram header, see datagram_header_t for the layout
+ * @param[out] out DATAGRAM_HEADER_SIZE bytes */
+void write_datagram_header(const datagram_header_t &header, uint8_t *out) {
+  put_le(out + 0, DATAGRAM_MAGIC, 4);
+  out[4] = header.type;
+  out[5] = header.stream;
+  put_le(out + 6, header.length, 2);
+  put_le(out + 8, header.sequence, 4);
+  put_le(out + 12, header.fragment, 2);
+  put_le(out + 14, header.fragments, 2);
+}
+
+/**
+ * @brief Parse a datagram header
+ * @param[in] in received datagram
+ * @param[in] size bytes received
+ * @return false if the datagram is not one of ours or is truncated */
+bool read_datagram_header(const uint8_t *in, size_t size, datagram_header_t &header) {
+  if (size < DATAGRAM_HEADER_SIZE || get_le(in, 4) != DATAGRAM_MAGIC || in[4] > DATAGRAM_SUBSCRIBE) return false;
+
+  header.type      = (datagram_type_t)in[4];
+  header.stream    = in[5];
+  header.length    = (uint16_t)get_le(in + 6, 2);
+  header.sequence  = (uint32_t)get_le(in + 8, 4);
+  header.fragment  = (uint16_t)get_le(in + 12, 2);
+  header.fragments = (uint16_t)get_le(in + 14, 2);
+  return header.stream < MAX_OUTPUTS && DATAGRAM_HEADER_SIZE + (size_t)header.length <= size;
+}
+
+void put_u32(uint8_t *out, uint32_t value) { put_le(out, value, 4); }
+
+uint32_t get_u32(const uint8_t *in) { return (uint32_t)get_le(in, 4); }
@@ -0,0 +1,91 @@
+#include "../include/rateController.hpp"
+
+#include <algorithm>
+
+const rateController::step rateController::levels[] = {{1, 100}, {2, 100}, {2, 75}, {2, 50}};
+const int                  rateController::nLevels  = sizeof(levels) / sizeof(levels[0]);
+
+/**
+ * @param[in] cfg budget, bitrate range and decision log
+ * @param[in] stream output the controller drives, written in the log */
+rateController::rateController(const config &cfg, int stream) : cfg(cfg), stream(stream), kbps(cfg.max_kbps) {}
+
+/**
+ * @brief Take a decision if RATE_INTERVAL_MS elapsed since the last one
+ * @param[in] now_us monotonic time
+ * @param[in] link last sample of the stream link
+ * @return true if the bitrate, the frame rate or the size changed */
+bool rateController::update(uint64_t now_us, const linkSample &link) {
+  if (now_us < nextUs) return false;
+  nextUs = now_us + (uint64_t)RATE_INTERVAL_MS * 1000;
+
+  // Nobody to measure the link with
+  if (link.viewers == 0) return false;
+
+  uint64_t budget = (uint64_t)cfg.budget_ms * 1000;
+  int      before = kbps;
+  int      prev   = level;
+
+  if (link.delay_us > budget) {
+    clearSinceUs = 0;
+
+    if (kbps > cfg.min_kbps) {
+      int target = kbps * 3 / 4;
+      if (link.rate_bps) target = std::min<int64_t>(target, link.rate_bps * 9 / 10 / 1000);
+      kbps       = std::max(cfg.min_kbps, target);
+      overloaded = 0;
+      log(now_us, link, "decrease");
+    } else if (++overloaded >= RATE_DEGRADE_INTERVALS && level < nLevels - 1) {
+      level++;
+      overloaded = 0;
+      log(now_us, link, "degrade");
+    } else {
+      log(now_us, link, "floor");
+    }
+  } else if (link.delay_us < budget / 2) {
+    overloaded = 0;
+    if (clearSinceUs == 0) clearSinceUs = now_us;
+
+    if (level > 0 && now_us - clearSinceUs >= (uint64_t)RATE_UPGRADE_HOLD_MS * 1000) {
+      level--;
+      clearSinceUs = now_us;
+      log(now_us, link, "upgrade");
+    } else if (kbps < cfg.max_kbps) {
+      kbps = std::min(cfg.max_kbps, kbps + std::max(kbps / 16, 1));
+      log(now_us, link, "increase");
+    } else {
+      log(now_us, link, "hold");
+    }
+  } else {
+    overloaded   = 0;
+    clearSinceUs = 0;
+    log(now_us, link, "hold");
+  }
+
+  return kbps != before || level != prev;
+}
+
+/**
+ * @brief Set the ABR target and the VBV of an encoder; before avcodec_open2, or
+ * between two frames of an open libx264 encoder which reconfigures itself
+ * @param[in] bit_rate target in bit/s, also the VBV maximum rate
+ * @param[in] buffer_size VBV buffer in bits */
+void rateController::apply(AVCodecContext *ctx, int64_t bit_rate, int buffer_size) {
+  ctx->bit_rate       = bit_rate;
+  ctx->rc_max_rate    = bit_rate;
+  ctx->rc_buffer_size = buffer_size;
+}
+
+/**
+ * @brief Column names of the decision log */
+void rateController::log_header(FILE *log) {
+  fprintf(log, "time_us,stream,action,delay_us,rate_kbps,queued_bytes,kernel_bytes,viewers,bitrate_kbps,"
+               "frame_divider,scale_percent\n");
+}
+
+void rateController::log(uint64_t now_us, const linkSample &link, const char *action) const {
+  if (cfg.log == NULL) return;
+  fprintf(cfg.log, "%lu,%d,%s,%lu,%lu,%lu,%lu,%d,%d,%d,%d\n", now_us, stream, action, link.delay_us,
+          link.rate_bps / 1000, link.queued_bytes, link.kernel_bytes, link.viewers, kbps, frame_divider(),
+          scale_percent());
+}
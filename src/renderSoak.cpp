@@ -0,0 +1,393 @@
+/**
+ * @brief Soak benchmark of the client render path
+ *
+ * A synthetic stream of --loop-frames frames (a moving gradient and box) is
+ * encoded once, then decoded in a loop for --duration seconds at --fps and
+ * every frame is scaled to RGB32 at the window size, into a frame of the
+ * frameRenderer pool like videoStream does into its window surface. Every
+ * --resize-s the window alternates between --window and half of it, so
+ * the scaler is rebuilt a few times. Every --sample-s a csv line with the
+ * resident set size and the present time of the interval is written: both
+ * should stay flat.
+ *
+ * --legacy builds the scaler and allocates the RGB32 image for every frame,
+ * as the client used to (without its leak), for comparison.
+ *
+ * --present rgb and --present yuv also show the frames in an SDL window like
+ * the client presentation modes, and the csv reports the cpu spent per
+ * frame. With --render-driver software and SDL_VIDEODRIVER=offscreen this
+ * compares the RGB32 conversion with the texture upload without a GPU.
+ */
+#include <SDL.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+}
+
+#include "../include/frameRenderer.hpp"
+#include "../include/latencyHistogram.hpp"
+#include "../include/texturePresenter.hpp"
+
+#define SOAK_DURATION_S 3600
+#define SOAK_FPS 60
+#define SOAK_LOOP_FRAMES 300
+#define SOAK_GOP 60
+#define SOAK_SAMPLE_S 10
+#define SOAK_RESIZE_S 300
+//! @brief frames of the render pool, one being presented and one being filled
+#define SOAK_POOL_FRAMES 2
+
+static int         duration   = SOAK_DURATION_S;
+static int         fps        = SOAK_FPS;
+static int         loopFrames = SOAK_LOOP_FRAMES;
+static int         sampleS    = SOAK_SAMPLE_S;
+static int         resizeS    = SOAK_RESIZE_S;
+static int         streamW    = 1920;
+static int         streamH    = 1080;
+static int         windowW    = 1280;
+static int         windowH    = 720;
+static bool        legacy     = false;
+static const char *csvOut     = NULL;
+static const char *present    = "pool";
+static const char *driver     = NULL;
+
+/**
+ * @brief cpu time of the calling thread, the software renderer works on it */
+static uint64_t thread_cpu_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief resident set size of the process in KiB */
+static long rss_kb() {
+  long  size = 0, resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL) return 0;
+  if (fscanf(statm, "%ld %ld", &size, &resident) != 2) resident = 0;
+  fclose(statm);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * @brief Encode the synthetic stream once, the loop starts on a keyframe */
+static std::vector<AVPacket *> encode_stream() {
+  const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+  if (codec == NULL) {
+    fprintf(stderr, "No H.264 encoder\n");
+    exit(1);
+  }
+  AVCodecContext *ctx = avcodec_alloc_context3(codec);
+  ctx->width          = streamW;
+  ctx->height         = streamH;
+  ctx->time_base      = (AVRational){1, SOAK_FPS};
+  ctx->framerate      = (AVRational){SOAK_FPS, 1};
+  ctx->pix_fmt        = AV_PIX_FMT_YUV420P;
+  ctx->gop_size       = SOAK_GOP;
+  ctx->max_b_frames   = 0;
+  av_opt_set(ctx->priv_data, "preset", "ultrafast", 0);
+  av_opt_set(ctx->priv_data, "tune", "zerolatency", 0);
+  if (avcodec_open2(ctx, codec, NULL) < 0) {
+    fprintf(stderr, "Could not open the encoder\n");
+    exit(1);
+  }
+
+  AVFrame *frame = av_frame_alloc();
+  frame->width   = streamW;
+  frame->height  = streamH;
+  frame->format  = AV_PIX_FMT_YUV420P;
+  if (av_frame_get_buffer(frame, 0) < 0) {
+    fprintf(stderr, "Could not allocate the video frame data\n");
+    exit(1);
+  }
+
+  std::vector<AVPacket *> packets;
+  AVPacket               *pkt = av_packet_alloc();
+  for (int i = 0; i <= loopFrames; i++) {
+    if (i < loopFrames) {
+      av_frame_make_writable(frame);
+      // A gradient scrolling right with a box going down, chroma stays flat
+      for (int y = 0; y < streamH; y++) {
+        uint8_t *row = frame->data[0] + (size_t)y * frame->linesize[0];
+        for (int x = 0; x < streamW; x++) row[x] = (uint8_t)(x + y + i * 4);
+      }
+      int top = (i * 8) % (streamH - 64);
+      for (int y = top; y < top + 64; y++) memset(frame->data[0] + (size_t)y * frame->linesize[0] + 64, 235, 64);
+      for (int p = 1; p < 3; p++) memset(frame->data[p], 128, (size_t)frame->linesize[p] * (streamH / 2));
+      frame->pts = i;
+    }
+
+    // The last turn flushes the encoder
+    int ret = avcodec_send_frame(ctx, i < loopFrames ? frame : NULL);
+    while (ret >= 0) {
+      ret = avcodec_receive_packet(ctx, pkt);
+      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) break;
+      if (ret < 0) {
+        fprintf(stderr, "Error during encoding\n");
+        exit(1);
+      }
+      packets.push_back(av_packet_clone(pkt));
+      av_packet_unref(pkt);
+    }
+  }
+
+  av_packet_free(&pkt);
+  av_frame_free(&frame);
+  avcodec_free_context(&ctx);
+  return packets;
+}
+
+/**
+ * @brief Scale like the client did before frameRenderer: a scaler and an image per frame */
+static void present_legacy(const AVFrame *frame, int width, int height) {
+  SwsContext *conversion = sws_getContext(frame->width, frame->height, (AVPixelFormat)frame->format, width, height,
+                                          AV_PIX_FMT_RGB32, SWS_POINT, NULL, NULL, NULL);
+  uint8_t    *data[4];
+  int         linesize[4];
+  av_image_alloc(data, linesize, width, height, AV_PIX_FMT_RGB32, 1);
+  sws_scale(conversion, frame->data, frame->linesize, 0, frame->height, data, linesize);
+  av_freep(&data[0]);
+  sws_freeContext(conversion);
+}
+
+static void usage(const char *pname) {
+  printf("Usage: %s [options]\n", pname);
+  printf("\n");
+  printf("Options:\n");
+  printf("  --help|-h\t\tThis message\n");
+  printf("  --duration|-T <s>\tLength of the soak (default: %d)\n", SOAK_DURATION_S);
+  printf("  --fps|-F <n>\t\tFrames presented per second, 0 as fast as possible (default: %d)\n", SOAK_FPS);
+  printf("  --loop-frames|-n <n>\tFrames of the synthetic stream, decoded in a loop (default: %d)\n",
+         SOAK_LOOP_FRAMES);
+  printf("  --size|-g <w>x<h>\tSize of the stream (default: 1920x1080)\n");
+  printf("  --window|-w <w>x<h>\tSize of the window (default: 1280x720)\n");
+  printf("  --resize-s|-r <s>\tAlternate the window between its size and half of it every <s>, 0 never\n"
+         "\t\t\t(default: %d)\n",
+         SOAK_RESIZE_S);
+  printf("  --sample-s|-S <s>\tTime between two csv lines (default: %d)\n", SOAK_SAMPLE_S);
+  printf("  --out|-o <f>\t\tWrite the samples to <f> instead of stdout\n");
+  printf("  --legacy|-L\t\tBuild a scaler and allocate an image for every frame, the former client path\n");
+  printf("  --present|-p <p>\t'pool' scales into a frame of the pool, 'rgb' into the surface of a window,\n"
+         "\t\t\t'yuv' uploads the planes to a texture of its renderer (default: pool)\n");
+  printf("  --render-driver|-R <d>\tSDL renderer of --present yuv, 'software' needs no GPU (default: SDL choice)\n");
+}
+
+int main(int argc, char *argv[]) {
+  static struct option longopts[] = {{"duration", required_argument, NULL, 'T'},
+                                     {"fps", required_argument, NULL, 'F'},
+                                     {"loop-frames", required_argument, NULL, 'n'},
+                                     {"size", required_argument, NULL, 'g'},
+                                     {"window", required_argument, NULL, 'w'},
+                                     {"resize-s", required_argument, NULL, 'r'},
+                                     {"sample-s", required_argument, NULL, 'S'},
+                                     {"out", required_argument, NULL, 'o'},
+                                     {"legacy", no_argument, NULL, 'L'},
+                                     {"present", required_argument, NULL, 'p'},
+                                     {"render-driver", required_argument, NULL, 'R'},
+                                     {"help", no_argument, NULL, 'h'},
+                                     {NULL, 0, NULL, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hT:F:n:g:w:r:S:o:Lp:R:", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 'T':
+        duration = atoi(optarg);
+        break;
+      case 'F':
+        fps = atoi(optarg);
+        break;
+      case 'n':
+        loopFrames = atoi(optarg);
+        break;
+      case 'g':
+        if (sscanf(optarg, "%dx%d", &streamW, &streamH) != 2) {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'w':
+        if (sscanf(optarg, "%dx%d", &windowW, &windowH) != 2) {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'r':
+        resizeS = atoi(optarg);
+        break;
+      case 'S':
+        sampleS = atoi(optarg);
+        break;
+      case 'o':
+        csvOut = optarg;
+        break;
+      case 'L':
+        legacy = true;
+        break;
+      case 'p':
+        present = optarg;
+        break;
+      case 'R':
+        driver = optarg;
+        break;
+      case 'h':
+      default:
+        usage(argv[0]);
+        return EXIT_SUCCESS;
+    }
+  }
+  if (duration <= 0 || fps < 0 || loopFrames <= 0 || sampleS <= 0 || resizeS < 0 || streamW < 128 ||
+      streamH < 128 || windowW < 2 || windowH < 2) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  bool presentRGB = strcmp(present, "rgb") == 0;
+  bool presentYUV = strcmp(present, "yuv") == 0;
+  if ((!presentRGB && !presentYUV && strcmp(present, "pool") != 0) || (legacy && (presentRGB || presentYUV))) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FILE *csv = stdout;
+  if (csvOut) {
+    csv = fopen(csvOut, "w");
+    if (csv == NULL) {
+      fprintf(stderr, "Could not open %s\n", csvOut);
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::vector<AVPacket *> packets = encode_stream();
+  printf("soak: %zu packets of %dx%d in the loop, window %dx%d, %s path\n", packets.size(), streamW, streamH,
+         windowW, windowH, legacy ? "legacy" : present);
+
+  const AVCodec  *codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+  AVCodecContext *dec   = avcodec_alloc_context3(codec);
+  if (avcodec_open2(dec, codec, NULL) < 0) {
+    fprintf(stderr, "Could not open the decoder\n");
+    return EXIT_FAILURE;
+  }
+  AVFrame      *frame = av_frame_alloc();
+  frameRenderer renderer(SOAK_POOL_FRAMES);
+
+  SDL_Window                       *window  = NULL;
+  SDL_Renderer                     *sdl     = NULL;
+  SDL_Surface                      *surface = NULL;
+  std::unique_ptr<texturePresenter> presenter;
+  if (presentRGB || presentYUV) {
+    if (driver) SDL_SetHint(SDL_HINT_RENDER_DRIVER, driver);
+    if (SDL_Init(SDL_INIT_VIDEO) < 0 || SDL_CreateWindowAndRenderer(windowW, windowH, 0, &window, &sdl) < 0) {
+      fprintf(stderr, "Could not open the window: %s\n", SDL_GetError());
+      return EXIT_FAILURE;
+    }
+    if (presentYUV) {
+      presenter.reset(new texturePresenter(sdl));
+    } else if ((surface = SDL_GetWindowSurface(window)) == NULL) {
+      fprintf(stderr, "Could not get the window surface: %s\n", SDL_GetError());
+      return EXIT_FAILURE;
+    }
+  }
+
+  latencyHistogram *decodeLatency  = latencyRegistry::instance().create("decode");
+  latencyHistogram *presentLatency = latencyRegistry::instance().create("present");
+  latencyHistogram *presentCpu     = latencyRegistry::instance().create("present_cpu");
+  std::unique_ptr<latencyHistogram> interval(new latencyHistogram());
+
+  fprintf(csv, "time_s,rss_kb,frames,present_p50_us,present_p99_us,present_max_us,present_cpu_us,scaler_rebuilds\n");
+  long     startRss = rss_kb(), maxRss = startRss;
+  uint64_t startUs  = latencyHistogram::now_us();
+  uint64_t nextUs   = startUs;
+  uint64_t sampleUs = startUs + (uint64_t)sampleS * 1000000;
+  uint64_t frames   = 0;
+  uint64_t cpuSum   = 0;  //!< present cpu of the current interval
+
+  for (size_t i = 0;; i = (i + 1) % packets.size()) {
+    uint64_t now = latencyHistogram::now_us();
+    if (now - startUs >= (uint64_t)duration * 1000000) break;
+
+    uint64_t decodeUs = now;
+    if (avcodec_send_packet(dec, packets[i]) < 0) {
+      fprintf(stderr, "Error sending a packet for decoding\n");
+      return EXIT_FAILURE;
+    }
+    while (avcodec_receive_frame(dec, frame) == 0) {
+      uint64_t decodedUs = latencyHistogram::now_us();
+      decodeLatency->record(decodedUs - decodeUs);
+
+      // Half size every other resize period
+      bool small  = resizeS && ((decodedUs - startUs) / ((uint64_t)resizeS * 1000000)) % 2;
+      int  width  = small ? windowW / 2 : windowW;
+      int  height = small ? windowH / 2 : windowH;
+
+      uint64_t cpuUs = thread_cpu_us();
+      if (legacy) {
+        present_legacy(frame, width, height);
+      } else if (presenter) {
+        presenter->upload(0, frame);
+        presenter->draw(0, SDL_FRect{0, 0, (float)width, (float)height});
+        presenter->present();
+      } else if (surface) {
+        SDL_LockSurface(surface);
+        renderer.scale(0, frame, (uint8_t *)surface->pixels, surface->pitch, width, height);
+        SDL_UnlockSurface(surface);
+        SDL_UpdateWindowSurface(window);
+      } else {
+        AVFrame *out = renderer.acquire(width, height);
+        renderer.scale(0, frame, out->data[0], out->linesize[0], width, height);
+        renderer.release(out);
+      }
+      uint64_t presentUs = latencyHistogram::now_us() - decodedUs;
+      presentLatency->record(presentUs);
+      interval->record(presentUs);
+      cpuUs = thread_cpu_us() - cpuUs;
+      presentCpu->record(cpuUs);
+      cpuSum += cpuUs;
+      frames++;
+      decodeUs = latencyHistogram::now_us();
+    }
+
+    now = latencyHistogram::now_us();
+    if (now >= sampleUs) {
+      long rss = rss_kb();
+      if (rss > maxRss) maxRss = rss;
+      fprintf(csv, "%.0f,%ld,%lu,%lu,%lu,%lu,%.1f,%lu\n", (now - startUs) / 1e6, rss, frames,
+              interval->percentile(50), interval->percentile(99), interval->percentile(100),
+              (double)cpuSum / std::max<uint64_t>(1, interval->samples()), renderer.rebuilds());
+      fflush(csv);
+      interval.reset(new latencyHistogram());
+      cpuSum = 0;
+      sampleUs += (uint64_t)sampleS * 1000000;
+    }
+
+    if (fps) {
+      nextUs += 1000000 / fps;
+      now = latencyHistogram::now_us();
+      if (nextUs > now) usleep(nextUs - now);
+    }
+  }
+
+  long endRss = rss_kb();
+  printf("soak: %lu frames in %d s, rss %ld KiB at start, %ld KiB at the end, %ld KiB max, %lu scaler rebuilds\n",
+         frames, duration, startRss, endRss, std::max(maxRss, endRss), renderer.rebuilds());
+  latencyRegistry::instance().print(stdout);
+
+  if (csv != stdout) fclose(csv);
+  presenter.reset();
+  if (window) SDL_Quit();
+  for (AVPacket *pkt : packets) av_packet_free(&pkt);
+  av_frame_free(&frame);
+  avcodec_free_context(&dec);
+  return EXIT_SUCCESS;
+}
@@ -1,5 +1,8 @@
 #include <SDL.h>
+#include <getopt.h>
 #include <stdint.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
@@ -9,11 +12,18 @@
 #include <boost/asio/ip/address.hpp>
 #include <boost/asio/streambuf.hpp>
 #include <boost/thread.hpp>
+#include <algorithm>
+#include <array>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdio>
+#include <cstring>
+#include <deque>
 #include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -30,23 +40,37 @@
 extern "C" {
 #include <libavcodec/codec.h>
 #include <libavcodec/codec_id.h>
+#include <libavutil/adler32.h>
 #include <libavutil/frame.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/log.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/pixfmt.h>
 #include <libswscale/swscale.h>
 #include <xdo.h>
 }
 
+#include "../include/frameMailbox.hpp"
+#include "../include/frameRenderer.hpp"
+#include "../include/latencyHistogram.hpp"
 #include "../include/protocol.hpp"
+#include "../include/texturePresenter.hpp"
+#include "../include/udpReceiver.hpp"
+
+#define STATS_INTERVAL 300
+//! @brief packets read ahead of the decoder before the network thread stops reading
+#define DECODE_QUEUE_PACKETS 32
+#define CURSOR_REFRESH_MS 8
 
 struct _Decode;
 struct _Endpoint;
 
 typedef struct av_thread_args {
-  _Decode   &dec;
-  _Endpoint &end;
+  std::map<int, _Decode> &dec;  //!< one decoder per stream, created on its first packet
+  _Endpoint              *end;  //!< TCP video connection, NULL with --transport udp
+  udpReceiver            *udp;
+  FILE                   *input;  //!< stream recorded with --record, read instead of the network
 } av_thread_args;
 typedef struct c_thread_args {
   _Endpoint &end;
@@ -56,13 +80,115 @@ struct client_SDL {
   SDL_Window   *window        = NULL;
   SDL_Surface  *screenSurface = NULL;
   SDL_Renderer *renderer      = NULL;
-  SDL_Texture  *bmp           = NULL;
-  SDL_Surface  *surf          = NULL;
-  SwsContext   *conversion    = NULL;
+  SDL_Surface  *surf          = NULL;  //!< window surface, NULL with --present yuv
 };
 
 client_SDL client_SDL;
 
+static bool        printStats   = false;
+static int         subscription = ALL_OUTPUTS;
+static int         requestW     = 0;
+static int         requestH     = 0;
+static bool        remoteCursor = false;
+static const char *latencyOut   = NULL;
+static bool        udpTransport = false;
+static udpReceiver *udpVideo    = NULL;
+static int         videoPort    = PORT_AV;
+static bool        joinKeyframe = false;
+static uint64_t    connectUs    = 0;
+static bool        presentYUV   = false;
+static const char *renderDriver = NULL;
+static bool        frameThreads = false;
+static bool        headless     = false;
+static int         duration     = 0;
+static FILE       *recordOut    = NULL;
+static FILE       *checksumOut  = NULL;
+
+/**
+ * @brief Remote cursor drawn over the video on the window surface
+ *
+ * The window pixels under the cursor are saved before drawing, so a move
+ * only touches two small rectangles. The cursor thread only updates the state,
+ * the present thread draws it, it alone touches the window */
+struct cursorOverlay {
+  std::mutex                                lock;
+  std::map<uint32_t, std::vector<uint32_t>> shapes;  //!< premultiplied ARGB keyed by the server hash
+  cursor_packet_t                           state{};
+  std::map<int, int>                        tiles;  //!< stream -> column of the window
+  int                                       tileCount = 1;
+  std::vector<uint32_t>                     under;  //!< window pixels covered by the cursor
+  SDL_Rect                                  drawn{0, 0, 0, 0};
+  bool                                      moved = false;  //!< state changed since the last present
+
+  /**
+   * @brief put back the pixels under the cursor
+   * @return rectangle to refresh, empty if the cursor was not drawn */
+  SDL_Rect restore(SDL_Surface *surf) {
+    SDL_Rect rect = drawn;
+    for (int y = 0; y < drawn.h; y++)
+      memcpy((uint8_t *)surf->pixels + (size_t)(drawn.y + y) * surf->pitch + drawn.x * 4, &under[(size_t)y * drawn.w],
+             drawn.w * 4);
+    drawn.w = drawn.h = 0;
+    return rect;
+  }
+
+  /**
+   * @brief where the current shape goes in a window of this size, scaled like the stream it is on
+   * @return false if there is nothing to draw */
+  bool place(int windowW, int windowH, SDL_Rect &rect) const {
+    auto tile = tiles.find(state.stream);
+    if (!state.visible || !shapes.count(state.hash) || tile == tiles.end() || !state.area_w || !state.area_h)
+      return false;
+
+    double tileW = (double)windowW / tileCount;
+    double sx    = tileW / state.area_w;
+    double sy    = (double)windowH / state.area_h;
+
+    rect.x = (int)(tile->second * tileW + state.x * tileW / 65535 - state.xhot * sx);
+    rect.y = (int)(state.y * (double)windowH / 65535 - state.yhot * sy);
+    rect.w = std::max(1, (int)(state.width * sx));
+    rect.h = std::max(1, (int)(state.height * sy));
+    return true;
+  }
+
+  /**
+   * @brief blend the current shape at the current position on the window surface */
+  void draw(SDL_Surface *surf) {
+    SDL_Rect at;
+    if (!place(surf->w, surf->h, at)) return;
+    auto shape = shapes.find(state.hash);
+
+    int left = at.x, top = at.y, width = at.w, height = at.h;
+
+    int x0 = std::max(left, 0), x1 = std::min(left + width, surf->w);
+    int y0 = std::max(top, 0), y1 = std::min(top + height, surf->h);
+    if (x0 >= x1 || y0 >= y1) return;
+
+    drawn = {x0, y0, x1 - x0, y1 - y0};
+    under.resize((size_t)drawn.w * drawn.h);
+    for (int y = y0; y < y1; y++) {
+      uint32_t *row = (uint32_t *)((uint8_t *)surf->pixels + (size_t)y * surf->pitch);
+      memcpy(&under[(size_t)(y - y0) * drawn.w], row + x0, drawn.w * 4);
+
+      const uint32_t *src = &shape->second[(size_t)((y - top) * state.height / height) * state.width];
+      for (int x = x0; x < x1; x++) {
+        uint32_t s = src[(x - left) * state.width / width];
+        uint32_t a = s >> 24;
+        if (a == 0) continue;
+
+        uint32_t d = row[x], out = 0xff000000;
+        for (int shift = 0; shift < 24; shift += 8)
+          out |= std::min(255u, ((s >> shift) & 0xff) + ((d >> shift) & 0xff) * (255 - a) / 255) << shift;
+        row[x] = out;
+      }
+    }
+  }
+};
+
+static cursorOverlay     cursor;
+static frameRenderer     renderer(0);
+static texturePresenter *presenter = NULL;  //!< --present yuv, owns the window content
+
 uint64_t timeing() {
   struct timeval tv;
 
@@ -71,32 +197,142 @@ uint64_t timeing() {
   return ((uint64_t)tv.tv_sec * 1000000ULL + (uint64_t)tv.tv_usec) / 1000;
 }
 
+static uint64_t time_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 /**
- * @brief parse the input stream
- * @param[in] &buffer this is a buffer containing width, hight and
- * byte size this part si always 64 byte max. It is followed by the ffmpeg
- * package
- * @return this struct conain width, height and image size
- **/
-image_metadata_t parse_header(boost::asio::streambuf &buffer) {
-  std::string data_buff_str = std::string(boost::asio::buffer_cast<const char *>(buffer.data()));
+ * @brief cpu time of the calling thread, the software renderer works on it */
+static uint64_t thread_cpu_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Counters accumulated by the threads when --stats is given, guarded by statsLock */
+struct decodeStats {
+  uint64_t      frames           = 0;  //!< presented
+  uint64_t      decoded          = 0;
+  uint64_t      skipped          = 0;  //!< replaced in a mailbox before the present thread took them
+  uint64_t      bytes            = 0;  //!< compressed bytes received
+  uint64_t      decode_us        = 0;  //!< packet sent to the decoder -> its frame received
+  uint64_t      convert_us       = 0;  //!< frames taken from the mailboxes -> window updated
+  uint64_t      present_cpu_us   = 0;  //!< cpu spent by the present thread in convert and present
+  uint64_t      lost             = 0;  //!< gaps in the packet sequence, dropped by the server for a slow link
+  uint64_t      server_encode_us = 0;  //!< encode time reported in the packet headers
+  uint64_t      start_us         = time_us();
+  AVPixelFormat format           = AV_PIX_FMT_NONE;  //!< format of the last decoded frame
+
+  void print() const {
+    uint64_t wall    = time_us() - start_us;
+    uint64_t divisor = frames ? frames : 1;
+    uint64_t decodes = decoded ? decoded : 1;
 
-  int x_pos    = data_buff_str.find("x");
-  int end_pos  = data_buff_str.find(' ');
-  int end_size = data_buff_str.find('e', end_pos);
+    printf("stats: %s, %lu frames decoded, %lu presented (%.1f fps), %lu skipped, %.1f kbit/s\n",
+           format == AV_PIX_FMT_NONE ? "none" : av_get_pix_fmt_name(format), decoded, frames, frames * 1e6 / wall,
+           skipped, bytes * 8000.0 / wall);
+    printf("stats: server encode %.1f us/frame, decode %.1f us/frame, convert+present %.1f us/frame (%.1f us cpu)\n",
+           (double)server_encode_us / decodes, (double)decode_us / decodes, (double)convert_us / divisor,
+           (double)present_cpu_us / divisor);
+    printf("stats: %lu packets lost\n", lost);
+    if (udpVideo) udpVideo->print_stats(stdout);
+  }
+};
 
-  image_metadata_t meta_data;
-  meta_data.width            = std::stoi(data_buff_str.substr(0, x_pos));
-  meta_data.height           = std::stoi(data_buff_str.substr(x_pos + 1, end_pos));
-  meta_data.image_size_bytes = std::stoi(data_buff_str.substr(end_pos + 1, end_size));
+static decodeStats stats;
+static std::mutex  statsLock;
 
-  return meta_data;
-}
+/**
+ * @brief Packets read by the network thread, waiting for the decode thread
+ *
+ * Bounded: when the decoder falls behind, the network thread stops reading
+ * and the TCP backlog makes the server resync us, rather than the client
+ * buffering seconds of video */
+struct packetQueue {
+  std::mutex                                         lock;
+  std::condition_variable                            changed;
+  std::deque<std::pair<packet_header_t, AVPacket *>> packets;
+  bool                                               closed = false;
+
+  /**
+   * @brief queue a packet, waits while DECODE_QUEUE_PACKETS are queued
+   * @param[in] pkt owned by the queue, then by the decode thread */
+  void push(const packet_header_t &header, AVPacket *pkt) {
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [this] { return packets.size() < DECODE_QUEUE_PACKETS; });
+    packets.emplace_back(header, pkt);
+    changed.notify_all();
+  }
+
+  /**
+   * @brief no more packets, pop returns false once the queue is empty */
+  void close() {
+    std::lock_guard<std::mutex> guard(lock);
+    closed = true;
+    changed.notify_all();
+  }
+
+  /**
+   * @brief next packet, the caller frees it
+   * @return false when the queue is closed and empty */
+  bool pop(packet_header_t &header, AVPacket *&pkt) {
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [this] { return !packets.empty() || closed; });
+    if (packets.empty()) return false;
+    header = packets.front().first;
+    pkt    = packets.front().second;
+    packets.pop_front();
+    changed.notify_all();
+    return true;
+  }
+};
+
+/**
+ * @brief Wakes the present thread when a frame is published in a mailbox
+ *
+ * Only the wake up takes a lock, the frames go through the mailboxes */
+struct presentSignal {
+  std::mutex              lock;
+  std::condition_variable wake;
+  bool                    pending = false;
+  bool                    stop    = false;
+
+  /**
+   * @param[in] last no frame will follow, the present thread ends */
+  void notify(bool last = false) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      pending = true;
+      stop |= last;
+    }
+    wake.notify_one();
+  }
+
+  /**
+   * @return false once stopped, else something was published since the last call */
+  bool wait() {
+    std::unique_lock<std::mutex> guard(lock);
+    wake.wait(guard, [this] { return pending || stop; });
+    bool published = pending && !stop;
+    pending        = false;
+    return published;
+  }
+};
+
+static packetQueue   decodeQueue;
+static frameMailbox  mailboxes[MAX_OUTPUTS];  //!< decode -> present, one per stream
+static presentSignal framesReady;
 
 bool init_show() {
   // Initialization flag
   bool success = true;
 
+  // "software" measures the present cpu without a GPU
+  if (renderDriver) SDL_SetHint(SDL_HINT_RENDER_DRIVER, renderDriver);
+
   // Initialize SDL
   if (SDL_Init(SDL_INIT_VIDEO) < 0) {
     printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
@@ -110,10 +346,11 @@ bool init_show() {
     if (res < 0) {
       printf("Window could not be created! SDL_Error: %s\n", SDL_GetError());
       success = false;
+    } else if (presentYUV) {
+      // The renderer draws the window, its surface is not used
+      presenter = new texturePresenter(client_SDL.renderer);
     } else {
       // Get window surface
-      client_SDL.bmp  = SDL_CreateTexture(client_SDL.renderer, SDL_PIXELFORMAT_BGR24,
-                                          SDL_TextureAccess::SDL_TEXTUREACCESS_STREAMING, 1920, 1080);
       client_SDL.surf = SDL_GetWindowSurface(client_SDL.window);
       SDL_SetSurfaceRLE(client_SDL.surf, 1);
     }
@@ -122,15 +359,39 @@ bool init_show() {
   return success;
 }
 
+/**
+ * @brief adler32 of the visible pixels of a frame, the padding of the rows is left out */
+static uint32_t frame_checksum(const AVFrame *frame) {
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+  uint32_t                  sum  = 1;
+  for (int p = 0; p < av_pix_fmt_count_planes((AVPixelFormat)frame->format); p++) {
+    int width  = av_image_get_linesize((AVPixelFormat)frame->format, frame->width, p);
+    int height = p == 1 || p == 2 ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+    for (int y = 0; y < height; y++)
+      sum = av_adler32_update(sum, frame->data[p] + (size_t)y * frame->linesize[p], width);
+  }
+  return sum;
+}
+
 /**
  * @brief decode ffmpeg package in frame
  * @param[in]  *dec_ctx Context to send packet to decode
  * @param[out] *frame single image frame return from decoded packet
- * @param[in]  *pkt packet to decoded
+ * @param[in]  *pkt packet to decoded, NULL drains the decoder at the end of the stream
+ * @param[out] mailbox of the stream, the decoded frames replace the one not presented yet, NULL to drop them
+ * @param[in]  decodeLatency records the time from a packet to its frame, the frames a threaded decoder holds included
+ * @param[in]  stream id of the stream, for --checksum
+ * @return frames decoded
  **/
-void decode_pkt(AVCodecContext *dec_ctx, AVFrame *frame, AVPacket *pkt) {
-  int ret;
+int decode_pkt(AVCodecContext *dec_ctx, AVFrame *frame, AVPacket *pkt, frameMailbox *mailbox,
+               latencyHistogram *decodeLatency, int stream) {
+  static thread_local AVPixelFormat format = AV_PIX_FMT_NONE;
+  static thread_local uint64_t      frames[MAX_OUTPUTS]{};
+  int                               ret;
+  int                               decoded = 0;
 
+  // The decoder gives the pts back on the frame of this packet, however many frames later
+  if (pkt) pkt->pts = time_us();
   ret = avcodec_send_packet(dec_ctx, pkt);
   if (ret < 0) {
     fprintf(stderr, "Error sending a packet for decoding\n");
@@ -140,32 +401,161 @@ void decode_pkt(AVCodecContext *dec_ctx, AVFrame *frame, AVPacket *pkt) {
   while (ret >= 0) {
     ret = avcodec_receive_frame(dec_ctx, frame);
     if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-      return;
+      return decoded;
     else if (ret < 0) {
       fprintf(stderr, "Error during decoding\n");
       exit(1);
     }
 
-    int width  = frame->width;
-    int height = frame->height;
+    uint64_t decodedUs = time_us();
+    uint64_t decodeUs  = frame->pts == AV_NOPTS_VALUE ? 0 : decodedUs - frame->pts;
+    decodeLatency->record(decodeUs);
+
+    // The server picks the chroma layout: yuv444p for High 4:4:4, yuv420p
+    // when it captures nv12. The scaler takes whatever the decoder returns
+    if (frame->format != format) {
+      printf("stream: %dx%d %s\n", frame->width, frame->height,
+             av_get_pix_fmt_name((AVPixelFormat)frame->format));
+      format = (AVPixelFormat)frame->format;
+    }
+
+    if (checksumOut) fprintf(checksumOut, "%d,%lu,%08x\n", stream, frames[stream], frame_checksum(frame));
+    frames[stream]++;
+
+    bool skipped = false;
+    if (mailbox) {
+      skipped = mailbox->publish(frame, decodedUs);
+      framesReady.notify();
+    }
+    decoded++;
 
-    // Rescale using the window current size
-    int windowW;
-    int windowH;
-    SDL_GetWindowSize(client_SDL.window, &windowW, &windowH);
-    client_SDL.conversion = sws_getContext(width, height, (AVPixelFormat)frame->format, windowW, windowH,
-                                           AVPixelFormat::AV_PIX_FMT_RGB32, SWS_POINT, NULL, NULL, NULL);
+    if (printStats) {
+      std::lock_guard<std::mutex> guard(statsLock);
+      stats.decoded++;
+      stats.skipped += skipped;
+      stats.decode_us += decodeUs;
+      stats.format = format;
+    }
+  }
+  return decoded;
+}
 
-    AVFrame *bgrFrame = av_frame_alloc();
+/**
+ * @brief Show the frames published since the last call, streams side by side
+ * @param[in] mailboxLatency records how long each frame waited in its mailbox
+ * @param[out] first streams whose first frame was presented, shown keeps track
+ * @return frames presented, 0 if every mailbox was empty, the cursor may still have been redrawn */
+static int present_frames(latencyHistogram *mailboxLatency, bool shown[MAX_OUTPUTS], std::vector<int> &first) {
+  // Rescale using the window current size
+  int windowW;
+  int windowH;
+  SDL_GetWindowSize(client_SDL.window, &windowW, &windowH);
+  uint64_t startUs = time_us();
 
-    av_image_alloc(bgrFrame->data, bgrFrame->linesize, width, height, AVPixelFormat::AV_PIX_FMT_RGB32, 1);
+  std::lock_guard<std::mutex>            guard(cursor.lock);
+  std::vector<std::pair<int, AVFrame *>> fresh;  //!< tile and newest frame
+  for (auto &t : cursor.tiles) {
+    uint64_t decodedUs;
+    AVFrame *frame = mailboxes[t.first].take(decodedUs);
+    if (frame == NULL) continue;
+    mailboxLatency->record(startUs - decodedUs);
+    fresh.emplace_back(t.second, frame);
+    if (!shown[t.first]) first.push_back(t.first);
+    shown[t.first] = true;
+  }
+  if (fresh.empty() && !cursor.moved) return 0;
+  cursor.moved = false;
 
+  int tileW = windowW / cursor.tileCount;
+  if (presenter) {
+    // The renderer converts and scales, every tile is drawn again from its texture
+    for (auto &f : fresh) presenter->upload(f.first, f.second);
+    for (int t = 0; t < cursor.tileCount; t++)
+      presenter->draw(t, SDL_FRect{(float)t * tileW, 0, (float)tileW, (float)windowH});
+    SDL_Rect at;
+    if (cursor.place(windowW, windowH, at)) {
+      const cursor_packet_t &c = cursor.state;
+      presenter->overlay(c.hash, cursor.shapes[c.hash].data(), c.width, c.height, at);
+    }
+    presenter->present();
+  } else {
     SDL_LockSurface(client_SDL.surf);
-    sws_scale(client_SDL.conversion, frame->data, frame->linesize, 0, height,
-              (uint8_t *const *)&client_SDL.surf->pixels, &client_SDL.surf->pitch);
+    SDL_Rect rects[2] = {cursor.restore(client_SDL.surf), {0, 0, 0, 0}};
+    // Straight into the window surface, the scaler of the tile is rebuilt only on resize
+    for (auto &f : fresh) {
+      uint8_t *dst = (uint8_t *)client_SDL.surf->pixels + (size_t)f.first * tileW * 4;
+      renderer.scale(f.first, f.second, dst, client_SDL.surf->pitch, tileW, windowH);
+    }
+    cursor.draw(client_SDL.surf);
+    rects[1] = cursor.drawn;
     SDL_UnlockSurface(client_SDL.surf);
 
-    SDL_UpdateWindowSurface(client_SDL.window);
+    // Only the cursor moved: refresh where it was and where it is
+    if (fresh.empty())
+      SDL_UpdateWindowSurfaceRects(client_SDL.window, rects, 2);
+    else
+      SDL_UpdateWindowSurface(client_SDL.window);
+  }
+  return fresh.size();
+}
+
+/**
+ * @brief Present thread: shows the newest decoded frame of every stream
+ *
+ * A slow present, waiting for vsync or the compositor, only makes the
+ * mailboxes skip frames: the decode and network threads never wait for it */
+void th_present() {
+  latencyHistogram *mailboxLatency = latencyRegistry::instance().create("mailbox");
+  latencyHistogram *presentLatency = latencyRegistry::instance().create("present");
+  latencyHistogram *firstFrame     = latencyRegistry::instance().create("first_frame");
+
+  bool shown[MAX_OUTPUTS] = {};
+  init_show();
+  while (framesReady.wait()) {
+    std::vector<int> first;
+    uint64_t         startUs   = time_us();
+    uint64_t         cpuUs     = thread_cpu_us();
+    int              presented = present_frames(mailboxLatency, shown, first);
+    if (presented == 0) continue;
+    presentLatency->record(time_us() - startUs);
+
+    for (int stream : first) {
+      // Time to first frame: connection, first keyframe, decode and present
+      uint64_t firstUs = time_us() - connectUs;
+      firstFrame->record(firstUs);
+      printf("output %d: first frame after %.1f ms\n", stream, firstUs / 1000.0);
+    }
+
+    if (printStats) {
+      std::lock_guard<std::mutex> guard(statsLock);
+      stats.frames += presented;
+      stats.convert_us += time_us() - startUs;
+      stats.present_cpu_us += thread_cpu_us() - cpuUs;
+      if (stats.frames >= STATS_INTERVAL) {
+        stats.print();
+        AVPixelFormat format = stats.format;
+        stats                = decodeStats();
+        stats.format         = format;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Read the layout of a stream from one of its keyframes
+ * @param[out] slices slice NAL units of the picture, the server encodes one per x264 thread
+ * @param[out] profile profile_idc of the SPS, 0 if the packet has none */
+static void probe_keyframe(const AVPacket *pkt, int &slices, int &profile) {
+  slices  = 0;
+  profile = 0;
+  for (int i = 0; i + 3 < pkt->size; i++) {
+    if (pkt->data[i] != 0 || pkt->data[i + 1] != 0 || pkt->data[i + 2] != 1) continue;
+    int type = pkt->data[i + 3] & 0x1f;
+    if (type == 1 || type == 5)
+      slices++;
+    else if (type == 7 && i + 4 < pkt->size)
+      profile = pkt->data[i + 4];
+    i += 3;
   }
 }
 
@@ -173,55 +563,51 @@ void decode_pkt(AVCodecContext *dec_ctx, AVFrame *frame, AVPacket *pkt) {
  * @brief struct to manage ffmpeg decode context
  **/
 struct _Decode {
-  AVPacket        *pkt   = av_packet_alloc();
-  AVFrame         *frame = av_frame_alloc();
-  const AVCodec   *codec = avcodec_find_decoder(AV_CODEC_ID_H264);
-  AVCodecContext  *c     = avcodec_alloc_context3(codec);
-  image_metadata_t header_data;
+  AVPacket         *pkt     = av_packet_alloc();
+  AVFrame          *frame   = av_frame_alloc();
+  const AVCodec    *codec   = avcodec_find_decoder(AV_CODEC_ID_H264);
+  AVCodecContext   *c       = NULL;  //!< opened on the first keyframe of the stream
+  latencyHistogram *latency = NULL;
+  packet_header_t   header_data;
+  bool              started = false;  //!< header_data holds the previous packet of the stream
+  uint64_t          decoded = 0;
 
   /**
-   * @brief Consturctor with macro defined width and height */
-  _Decode() {
-    c->width        = VSIZEW;
-    c->height       = VSIZEH;
-    c->framerate    = (AVRational){15, 1};
-    c->thread_count = 4;
-    c->thread_type  = FF_THREAD_SLICE;
-    // av_opt_set(c->priv_data, "preset", "ultrafast", 0);
-    // av_opt_set(c->priv_data, "tune", "zerolatency", 0);
-
-    frame->width  = VSIZEW;
-    frame->height = VSIZEH;
-    frame->format = AV_PIX_FMT_YUV422P;
-    frame->pts    = 0;
+   * @brief Open the decoder with the threading the stream allows
+   * @param[in] keyframe first keyframe of the stream, its slices are counted
+   * @param[in] stream id of the stream, names its decode histogram
+   *
+   * Frame threading holds one frame per thread, low delay mode never uses
+   * it: slice threads when the server sends several slices, one thread
+   * otherwise. The stream has no B-frames (x264 zerolatency), the decoder
+   * can output each frame as soon as it is decoded. */
+  void open(const AVPacket *keyframe, int stream) {
+    int slices, profile;
+    probe_keyframe(keyframe, slices, profile);
+    int cores = std::max<int>(1, boost::thread::hardware_concurrency());
+
+    c = avcodec_alloc_context3(codec);
+    if (frameThreads) {
+      // Recording playback: throughput matters, not the latency
+      c->thread_type  = FF_THREAD_FRAME;
+      c->thread_count = cores;
+    } else {
+      c->flags |= AV_CODEC_FLAG_LOW_DELAY;
+      // Not for High 4:4:4 (profile 244), only the 4:2:0 streams are known to be safe
+      if (profile != 244) c->flags2 |= AV_CODEC_FLAG2_FAST;
+      c->thread_type  = FF_THREAD_SLICE;
+      c->thread_count = slices > 1 ? std::min(slices, cores) : 1;
+    }
 
     if (avcodec_open2(c, codec, NULL) < 0) {
       fprintf(stderr, "Could not open codec\n");
       exit(1);
     }
+    latency = latencyRegistry::instance().create("decode", stream);
+    const char *mode = frameThreads ? "frame threaded" : slices > 1 ? "low delay slice threaded" : "low delay";
+    printf("output %d: %d slices, profile %d, %s decoding on %d threads\n", stream, slices, profile, mode,
+           c->thread_count);
   }
-  /**
-   * @brief Constructor with parameterized width and height
-   * @param width of the receved frame
-   * @param height of the receved frame
-   **/
-  _Decode(uint16_t width, uint16_t height) {
-    c->width        = width;
-    c->height       = height;
-    c->thread_count = 8;
-    c->thread_type  = FF_THREAD_FRAME;
-    // c->time_base = (AVRational){1, 60};
-    // c->framerate = (AVRational){60, 1};
-
-    frame->width  = width;
-    frame->height = height;
-    frame->format = AV_PIX_FMT_YUV444P;
-    frame->pts    = 0;
-  }
-  _Decode(const _Decode &)            = default;
-  _Decode(_Decode &&)                 = default;
-  _Decode &operator=(const _Decode &) = default;
-  _Decode &operator=(_Decode &&)      = default;
 };
 
 /**
@@ -234,18 +620,22 @@ struct _Endpoint {
 
   /**
    * @brief wrapper of asio read for header
-   * @param[out] rReceiveBuffer buffer where to write data */
-  void readHeader(boost::asio::streambuf &rReceiveBuffer) {
-    size_t header_size = 64;
-    boost::asio::read(socket, rReceiveBuffer, boost::asio::transfer_exactly(header_size), mTcpError);
+   * @param[out] buffer where to write data
+   * @param[in] size bytes to read
+   * @return false if the connection failed */
+  bool readHeader(uint8_t *buffer, size_t size) {
+    boost::asio::read(socket, boost::asio::buffer(buffer, size), boost::asio::transfer_exactly(size), mTcpError);
+    return !mTcpError;
   }
 
   /**
    * @brief wrapper of asio read for packet
    * @param[out] rPacket asio::buffer pointing to ffmpeg packet data
-   * @param[in] byteSize how big is the rPacket in bytes */
-  void readPacket(boost::asio::mutable_buffer &rPacket, size_t byteSize) {
+   * @param[in] byteSize how big is the rPacket in bytes
+   * @return false if the connection failed before byteSize bytes were read */
+  bool readPacket(boost::asio::mutable_buffer &rPacket, size_t byteSize) {
     boost::asio::read(socket, rPacket, boost::asio::transfer_exactly(byteSize), mTcpError);
+    return !mTcpError;
   };
   /**
    * @brief write buffer to socket
@@ -283,41 +673,221 @@ struct _Endpoint {
   boost::system::error_code mTcpError;
 };
 
+/**
+ * @brief Read the next video packet from the TCP connection
+ * @param[out] header parsed packet header
+ * @param[out] pkt receives the encoded data
+ * @param[in] receiveLatency records the packet transfer
+ * @return false if the connection closed, even in the middle of a packet, or the header is not valid */
+static bool receive_tcp(_Endpoint &end, packet_header_t &header, AVPacket *pkt, latencyHistogram *receiveLatency) {
+  // Retrive the binary header from socket, see packet_header_t
+  std::array<uint8_t, HEADER_SIZE> raw;
+  if (!end.readHeader(raw.data(), raw.size())) {
+    std::cerr << "Video connection closed" << std::endl;
+    return false;
+  }
+
+  // Parsing header
+  int headerSize = read_header(raw.data(), header);
+  if (headerSize == 0) {
+    std::cerr << "Bad packet header, another protocol version, a stream or a size out of range" << std::endl;
+    return false;
+  }
+  // Fields appended by a newer server are skipped
+  for (int extra = headerSize - HEADER_SIZE; extra > 0; extra -= HEADER_SIZE)
+    if (!end.readHeader(raw.data(), std::min(extra, HEADER_SIZE))) return false;
+
+  if (av_new_packet(pkt, header.payload_size) < 0) {
+    std::cerr << "Could not allocate a " << header.payload_size << " bytes packet" << std::endl;
+    return false;
+  }
+
+  // Retrive packet from socket
+  boost::asio::mutable_buffer packetData(pkt->data, header.payload_size);
+
+  // Waiting for the header is idle time, only the packet transfer is measured
+  uint64_t receiveUs = time_us();
+  if (!end.readPacket(packetData, header.payload_size)) {
+    std::cerr << "Video connection closed in the middle of a packet" << std::endl;
+    return false;
+  }
+  receiveLatency->record(time_us() - receiveUs);
+  return true;
+}
+
+/**
+ * @brief Read the next video packet of a stream written by --record
+ * @param[out] header parsed packet header
+ * @param[out] pkt receives the encoded data
+ * @return false at the end of the file or on a truncated packet */
+static bool receive_file(FILE *input, packet_header_t &header, AVPacket *pkt) {
+  std::array<uint8_t, HEADER_SIZE> raw;
+  if (fread(raw.data(), raw.size(), 1, input) != 1) return false;
+  if (read_header(raw.data(), header) != HEADER_SIZE) {
+    std::cerr << "Bad packet header, not a recorded stream" << std::endl;
+    return false;
+  }
+  if (av_new_packet(pkt, header.payload_size) < 0) return false;
+  return fread(pkt->data, header.payload_size, 1, input) == 1;
+}
+
+/**
+ * @brief Write a received packet as the server sent it, for --input
+ * @param[in] header header of the packet, rewritten at this protocol version */
+static void record_packet(FILE *out, const packet_header_t &header, const AVPacket *pkt) {
+  std::array<uint8_t, HEADER_SIZE> raw;
+  write_header(header, raw.data());
+  fwrite(raw.data(), raw.size(), 1, out);
+  fwrite(pkt->data, pkt->size, 1, out);
+}
+
+/**
+ * @brief Network thread: reads the video packets and queues them for the decode thread */
 void av_thread_function(av_thread_args args) {
+  latencyHistogram *receiveLatency = latencyRegistry::instance().create("receive");
+  uint64_t          startUs        = time_us();
+
   try {
-    init_show();
     for (;;) {
-      std::unique_ptr<boost::asio::streambuf> receive_buffer = std::make_unique<boost::asio::streambuf>();
-
-      // Retrive 64 bytes header from socket
-      // std::function<void()> fReadHeader = [&]() {
-      args.end.readHeader(*receive_buffer);
-      //};
-
-      // Parsing header
-      // std::function<void()> fParseHeader = [&]() {
-      args.dec.header_data = parse_header(*receive_buffer);
-      av_new_packet(args.dec.pkt, args.dec.header_data.image_size_bytes);
-      //};
-      //_EndpointContext.runIfNoError(fReadHeader, fParseHeader);
-
-      // Retrive packet from socket
-      // std::function<void()> fReadPkt = [&]() {
-      boost::asio::mutable_buffer packetData(args.dec.pkt->data, args.dec.header_data.image_size_bytes);
-
-      args.end.readPacket(packetData, args.dec.header_data.image_size_bytes);
-      //};
-
-      // Decode AV packet
-      // std::function<void()> fDecodePkt = [&]() {
-      decode_pkt(args.dec.c, args.dec.frame, args.dec.pkt);
-      av_packet_unref(args.dec.pkt);
-      // };
-      // _EndpointContext.runIfNoError(fReadPkt, fDecodePkt);
+      if (duration && time_us() - startUs >= (uint64_t)duration * 1000000) break;
+
+      packet_header_t header;
+      AVPacket       *received = av_packet_alloc();
+      bool            ok;
+      if (args.input) {
+        // As fast as the decoder takes them
+        ok = receive_file(args.input, header, received);
+      } else if (args.udp) {
+        // Reassembled and in order, lost packets only leave a sequence gap
+        ok = args.udp->receive(header, received);
+        if (!ok) std::cerr << "Video stream timed out" << std::endl;
+      } else {
+        ok = receive_tcp(*args.end, header, received, receiveLatency);
+      }
+      if (!ok) {
+        av_packet_free(&received);
+        break;
+      }
+      if (recordOut) record_packet(recordOut, header, received);
+      decodeQueue.push(header, received);
     }
   } catch (std::exception &e) {
     std::cerr << e.what() << std::endl;
   }
+  decodeQueue.close();
+}
+
+/**
+ * @brief Decode thread: decodes the queued packets into the mailboxes of their stream */
+void th_decode(av_thread_args args) {
+  packet_header_t   header;
+  AVPacket         *received;
+  latencyHistogram *firstFrame = headless ? latencyRegistry::instance().create("first_frame") : NULL;
+
+  uint64_t frames = 0, bytes = 0, startUs = 0;
+
+  while (decodeQueue.pop(header, received)) {
+    if (startUs == 0) startUs = time_us();
+    bytes += received->size;
+
+    _Decode &dec = args.dec[header.stream];
+    if (printStats) {
+      std::lock_guard<std::mutex> guard(statsLock);
+      stats.bytes += received->size;
+      if (dec.started) {
+        stats.lost += header.sequence - dec.header_data.sequence - 1;
+        stats.server_encode_us += header.encode_us;
+      }
+    }
+    dec.header_data = header;
+    dec.started     = true;
+    av_packet_move_ref(dec.pkt, received);
+    av_packet_free(&received);
+
+    // Nothing decodes before the first keyframe, which also tells how to decode the stream
+    if (dec.c == NULL) {
+      if (header.frame_type != FRAME_IDR) {
+        av_packet_unref(dec.pkt);
+        continue;
+      }
+      dec.open(dec.pkt, header.stream);
+    }
+
+    // Streams are laid side by side in the order of their id
+    if (cursor.tileCount != (int)args.dec.size()) {
+      std::lock_guard<std::mutex> guard(cursor.lock);
+      cursor.tiles.clear();
+      for (auto &d : args.dec) cursor.tiles.emplace(d.first, (int)cursor.tiles.size());
+      cursor.tileCount = args.dec.size();
+    }
+    frameMailbox *mailbox = headless ? NULL : &mailboxes[header.stream];
+    int           decoded = decode_pkt(dec.c, dec.frame, dec.pkt, mailbox, dec.latency, header.stream);
+    av_packet_unref(dec.pkt);
+
+    if (headless && decoded && !dec.decoded) {
+      // Time to first frame, without a window: connection, first keyframe and decode
+      uint64_t first = time_us() - connectUs;
+      firstFrame->record(first);
+      printf("output %d: first frame decoded after %.1f ms\n", header.stream, first / 1000.0);
+    }
+    dec.decoded += decoded;
+    frames += decoded;
+  }
+
+  // A frame threaded decoder still holds up to a frame per thread, they go to
+  // the recording checksum and the window like the others
+  for (auto &d : args.dec) {
+    if (d.second.c == NULL) continue;
+    frameMailbox *mailbox = headless ? NULL : &mailboxes[d.first];
+    int           decoded = decode_pkt(d.second.c, d.second.frame, NULL, mailbox, d.second.latency, d.first);
+    d.second.decoded += decoded;
+    frames += decoded;
+  }
+  framesReady.notify(true);
+
+  if (headless) {
+    latencyHistogram decodeLatency;
+    for (auto &d : args.dec)
+      if (d.second.latency) decodeLatency.merge(*d.second.latency);
+    double wall = startUs ? (time_us() - startUs) / 1e6 : 0;
+    printf("headless: %lu frames in %.1f s, %.1f fps, %.1f kB/s, decode p50 %lu us, p99 %lu us, p99.9 %lu us\n",
+           frames, wall, wall > 0 ? frames / wall : 0, wall > 0 ? bytes / wall / 1000 : 0,
+           decodeLatency.percentile(50), decodeLatency.percentile(99), decodeLatency.percentile(99.9));
+  }
+}
+
+/**
+ * @brief Receive the remote cursor and wake the present thread, at most every CURSOR_REFRESH_MS
+ * @param[in] end endpoint connected to PORT_CURSOR
+ *
+ * Updates that arrived while waiting are folded, only the last position is drawn */
+void th_cursor(_Endpoint &end) {
+  try {
+    for (;;) {
+      uint64_t startUs = time_us();
+
+      do {
+        cursor_packet_t       packet;
+        std::vector<uint32_t> argb;
+        boost::asio::read(end.socket, boost::asio::buffer(&packet, sizeof(packet)));
+        if (packet.size) {
+          argb.resize(packet.size / sizeof(uint32_t));
+          boost::asio::read(end.socket, boost::asio::buffer(argb));
+        }
+
+        std::lock_guard<std::mutex> guard(cursor.lock);
+        if (packet.size) cursor.shapes[packet.hash] = std::move(argb);
+        cursor.state = packet;
+        cursor.moved = true;
+      } while (end.socket.available() >= sizeof(cursor_packet_t));
+      framesReady.notify();
+
+      uint64_t elapsed = time_us() - startUs;
+      if (elapsed < CURSOR_REFRESH_MS * 1000) usleep(CURSOR_REFRESH_MS * 1000 - elapsed);
+    }
+  } catch (std::exception &e) {
+    std::cerr << "Cursor channel: " << e.what() << std::endl;
+  }
 }
 
 void th_send_xdo(c_thread_args arg) {
@@ -359,20 +929,260 @@ TH_SEND_EXIT:
   return;
 }
 
-int main() {
-  _Decode   _DecodeContext;
-  _Endpoint _EndpointAV(REMOTE_IP, PORT_AV);
-  _Endpoint _EndpointC(REMOTE_IP, PORT_XDO);
+/**
+ * Prints usage information.
+ */
+static void usage(const char *pname) {
+  printf("Usage: %s [options]\n", pname);
+  printf("\n");
+  printf("Options:\n");
+  printf("  --help|-h\t\tThis message\n");
+  printf("  --output|-O <n>\tOutput of the server to show, or 'all' side by side (default: all)\n");
+  printf("  --size|-g <w>x<h>\tSize the server encodes at, lower saves bandwidth (default: captured size)\n");
+  printf("  --remote-cursor|-C\tDraw the cursor sent on port %d, the server runs with --cursor remote\n", PORT_CURSOR);
+  printf("  --stats|-s\t\tPrint stream format, decode time and bitrate every %d frames\n", STATS_INTERVAL);
+  printf("  --latency-out|-l <f>\tWrite the receive, decode and present latency histograms to <f> as csv\n"
+         "\t\t\ton SIGUSR1 and on exit, SIGUSR1 prints them on stdout without it\n");
+  printf("  --transport|-t <t>\t'tcp' or 'udp', the server runs with --udp (default: tcp)\n");
+  printf("  --loss|-X <pct>\tDrop this percentage of the received datagrams, udp only\n");
+  printf("  --delay|-D <ms>\tDelay the received datagrams, udp only\n");
+  printf("  --jitter|-J <ms>\tAdd a uniform 0..<ms> delay to the received datagrams, reorders them, udp only\n");
+  printf("  --join|-j <j>\t\t'cache' starts from the last keyframe cached by the server, 'keyframe' waits\n"
+         "\t\t\tfor one forced for us, tcp only (default: cache)\n");
+  printf("  --host|-H <ip>\t\tAddress of the server (default: %s)\n", REMOTE_IP);
+  printf("  --port|-P <n>\t\tVideo port of the server, another one to go through linkProxy (default: %d)\n", PORT_AV);
+  printf("  --present|-p <p>\t'rgb' converts to RGB32 into the window surface, 'yuv' uploads the decoded planes\n"
+         "\t\t\tto a texture the renderer converts and scales (default: rgb)\n");
+  printf("  --decoder|-d <d>\t'low-delay' outputs each frame once decoded, slice threaded if the stream has\n"
+         "\t\t\tslices, 'throughput' frame threaded, a frame late per thread, for recordings\n"
+         "\t\t\t(default: low-delay)\n");
+  printf("  --headless|-n\t\tReceive and decode without a window, print fps, decode times and bytes/s on exit\n");
+  printf("  --duration|-T <s>\tStop reading after <s> seconds (default: until the stream ends)\n");
+  printf("  --checksum|-k <f>\tWrite output,frame,adler32 of every decoded frame to <f>\n");
+  printf("  --record|-w <f>\tWrite the received packets to <f>\n");
+  printf("  --input|-i <f>\t\tRead the packets of a --record file as fast as they decode, no server\n");
+  printf("  --render-driver|-R <d>\tSDL renderer of --present yuv, 'software' needs no GPU (default: SDL choice)\n");
+}
+
+int main(int argc, char *argv[]) {
+  static struct option longopts[] = {{"output", required_argument, NULL, 'O'},
+                                     {"size", required_argument, NULL, 'g'},
+                                     {"remote-cursor", no_argument, NULL, 'C'},
+                                     {"stats", no_argument, NULL, 's'},
+                                     {"latency-out", required_argument, NULL, 'l'},
+                                     {"transport", required_argument, NULL, 't'},
+                                     {"loss", required_argument, NULL, 'X'},
+                                     {"delay", required_argument, NULL, 'D'},
+                                     {"jitter", required_argument, NULL, 'J'},
+                                     {"join", required_argument, NULL, 'j'},
+                                     {"host", required_argument, NULL, 'H'},
+                                     {"port", required_argument, NULL, 'P'},
+                                     {"present", required_argument, NULL, 'p'},
+                                     {"render-driver", required_argument, NULL, 'R'},
+                                     {"decoder", required_argument, NULL, 'd'},
+                                     {"headless", no_argument, NULL, 'n'},
+                                     {"duration", required_argument, NULL, 'T'},
+                                     {"checksum", required_argument, NULL, 'k'},
+                                     {"record", required_argument, NULL, 'w'},
+                                     {"input", required_argument, NULL, 'i'},
+                                     {"help", no_argument, NULL, 'h'},
+                                     {NULL, 0, NULL, 0}};
+
+  lossInjector injector;
+  const char  *inputFile = NULL;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hO:g:Csl:t:X:D:J:j:H:P:p:R:d:nT:k:w:i:", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 'O':
+        subscription = strcmp(optarg, "all") == 0 ? ALL_OUTPUTS : atoi(optarg);
+        if (subscription != ALL_OUTPUTS && (subscription < 0 || subscription >= MAX_OUTPUTS)) {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'g':
+        if (sscanf(optarg, "%dx%d", &requestW, &requestH) != 2 || requestW <= 0 || requestH <= 0) {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'C':
+        remoteCursor = true;
+        break;
+      case 's':
+        printStats = true;
+        break;
+      case 'l':
+        latencyOut = optarg;
+        break;
+      case 't':
+        if (strcmp(optarg, "udp") == 0) {
+          udpTransport = true;
+        } else if (strcmp(optarg, "tcp") == 0) {
+          udpTransport = false;
+        } else {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'X':
+        injector.loss_percent = atof(optarg);
+        break;
+      case 'D':
+        injector.delay_ms = atoi(optarg);
+        break;
+      case 'J':
+        injector.jitter_ms = atoi(optarg);
+        break;
+      case 'j':
+        if (strcmp(optarg, "keyframe") == 0) {
+          joinKeyframe = true;
+        } else if (strcmp(optarg, "cache") == 0) {
+          joinKeyframe = false;
+        } else {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'H':
+        REMOTE_IP = optarg;
+        break;
+      case 'P':
+        videoPort = atoi(optarg);
+        if (videoPort <= 0 || videoPort > 65535) {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'p':
+        if (strcmp(optarg, "yuv") == 0) {
+          presentYUV = true;
+        } else if (strcmp(optarg, "rgb") == 0) {
+          presentYUV = false;
+        } else {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'R':
+        renderDriver = optarg;
+        break;
+      case 'd':
+        if (strcmp(optarg, "throughput") == 0) {
+          frameThreads = true;
+        } else if (strcmp(optarg, "low-delay") == 0) {
+          frameThreads = false;
+        } else {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'n':
+        headless = true;
+        break;
+      case 'T':
+        duration = atoi(optarg);
+        break;
+      case 'k':
+        checksumOut = fopen(optarg, "w");
+        if (checksumOut == NULL) {
+          fprintf(stderr, "Could not open %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'w':
+        recordOut = fopen(optarg, "wb");
+        if (recordOut == NULL) {
+          fprintf(stderr, "Could not open %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'i':
+        inputFile = optarg;
+        break;
+      case 'h':
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  // Before any thread exists, they all inherit the blocked SIGUSR1
+  latencyRegistry::instance().dump_on_signal(latencyOut);
+
+  if (injector.enabled() && !udpTransport) fprintf(stderr, "--loss, --delay and --jitter only apply to udp\n");
+
+  std::map<int, _Decode>       _DecodeContext;
+  std::unique_ptr<_Endpoint>   _EndpointAV;
+  std::unique_ptr<udpReceiver> _ReceiverAV;
+  FILE                        *_InputAV = NULL;
 
   av_log_set_level(AV_LOG_INFO);
 
-  av_thread_args _av_args{_DecodeContext, _EndpointAV};
-  c_thread_args  _c_args{_EndpointC};
+  // Tell the server which output to stream and at which size, "<stream>s
+  // <width>x<height>[ k]" padded to PKTSIZE, 0x0 keeps the captured size, k waits for a forced keyframe
+  std::string subscribe = std::to_string(subscription) + "s " + std::to_string(requestW) + 'x' +
+                          std::to_string(requestH) + (joinKeyframe ? " k" : "") + '\n';
+  subscribe.append(PKTSIZE - subscribe.size(), '0');
+  connectUs = time_us();
+  if (inputFile) {
+    _InputAV = fopen(inputFile, "rb");
+    if (_InputAV == NULL) {
+      fprintf(stderr, "Could not open %s\n", inputFile);
+      return EXIT_FAILURE;
+    }
+  } else if (udpTransport) {
+    // Sent again as a keep-alive by the receiver
+    _ReceiverAV = std::make_unique<udpReceiver>(REMOTE_IP, videoPort, subscribe.data(), injector);
+    udpVideo    = _ReceiverAV.get();
+  } else {
+    _EndpointAV = std::make_unique<_Endpoint>(REMOTE_IP, videoPort);
+    _EndpointAV->writePacket(boost::asio::buffer(&subscribe[0], PKTSIZE));
+  }
+
+  av_thread_args _av_args{_DecodeContext, _EndpointAV.get(), _ReceiverAV.get(), _InputAV};
+
+  if (headless) {
+    // No window, no input and no cursor: only the network and decode threads
+    boost::thread decode_thread(th_decode, _av_args);
+    boost::thread av_thread(av_thread_function, _av_args);
+    av_thread.join();
+    decode_thread.join();
+  } else {
+    // A recorded stream is only shown, there is no server for the input and the cursor
+    std::unique_ptr<_Endpoint> _EndpointC;
+    boost::thread              xdo_thread;
+    std::unique_ptr<_Endpoint> _EndpointCursor;
+    boost::thread              cursor_thread;
+    if (!inputFile) {
+      _EndpointC = std::make_unique<_Endpoint>(REMOTE_IP, PORT_XDO);
+      xdo_thread = boost::thread(th_send_xdo, c_thread_args{*_EndpointC});
+    }
+    if (remoteCursor && !inputFile) {
+      _EndpointCursor = std::make_unique<_Endpoint>(REMOTE_IP, PORT_CURSOR);
+      cursor_thread   = boost::thread(th_cursor, std::ref(*_EndpointCursor));
+    }
+
+    boost::thread present_thread(th_present);
+    boost::thread decode_thread(th_decode, _av_args);
+    boost::thread av_thread(av_thread_function, _av_args);
+    if (xdo_thread.joinable()) xdo_thread.join();
+    av_thread.join();
+    decode_thread.join();
+    present_thread.join();
+    if (cursor_thread.joinable()) cursor_thread.join();
+
+    for (auto &d : _DecodeContext)
+      printf("output %d: %lu frames skipped at present\n", d.first, mailboxes[d.first].skipped());
+  }
+
+  if (_InputAV) fclose(_InputAV);
+  if (recordOut) fclose(recordOut);
+  if (checksumOut) fclose(checksumOut);
 
-  boost::thread av_thread(av_thread_function, _av_args);
-  boost::thread xdo_thread(th_send_xdo, _c_args);
-  xdo_thread.join();
-  av_thread.join();
+  latencyRegistry::instance().print(stdout);
+  if (latencyOut) latencyRegistry::instance().dump(latencyOut);
 
   return 0;
 }
@@ -5,12 +5,20 @@
 #include <boost/asio/error.hpp>
 #include <boost/range.hpp>
 #include <boost/thread/thread.hpp>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <cerrno>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <deque>
 #include <iomanip>
 #include <iostream>
 #include <ostream>
-#include <sstream>
 #include <string>
 #include <vector>
 
@@ -21,31 +29,600 @@ extern "C" {
 #include <libavutil/opt.h>
 }
 
+#include "../include/latencyHistogram.hpp"
 #include "../include/protocol.hpp"
 #include "../include/tcpServer.hpp"
+#include "../include/udpServer.hpp"
 
 tcpServerAV *tcpServerAV::instance = nullptr;
+std::mutex   tcpServerAV::instanceLock;
+int          tcpServerAV::udpPort     = 0;
+int          tcpServerAV::udpFecGroup = 0;
+size_t       tcpServerAV::zerocopyMin = 0;
+bool         tcpServerAV::useUring    = false;
+
+/**
+ * @brief Start accepting viewers on the network thread, then wait for the
+ * first one: the encoders need its requested size */
+tcpServerAV::tcpServerAV()
+    : work(boost::asio::make_work_guard(io_context)),
+      acceptor(io_context, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), PORT_AV)),
+      sampleTimer(io_context),
+      writeLatency(latencyRegistry::instance().create("socket_write")),
+      joinLatency(latencyRegistry::instance().create("first_keyframe")) {
+  start_accept();
+  sample_links();
+  if (udpPort) udp = new udpServerAV(*this, io_context, udpPort, udpFecGroup);
+  if (useUring) {
+    if (uringWriter::available())
+      uring = new uringWriter(io_context, [this](uint64_t user_data, int res) { uring_done(user_data, res); });
+    else
+      std::cout << "io_uring is not available, writing with epoll" << std::endl;
+  }
+  th_network = boost::thread([this]() { io_context.run(); });
+  if (pthread_getcpuclockid(th_network.native_handle(), &networkClock) != 0) networkClock = CLOCK_THREAD_CPUTIME_ID;
+
+  int width, height;
+  requested_size(width, height);
+  std::cout << "Success" << std::endl;
+}
+
+void tcpServerAV::start_accept() {
+  auto v = std::make_shared<viewer>(io_context, nextViewer++);
+  acceptor.async_accept(v->socket, [this, v](const boost::system::error_code &error) {
+    if (!error) {
+      boost::system::error_code ignored;
+      v->socket.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+      if (zerocopyMin) {
+        int one     = 1;
+        v->zerocopy = setsockopt(v->socket.native_handle(), SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+        if (!v->zerocopy) std::cout << "SO_ZEROCOPY: " << strerror(errno) << ", packets are copied" << std::endl;
+      }
+      read_subscription(v);
+    } else {
+      std::cout << "Accept: " << error.message() << std::endl;
+    }
+    start_accept();
+  });
+}
+
+/**
+ * @brief Read the stream and size the viewer wants, a PKTSIZE header
+ * "<stream>s <width>x<height>" padded with '0'. stream is an output index or
+ * ALL_OUTPUTS, a 0x0 size keeps the captured size. The viewer starts with
+ * the cached GOP of each stream, or at the next keyframe, requested now */
+void tcpServerAV::read_subscription(std::shared_ptr<viewer> v) {
+  boost::asio::async_read(
+      v->socket, boost::asio::buffer(v->request.data(), PKTSIZE), boost::asio::transfer_exactly(PKTSIZE),
+      [this, v](const boost::system::error_code &error, std::size_t) {
+        if (error) {
+          std::cout << "Subscription: " << error.message() << std::endl;
+          return;
+        }
+
+        // io_uring returns EAGAIN on a non-blocking socket instead of waiting for room
+        if (uring) fcntl(v->socket.native_handle(), F_SETFL, fcntl(v->socket.native_handle(), F_GETFL) & ~O_NONBLOCK);
+
+        bool burst      = true;
+        v->joinedUs     = latencyHistogram::now_us();
+        v->subscription = subscribed("Viewer " + std::to_string(v->id), v->request.data(), burst);
+        viewers.push_back(v);
+        connected++;
+        if (burst) burst_gop(v);
+        for_streams(v->subscription, [this](int s) { update_depth(s); });
+      });
+}
+
+/**
+ * @brief Keep the packets of the current GOP, on the network thread
+ *
+ * A keyframe starts a new cache, a GOP that grows past GOP_CACHE_BYTES is
+ * forgotten until the next keyframe. The packets are shared, not copied */
+void tcpServerAV::cache_gop(const std::shared_ptr<const sharedPacket> &packet) {
+  int s = packet->stream;
+  if (packet->key) {
+    gop[s].clear();
+    gopBytes[s] = 0;
+  } else if (gop[s].empty()) {
+    return;
+  }
+
+  gopBytes[s] += HEADER_SIZE + packet->pkt->size;
+  if (gopBytes[s] > GOP_CACHE_BYTES) {
+    gop[s].clear();
+    gopBytes[s] = 0;
+    return;
+  }
+  gop[s].push_back(packet);
+}
+
+/**
+ * @brief Queue the cached GOP of every stream of a new viewer, it decodes
+ * from the cached keyframe instead of waiting for the next one
+ *
+ * These packets do not count against VIEWER_QUEUE_PACKETS, a long GOP would
+ * resynchronize the viewer right away, see viewer::burst */
+void tcpServerAV::burst_gop(std::shared_ptr<viewer> v) {
+  for_streams(v->subscription, [this, &v](int s) {
+    if (gop[s].empty()) return;
+    for (const auto &packet : gop[s]) {
+      v->queue.push_back(packet);
+      v->queuedBytes += HEADER_SIZE + packet->pkt->size;
+    }
+    v->queued[s] += gop[s].size();
+    v->burst[s]   = gop[s].size();
+    v->waitKey[s] = false;
+  });
+  if (!v->writing) write_next(v);
+  if (uring) uring->submit();
+}
+
+/**
+ * @brief Account a new viewer, TCP or UDP, on the network thread
+ * @param[in] name printed with the subscription
+ * @param[in] request PKTSIZE text request, see read_subscription
+ * @param[in,out] burst in: the viewer can take the cached GOP, out: it asked
+ * for it, a trailing " k" in the request asks for a forced keyframe instead
+ * @return stream subscribed to, or ALL_OUTPUTS */
+int tcpServerAV::subscribed(const std::string &name, const char *request, bool &burst) {
+  int  subscription = ALL_OUTPUTS, width = 0, height = 0;
+  char join         = 0;
+  if (sscanf(request, "%ds %dx%d %c", &subscription, &width, &height, &join) < 1 || subscription < ALL_OUTPUTS ||
+      subscription >= MAX_OUTPUTS)
+    subscription = ALL_OUTPUTS;
+  if (width <= 0 || height <= 0) width = height = 0;
+  if (join == 'k') burst = false;
+
+  if (subscription == ALL_OUTPUTS)
+    std::cout << name << " subscribed to every output";
+  else
+    std::cout << name << " subscribed to output " << subscription;
+  if (width)
+    std::cout << " at " << width << 'x' << height;
+  else
+    std::cout << " at the captured size";
+
+  {
+    std::lock_guard<std::mutex> lock(sizeLock);
+    if (!firstViewer) {
+      firstViewer = true;
+      requestW    = width;
+      requestH    = height;
+    } else if (width != requestW || height != requestH) {
+      // Every viewer gets the same packets, the stream is not re-encoded
+      std::cout << ", already encoded at ";
+      if (requestW)
+        std::cout << requestW << 'x' << requestH;
+      else
+        std::cout << "the captured size";
+    }
+  }
+  sizeReady.notify_all();
+
+  bool cached = false;
+  for_streams(subscription, [this, burst, &cached](int s) {
+    watchers[s]++;
+    if (burst && !gop[s].empty())
+      cached = true;
+    else
+      request_keyframe(s);
+  });
+  std::cout << (cached ? ", starts from the cached GOP" : ", waits for a keyframe") << std::endl;
+  return subscription;
+}
+
+/**
+ * @brief Account a viewer that left, on the network thread
+ * @param[in] subscription as returned by @ref subscribed */
+void tcpServerAV::unsubscribed(int subscription) {
+  for_streams(subscription, [this](int s) { watchers[s]--; });
+}
+
+/**
+ * @brief Queue a packet for a viewer, on the network thread
+ *
+ * A viewer with VIEWER_QUEUE_PACKETS packets of the stream still queued
+ * is too slow for it: its queued packets of the stream are dropped and it
+ * skips the stream until the next keyframe, unless this packet is one */
+void tcpServerAV::enqueue(std::shared_ptr<viewer> v, const std::shared_ptr<const sharedPacket> &packet) {
+  int s = packet->stream;
+
+  if (v->waitKey[s]) {
+    if (!packet->key) {
+      packets_dropped++;
+      return;
+    }
+    v->waitKey[s] = false;
+  }
+
+  if (v->queued[s] >= VIEWER_QUEUE_PACKETS + v->burst[s]) {
+    // The packet being written stays, the client would lose the stream framing
+    v->burst[s] = 0;
+    auto it     = v->queue.begin() + (v->writing ? 1 : 0);
+    while (it != v->queue.end()) {
+      if ((*it)->stream == s) {
+        v->queuedBytes -= HEADER_SIZE + (*it)->pkt->size;
+        it = v->queue.erase(it);
+        v->queued[s]--;
+        packets_dropped++;
+      } else {
+        ++it;
+      }
+    }
+    resyncs++;
+
+    if (!packet->key) {
+      v->waitKey[s] = true;
+      packets_dropped++;
+      request_keyframe(s);
+      return;
+    }
+  }
+
+  v->queue.push_back(packet);
+  v->queued[s]++;
+  v->queuedBytes += HEADER_SIZE + packet->pkt->size;
+  if (!v->writing) write_next(v);
+}
+
+/**
+ * @brief Refresh the depth of a stream, on the network thread */
+void tcpServerAV::update_depth(int stream) {
+  int least = -1;
+  for (auto &v : viewers)
+    if (v->wants(stream) && (least < 0 || v->queued[stream] < least)) least = v->queued[stream];
+  depth[stream] = least < 0 ? 0 : least;
+}
+
+/**
+ * @brief Write the viewer queue until it is empty or the socket is full
+ *
+ * Each packet goes out in gather sendmsg calls, header and payload straight
+ * from the shared buffers. Payloads of at least zerocopyMin bytes are sent
+ * with MSG_ZEROCOPY when the socket accepts it: the packet then stays in
+ * viewer::pinned until @ref reap_zerocopy sees its completion. */
+void tcpServerAV::write_next(std::shared_ptr<viewer> v) {
+  if (uring) {
+    uring_write(v);
+    return;
+  }
+  reap_zerocopy(*v);
+
+  while (!v->queue.empty()) {
+    const std::shared_ptr<const sharedPacket> &packet = v->queue.front();
+    size_t                                     total  = HEADER_SIZE + packet->pkt->size;
+
+    iovec iov[2];
+    int   count = 0;
+    if (v->frontSent < HEADER_SIZE) {
+      iov[count++] = {(void *)(packet->header.data() + v->frontSent), HEADER_SIZE - v->frontSent};
+      iov[count++] = {packet->pkt->data, (size_t)packet->pkt->size};
+    } else {
+      iov[count++] = {packet->pkt->data + (v->frontSent - HEADER_SIZE), total - v->frontSent};
+    }
+    msghdr msg{};
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = count;
+
+    bool    large = zerocopyMin && (size_t)packet->pkt->size >= zerocopyMin;
+    bool    zero  = large && v->zerocopy;
+    send_calls++;
+    ssize_t sent  = sendmsg(v->socket.native_handle(), &msg, MSG_DONTWAIT | MSG_NOSIGNAL | (zero ? MSG_ZEROCOPY : 0));
+    if (sent < 0 && zero && errno == ENOBUFS) {
+      // Over the optmem limit for pending notifications, this one is copied
+      zero = false;
+      send_calls++;
+      sent = sendmsg(v->socket.native_handle(), &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        wait_writable(v);
+      } else {
+        drop(v, boost::system::error_code(errno, boost::system::system_category()));
+      }
+      return;
+    }
+
+    if (zero) {
+      zerocopy_sends++;
+      v->frontZerocopy = v->zerocopyNext++;
+    } else {
+      copy_sends++;
+      if (large) zerocopy_fallbacks++;
+    }
+    bytes_written += sent;
+    v->written += sent;
+    v->queuedBytes -= sent;
+    v->frontSent += sent;
+    // A partial send, the next call most likely waits for room
+    if (v->frontSent < total) continue;
+    written(v);
+  }
+  v->writing = false;
+}
+
+/**
+ * @brief The front packet of the viewer queue is fully written, pop it */
+void tcpServerAV::written(std::shared_ptr<viewer> v) {
+  const std::shared_ptr<const sharedPacket> &packet = v->queue.front();
+  writeLatency->record(latencyHistogram::now_us() - packet->queued_us);
+  if (v->frontZerocopy >= 0) v->pinned.emplace_back((uint32_t)v->frontZerocopy, packet);
+  v->frontZerocopy = -1;
+  v->frontSent     = 0;
+
+  int stream = packet->stream;
+  if (!v->started[stream]) {
+    // Time to first frame as far as the server goes, the viewer still has to decode it
+    uint64_t join = latencyHistogram::now_us() - v->joinedUs;
+    joinLatency->record(join);
+    v->started[stream] = true;
+    std::cout << "Viewer " << v->id << ": first keyframe of output " << stream << " written after "
+              << join / 1000.0 << " ms" << (v->burst[stream] ? ", from the cache" : "") << std::endl;
+  }
+  if (v->burst[stream]) v->burst[stream]--;
+  v->queued[stream]--;
+  v->queue.pop_front();
+  update_depth(stream);
+}
+
+/**
+ * @brief Queue the io_uring write of the rest of the front packet, submitted by the caller
+ *
+ * A packet in the registered pool goes out in one fixed write, the others as
+ * a header write linked to the payload write. A viewer has one packet in
+ * flight at a time, writes to the same socket would not keep their order. */
+void tcpServerAV::uring_write(std::shared_ptr<viewer> v) {
+  if (v->queue.empty()) {
+    v->writing = false;
+    return;
+  }
+  v->writing         = true;
+  v->chainError      = 0;
+  uringWriting[v->id] = v;
+
+  const sharedPacket &packet = *v->queue.front();
+  size_t              total  = HEADER_SIZE + packet.pkt->size;
+  int                 fd     = v->socket.native_handle();
+  // The last write of the chain is tagged, it completes even when a short write cancels it
+  uint64_t            tag    = (uint64_t)v->id << 1;
+
+  if (packet.slot >= 0) {
+    uring->write(fd, uring->slot_data(packet.slot) + v->frontSent, total - v->frontSent, packet.slot, false, tag | 1);
+  } else if (v->frontSent < HEADER_SIZE) {
+    uring->write(fd, packet.header.data() + v->frontSent, HEADER_SIZE - v->frontSent, -1, true, tag);
+    uring->write(fd, packet.pkt->data, packet.pkt->size, -1, false, tag | 1);
+  } else {
+    uring->write(fd, packet.pkt->data + (v->frontSent - HEADER_SIZE), total - v->frontSent, -1, false, tag | 1);
+  }
+}
+
+/**
+ * @brief Completion of a write queued by @ref uring_write, on the network thread
+ *
+ * Once the last write of the chain is back the packet is popped, or the rest
+ * of it written again after a short write. */
+void tcpServerAV::uring_done(uint64_t user_data, int res) {
+  auto it = uringWriting.find(user_data >> 1);
+  if (it == uringWriting.end()) return;
+  std::shared_ptr<viewer> v = it->second;
+
+  if (res > 0) {
+    bytes_written += res;
+    v->written += res;
+    v->queuedBytes -= res;
+    v->frontSent += res;
+  } else if (res != -ECANCELED && v->chainError == 0) {
+    // 0 on a socket that is not writable any more
+    v->chainError = res ? -res : EPIPE;
+  }
+  if (!(user_data & 1)) return;
+
+  uringWriting.erase(it);
+  // Dropped while the write was in flight
+  if (!v->socket.is_open()) return;
+  if (v->chainError) {
+    drop(v, boost::system::error_code(v->chainError, boost::system::system_category()));
+    return;
+  }
+
+  if (v->frontSent == HEADER_SIZE + (size_t)v->queue.front()->pkt->size) written(v);
+  uring_write(v);
+}
+
+/**
+ * @brief Resume @ref write_next once the socket send buffer has room */
+void tcpServerAV::wait_writable(std::shared_ptr<viewer> v) {
+  v->writing = true;
+  v->socket.async_wait(boost::asio::ip::tcp::socket::wait_write, [this, v](const boost::system::error_code &error) {
+    // Aborted when the viewer was dropped, its socket is closed
+    if (error == boost::asio::error::operation_aborted) return;
+    if (error) {
+      drop(v, error);
+      return;
+    }
+    write_next(v);
+  });
+}
+
+/**
+ * @brief Release the packets the kernel no longer reads, from the MSG_ZEROCOPY
+ * completions on the socket error queue. Called before each write and by
+ * @ref sample_links, so a packet is kept at most about LINK_SAMPLE_MS after
+ * its completion
+ *
+ * A completion covers the inclusive range [ee_info, ee_data] of send ids,
+ * TCP completes them in order. */
+void tcpServerAV::reap_zerocopy(viewer &v) {
+  while (!v.pinned.empty()) {
+    char   control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+    msghdr msg{};
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(v.socket.native_handle(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+
+    for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+        continue;
+      const sock_extended_err *error = (const sock_extended_err *)CMSG_DATA(cm);
+      if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+      if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) zerocopy_copied += error->ee_data - error->ee_info + 1;
+      while (!v.pinned.empty() && (int32_t)(v.pinned.front().first - error->ee_data) <= 0) v.pinned.pop_front();
+    }
+  }
+}
+
+/**
+ * @brief Estimate the queuing delay of every viewer, then publish the least
+ * delayed viewer of each stream. Runs on the network thread every LINK_SAMPLE_MS
+ *
+ * Bytes leave the send queue at the rate the link delivers them, what sits
+ * in our queue and in the socket takes backlog / rate to get through. */
+void tcpServerAV::sample_links() {
+  uint64_t now     = latencyHistogram::now_us();
+  uint64_t elapsed = lastSampleUs ? now - lastSampleUs : 0;
+  lastSampleUs     = now;
+
+  for (auto &v : viewers) {
+    reap_zerocopy(*v);
+
+    int outq = 0;
+    if (ioctl(v->socket.native_handle(), TIOCOUTQ, &outq) < 0) outq = 0;
+
+    uint64_t delivered = v->written - std::min<uint64_t>(outq, v->written);
+    if (elapsed) {
+      uint64_t rate = (delivered - v->delivered) * 8 * 1000000 / elapsed;
+      // Smoothed over about four samples
+      v->link.rate_bps = v->link.rate_bps ? (3 * v->link.rate_bps + rate) / 4 : rate;
+    }
+    v->delivered = delivered;
+
+    v->link.queued_bytes = v->queuedBytes;
+    v->link.kernel_bytes = outq;
+    uint64_t backlog     = v->queuedBytes + outq;
+    v->link.delay_us     = backlog * 8 * 1000000 / std::max<uint64_t>(v->link.rate_bps, LINK_MIN_RATE_BPS);
+  }
+
+  for (int s = 0; s < MAX_OUTPUTS; s++) {
+    const viewer *best = NULL;
+    for (auto &v : viewers)
+      if (v->wants(s) && (best == NULL || v->link.delay_us < best->link.delay_us)) best = v.get();
+    linkSample link = best ? best->link : linkSample();
+    linkDelay[s]    = link.delay_us;
+    linkRate[s]     = link.rate_bps;
+    linkQueued[s]   = link.queued_bytes;
+    linkKernel[s]   = link.kernel_bytes;
+  }
+
+  sampleTimer.expires_after(std::chrono::milliseconds(LINK_SAMPLE_MS));
+  sampleTimer.async_wait([this](const boost::system::error_code &error) {
+    if (!error) sample_links();
+  });
+}
+
+/**
+ * @brief Last link state of a stream, see sample_links */
+linkSample tcpServerAV::link_sample(int stream) const {
+  linkSample link;
+  link.delay_us     = linkDelay[stream];
+  link.rate_bps     = linkRate[stream];
+  link.queued_bytes = linkQueued[stream];
+  link.kernel_bytes = linkKernel[stream];
+  link.viewers      = watchers[stream];
+  return link;
+}
+
+/**
+ * @brief Forget a viewer whose connection failed, its queued packets are released */
+void tcpServerAV::drop(std::shared_ptr<viewer> v, const boost::system::error_code &error) {
+  std::cout << "Viewer " << v->id << " left: " << error.message() << std::endl;
+
+  boost::system::error_code ignored;
+  // Fails the io_uring writes still waiting for room, they hold the viewer
+  v->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+  v->socket.close(ignored);
+  // The packet of an io_uring write in flight is read by the kernel until it completes
+  if (uringWriting.count(v->id))
+    v->queue.erase(v->queue.begin() + 1, v->queue.end());
+  else
+    v->queue.clear();
+  v->pinned.clear();
+  v->writing = false;
+
+  viewers.remove(v);
+  connected--;
+  unsubscribed(v->subscription);
+  for_streams(v->subscription, [this](int s) { update_depth(s); });
+}
+
+/**
+ * @brief Hand a packet to every viewer of its stream, on the network thread */
+void tcpServerAV::fan_out(std::shared_ptr<const sharedPacket> packet) {
+  cache_gop(packet);
+  for (auto &v : viewers)
+    if (v->wants(packet->stream)) enqueue(v, packet);
+  if (uring) uring->submit();
+  if (udp) udp->send(*packet);
+  update_depth(packet->stream);
+  posted[packet->stream]--;
+}
+
+/**
+ * @brief true if a viewer waits for a keyframe of the stream and one can be forced now,
+ * at most every KEYFRAME_MIN_INTERVAL_MS so a viewer that keeps falling behind
+ * does not fill the stream with keyframes
+ * @param[in] stream output the calling encoder thread encodes, it is the only one calling for it */
+bool tcpServerAV::keyframe_due(int stream) const {
+  return keyframeRequest[stream] &&
+         latencyHistogram::now_us() - lastKeyframeUs[stream] >= (uint64_t)KEYFRAME_MIN_INTERVAL_MS * 1000;
+}
+
+/**
+ * @brief Tell the encoder of a stream to make the next frame a keyframe
+ * @param[in] stream output the calling encoder thread encodes
+ * @return true once per request, see @ref keyframe_due */
+bool tcpServerAV::take_keyframe_request(int stream) {
+  if (!keyframe_due(stream)) return false;
+
+  keyframeRequest[stream] = false;
+  lastKeyframeUs[stream]  = latencyHistogram::now_us();
+  keyframes_forced++;
+  return true;
+}
 
 /**
  * @brief Encode a passed frame in a packet send it to @ref tcpServer::send_frame
- * @param[in] video_param struct containing the AV Codec Context and the source frame */
+ * @param[in] video_param struct containing the AV Codec Context, the source frame and the stage histograms */
 void tcpServerAV::encode_send(videoThreadParams *video_param) {
-  int ret;
+  encodeTiming &timing = video_param->timing;
+  int           ret;
+
+  // Late joiners and viewers that fell behind start over from a keyframe
+  video_param->frame->pict_type =
+      take_keyframe_request(video_param->stream) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
 
+  uint64_t start = latencyHistogram::now_us();
+  timing.sent(video_param->frame, start);
   ret = avcodec_send_frame(video_param->ctx, video_param->frame);
   if (ret < 0) {
     fprintf(stderr, "Error sending a frame for encoding\n");
     exit(1);
   }
+  video_param->send_frame->record(latencyHistogram::now_us() - start);
 
   while (ret >= 0) {
-    ret = avcodec_receive_packet(video_param->ctx, video_param->pkt);
+    start = latencyHistogram::now_us();
+    ret   = avcodec_receive_packet(video_param->ctx, video_param->pkt);
     if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
       return;
     else if (ret < 0) {
       fprintf(stderr, "Error during encoding\n");
       exit(1);
     }
+    uint64_t now = latencyHistogram::now_us();
+    video_param->receive_packet->record(now - start);
+    timing.received(video_param->pkt, now);
 
     tcpServerAV::send_frame(video_param);
     av_packet_unref(video_param->pkt);
@@ -55,33 +632,70 @@ void tcpServerAV::encode_send(videoThreadParams *video_param) {
  * @brief Send a frame using the tcp socket defined in the class
  * @param[in] video_param struct containing the original AV frame and the encoded AV packet */
 int tcpServerAV::send_frame(videoThreadParams *video_param) {
-  std::stringstream header_stream;
+  packet_header_t header;
+  header.stream = video_param->stream;
+  header.width  = video_param->frame->width;
+  header.height = video_param->frame->height;
+  video_param->timing.fill(video_param->pkt, header);
+  return send_packet(video_param->pkt, header);
+}
+/**
+ * @brief Broadcast an encoded packet to the viewers of its stream, without waiting for the writes
+ * @param[in] pkt encoded AV packet, a new reference is taken so the caller can unref it
+ * @param[in] header stream, size and timing of the packet; the sequence, frame type and
+ * payload size are filled here
+ * @return @ref queue_depth of the stream before this packet */
+int tcpServerAV::send_packet(AVPacket *pkt, packet_header_t header) {
+  int stream = header.stream;
+  if (!watched(stream)) return 0;
 
-  header_stream << video_param->frame->width << 'x' << video_param->frame->height << " "
-                << std::to_string(video_param->pkt->buf->size) << 'e' << std::endl;
+  auto packet = std::make_shared<sharedPacket>();
+  if (av_packet_ref(packet->pkt, pkt) < 0) {
+    fprintf(stderr, "Could not reference the encoded packet\n");
+    exit(1);
+  }
 
-  std::flush(header_stream);
+  packet->stream    = stream;
+  packet->key       = pkt->flags & AV_PKT_FLAG_KEY;
+  packet->queued_us = latencyHistogram::now_us();
 
-  std::string header = header_stream.str();
-  header.append(PKTSIZE - header.size(), '0');
+  header.sequence     = sequence[stream]++;
+  header.frame_type   = packet->key ? FRAME_IDR : FRAME_P;
+  header.payload_size = pkt->size;
+  write_header(header, packet->header.data());
+
+  // Copied here on the encoder thread, the network thread only submits
+  if (uring && connected > 0) {
+    packet->slot = uring->acquire(HEADER_SIZE + pkt->size);
+    if (packet->slot >= 0) {
+      packet->pool = uring;
+      memcpy(uring->slot_data(packet->slot), packet->header.data(), HEADER_SIZE);
+      memcpy(uring->slot_data(packet->slot) + HEADER_SIZE, pkt->data, pkt->size);
+    }
+  }
 
-  boost::system::error_code ignored_error;
+  bytes_sent[stream] += HEADER_SIZE + pkt->size;
 
-  auto send = std::make_unique<std::array<boost::asio::const_buffer, 2>>(std::array<boost::asio::const_buffer, 2>{
-      boost::asio::buffer(header, PKTSIZE),
-      boost::asio::buffer(video_param->pkt->buf->data, video_param->pkt->buf->size)});
+  int queued = queue_depth(stream);
+  posted[stream]++;
 
-  io_context.restart();
-  boost::asio::async_write(*socket, *send, [](boost::system::error_code ec, std::size_t) {
-    if (ec) std::cout << "Lambda Send: " << ec.message() << std::endl;
-  });
+  std::shared_ptr<const sharedPacket> shared = std::move(packet);
+  boost::asio::post(io_context, [this, shared]() { fan_out(shared); });
+  return queued;
+}
 
-  try {
-    io_context.run();
-  } catch (std::exception e) {
-    std::cout << e.what() << std::endl;
-  }
+void tcpServerAV::print_stats(FILE *out) const {
+  fprintf(out, "viewers: %d connected, %lu bytes written, %lu packets dropped, %lu resyncs, %lu keyframes forced\n",
+          connected.load(), bytes_written.load(), packets_dropped.load(), resyncs.load(), keyframes_forced.load());
 
-  // boost::asio::write(*socket, *send, ignored_error);
-  return 0;
+  // What the writes cost, to compare epoll and io_uring
+  timespec cpu;
+  if (clock_gettime(networkClock, &cpu) == 0)
+    fprintf(out, "network thread: %.3f s cpu, %lu sendmsg calls\n", cpu.tv_sec + cpu.tv_nsec / 1e9,
+            send_calls.load());
+  if (uring) uring->print_stats(out);
+  if (zerocopyMin)
+    fprintf(out, "zerocopy: %lu sends, %lu copied by the kernel anyway, %lu fallbacks to copy, %lu copy sends\n",
+            zerocopy_sends.load(), zerocopy_copied.load(), zerocopy_fallbacks.load(), copy_sends.load());
+  if (udp) udp->print_stats(out);
 }
@@ -0,0 +1,112 @@
+#include "../include/texturePresenter.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+}
+
+/**
+ * @param[in] renderer of the window, textures are created on it */
+texturePresenter::texturePresenter(SDL_Renderer *renderer) : renderer(renderer) {}
+
+texturePresenter::~texturePresenter() {
+  for (auto &t : tiles) SDL_DestroyTexture(t.second.texture);
+  if (cursor) SDL_DestroyTexture(cursor);
+}
+
+/**
+ * @brief Copy a decoded frame into the texture of its tile
+ * @param[in] tile the texture is recreated only when the size or the format of its frames change
+ * @param[in] frame decoded frame, its planes are read as they are */
+void texturePresenter::upload(int tile, const AVFrame *frame) {
+  tileTexture &t = tiles[tile];
+  if (t.texture == NULL || t.width != frame->width || t.height != frame->height || t.format != frame->format) {
+    uint32_t sdl_format;
+    switch (frame->format) {
+      case AV_PIX_FMT_YUV420P:
+        sdl_format = SDL_PIXELFORMAT_IYUV;
+        break;
+      case AV_PIX_FMT_NV12:
+        sdl_format = SDL_PIXELFORMAT_NV12;
+        break;
+      default:
+        sdl_format = SDL_PIXELFORMAT_ARGB8888;
+        break;
+    }
+
+    if (t.texture) SDL_DestroyTexture(t.texture);
+    t.texture = SDL_CreateTexture(renderer, sdl_format, SDL_TEXTUREACCESS_STREAMING, frame->width, frame->height);
+    if (t.texture == NULL) {
+      fprintf(stderr, "Could not create a %dx%d texture: %s\n", frame->width, frame->height, SDL_GetError());
+      exit(1);
+    }
+    t.width  = frame->width;
+    t.height = frame->height;
+    t.format = (AVPixelFormat)frame->format;
+    printf("present: tile %d %s %s texture\n", tile, av_get_pix_fmt_name(t.format),
+           sdl_format == SDL_PIXELFORMAT_ARGB8888 ? "converted to an RGB32" : "uploaded to a YUV");
+  }
+
+  switch (t.format) {
+    case AV_PIX_FMT_YUV420P:
+      SDL_UpdateYUVTexture(t.texture, NULL, frame->data[0], frame->linesize[0], frame->data[1], frame->linesize[1],
+                           frame->data[2], frame->linesize[2]);
+      break;
+    case AV_PIX_FMT_NV12:
+      SDL_UpdateNVTexture(t.texture, NULL, frame->data[0], frame->linesize[0], frame->data[1], frame->linesize[1]);
+      break;
+    default: {
+      // No planar 4:4:4 texture in SDL, converted at the stream size and scaled by the renderer
+      void *pixels;
+      int   pitch;
+      if (SDL_LockTexture(t.texture, NULL, &pixels, &pitch) < 0) {
+        fprintf(stderr, "Could not lock the texture: %s\n", SDL_GetError());
+        exit(1);
+      }
+      converter.scale(tile, frame, (uint8_t *)pixels, pitch, frame->width, frame->height);
+      SDL_UnlockTexture(t.texture);
+      nFallbacks++;
+      break;
+    }
+  }
+}
+
+/**
+ * @brief Draw the last frame of a tile, nothing before its first upload
+ * @param[in] dst rectangle of the window, the renderer scales the texture to it */
+void texturePresenter::draw(int tile, const SDL_FRect &dst) {
+  auto t = tiles.find(tile);
+  if (t == tiles.end()) return;
+  SDL_RenderTexture(renderer, t->second.texture, NULL, &dst);
+}
+
+/**
+ * @brief Blend the cursor over the tiles drawn so far
+ * @param[in] hash identifies the shape, the texture is uploaded again only when it changes
+ * @param[in] argb premultiplied ARGB pixels of the shape, width x height
+ * @param[in] dst window rectangle, the shape is scaled to it */
+void texturePresenter::overlay(uint32_t hash, const uint32_t *argb, int width, int height, const SDL_Rect &dst) {
+  if (cursor == NULL || cursorHash != hash) {
+    if (cursor) SDL_DestroyTexture(cursor);
+    cursor = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, width, height);
+    if (cursor == NULL) return;
+    SDL_UpdateTexture(cursor, NULL, argb, width * 4);
+    // The server sends premultiplied alpha
+    SDL_BlendMode premultiplied =
+        SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD,
+                                   SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD);
+    SDL_SetTextureBlendMode(cursor, premultiplied);
+    cursorHash = hash;
+  }
+  SDL_FRect rect = {(float)dst.x, (float)dst.y, (float)dst.w, (float)dst.h};
+  SDL_RenderTexture(renderer, cursor, NULL, &rect);
+}
+
+/**
+ * @brief Show what was drawn, the next frame starts from a cleared target */
+void texturePresenter::present() {
+  SDL_RenderPresent(renderer);
+  SDL_RenderClear(renderer);
+}
@@ -0,0 +1,292 @@
+/**
+ * @brief Loopback benchmark of the video transport
+ *
+ * A producer thread stands in for capture + encode: it hands a packet of
+ * --bytes to the transport every 1/--fps s, while --viewers local clients read
+ * the stream and sleep --read-ms after each packet to emulate a slow link.
+ * The "cadence" histogram is the time between two produced frames and
+ * "enqueue" the time the producer spent handing a packet over. With
+ * --late-ms the viewers after the first join mid-stream, "first_keyframe_rx"
+ * is the time from their connection to the first keyframe they read.
+ *
+ * --mode async goes through tcpServerAV, --mode blocking writes each packet
+ * on the producer thread like the server used to, for comparison.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <boost/thread/thread.hpp>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "../include/latencyHistogram.hpp"
+#include "../include/protocol.hpp"
+#include "../include/tcpServer.hpp"
+
+#define BENCH_FPS 60
+#define BENCH_BYTES 100000
+#define BENCH_FRAMES 600
+#define BENCH_GOP 60
+
+static int         fps     = BENCH_FPS;
+static int         bytes   = BENCH_BYTES;
+static int         frames  = BENCH_FRAMES;
+static int         viewers = 1;
+static int         readMs  = 0;
+static int         zeroMin = 0;
+static bool        ioUring = false;
+static int         lateMs  = 0;
+static bool        joinKey = false;
+static bool        async   = true;
+static const char *host    = "127.0.0.1";
+
+static std::atomic<uint64_t> received{0};
+
+/**
+ * @brief Loopback viewer: subscribe to every stream, then read packets until the server goes away
+ * @param[in] late connect after --late-ms */
+static void viewer_thread(bool late) {
+  // One per viewer thread, a histogram has a single writer, the registry merges them by name
+  latencyHistogram *firstKeyframe = latencyRegistry::instance().create("first_keyframe_rx");
+  if (late) usleep(lateMs * 1000);
+
+  boost::asio::io_context      io;
+  boost::asio::ip::tcp::socket socket(io);
+  boost::system::error_code    error;
+
+  // The server may not be listening yet
+  for (int i = 0; i < 100; i++) {
+    socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string(host), PORT_AV), error);
+    if (!error) break;
+    socket.close();
+    usleep(10000);
+  }
+  if (error) {
+    fprintf(stderr, "Could not connect: %s\n", error.message().c_str());
+    return;
+  }
+
+  uint64_t    connectedUs = latencyHistogram::now_us();
+  bool        started     = false;
+  std::string subscribe   = std::to_string(ALL_OUTPUTS) + "s 0x0" + (joinKey ? " k" : "") + '\n';
+  subscribe.append(PKTSIZE - subscribe.size(), '0');
+  boost::asio::write(socket, boost::asio::buffer(subscribe), error);
+
+  std::vector<char> packet;
+  for (;;) {
+    std::array<uint8_t, HEADER_SIZE> raw;
+    boost::asio::read(socket, boost::asio::buffer(raw), error);
+    if (error) return;
+
+    packet_header_t header;
+    if (read_header(raw.data(), header) != HEADER_SIZE) return;
+    packet.resize(header.payload_size);
+    boost::asio::read(socket, boost::asio::buffer(packet), error);
+    if (error) return;
+
+    if (!started && header.frame_type == FRAME_IDR) {
+      firstKeyframe->record(latencyHistogram::now_us() - connectedUs);
+      started = true;
+    }
+    received++;
+    if (readMs) usleep(readMs * 1000);
+  }
+}
+
+/**
+ * @brief Write header and packet on the producer thread, returns once the kernel took everything */
+static void send_blocking(boost::asio::ip::tcp::socket &socket, AVPacket *pkt, packet_header_t header) {
+  static uint32_t sequence = 0;
+
+  std::array<uint8_t, HEADER_SIZE> raw;
+  header.sequence     = sequence++;
+  header.frame_type   = pkt->flags & AV_PKT_FLAG_KEY ? FRAME_IDR : FRAME_P;
+  header.payload_size = pkt->size;
+  write_header(header, raw.data());
+
+  std::array<boost::asio::const_buffer, 2> buffers{boost::asio::buffer(raw),
+                                                   boost::asio::buffer(pkt->data, pkt->size)};
+  boost::system::error_code                error;
+  boost::asio::write(socket, buffers, error);
+}
+
+static void usage(const char *pname) {
+  printf("Usage: %s [options]\n", pname);
+  printf("\n");
+  printf("Options:\n");
+  printf("  --help|-h\t\tThis message\n");
+  printf("  --mode|-M <mode>\t'async' uses tcpServerAV, 'blocking' writes on the producer thread (default: async)\n");
+  printf("  --fps|-F <n>\t\tProducer rate (default: %d)\n", BENCH_FPS);
+  printf("  --bytes|-b <n>\tPacket size (default: %d)\n", BENCH_BYTES);
+  printf("  --frames|-f <n>\tPackets produced (default: %d)\n", BENCH_FRAMES);
+  printf("  --viewers|-v <n>\tLoopback viewers, blocking mode has one (default: 1)\n");
+  printf("  --read-ms|-d <ms>\tViewer pause after each packet, emulates a slow link (default: 0)\n");
+  printf("  --late-ms|-a <ms>\tViewers after the first connect <ms> later, mid-stream (default: 0)\n");
+  printf("  --join|-j <j>\t\tLate viewers start from the server GOP 'cache' or wait for a 'keyframe' (default: cache)\n");
+  printf("  --io-uring|-U\t\tAsync mode writes through io_uring instead of epoll\n");
+  printf("  --msg-zerocopy|-Z <n>\tAsync mode sends packets of at least <n> bytes with MSG_ZEROCOPY (default: 0, off)\n");
+}
+
+int main(int argc, char *argv[]) {
+  static struct option longopts[] = {{"mode", required_argument, NULL, 'M'},
+                                     {"fps", required_argument, NULL, 'F'},
+                                     {"bytes", required_argument, NULL, 'b'},
+                                     {"frames", required_argument, NULL, 'f'},
+                                     {"viewers", required_argument, NULL, 'v'},
+                                     {"read-ms", required_argument, NULL, 'd'},
+                                     {"msg-zerocopy", required_argument, NULL, 'Z'},
+                                     {"io-uring", no_argument, NULL, 'U'},
+                                     {"late-ms", required_argument, NULL, 'a'},
+                                     {"join", required_argument, NULL, 'j'},
+                                     {"help", no_argument, NULL, 'h'},
+                                     {NULL, 0, NULL, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hM:F:b:f:v:d:Z:Ua:j:", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 'M':
+        if (strcmp(optarg, "async") == 0) {
+          async = true;
+        } else if (strcmp(optarg, "blocking") == 0) {
+          async = false;
+        } else {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'F':
+        fps = atoi(optarg);
+        break;
+      case 'b':
+        bytes = atoi(optarg);
+        break;
+      case 'f':
+        frames = atoi(optarg);
+        break;
+      case 'v':
+        viewers = atoi(optarg);
+        break;
+      case 'd':
+        readMs = atoi(optarg);
+        break;
+      case 'Z':
+        zeroMin = atoi(optarg);
+        break;
+      case 'U':
+        ioUring = true;
+        break;
+      case 'a':
+        lateMs = atoi(optarg);
+        break;
+      case 'j':
+        if (strcmp(optarg, "keyframe") == 0) {
+          joinKey = true;
+        } else if (strcmp(optarg, "cache") == 0) {
+          joinKey = false;
+        } else {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'h':
+      default:
+        usage(argv[0]);
+        return EXIT_SUCCESS;
+    }
+  }
+  if (fps <= 0 || bytes <= 0 || frames <= 0 || viewers <= 0 || readMs < 0 || zeroMin < 0 || lateMs < 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (!async) viewers = 1;
+
+  boost::thread_group th_viewers;
+  for (int i = 0; i < viewers; i++) th_viewers.create_thread([i]() { viewer_thread(i > 0); });
+
+  tcpServerAV                                   *server = NULL;
+  boost::asio::io_context                        io;
+  std::unique_ptr<boost::asio::ip::tcp::socket> socket;
+  if (async) {
+    tcpServerAV::enable_zerocopy(zeroMin);
+    if (ioUring) tcpServerAV::enable_uring();
+    server = tcpServerAV::getInstance();
+  } else {
+    boost::asio::ip::tcp::acceptor acceptor(io,
+                                            boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), PORT_AV));
+    socket = std::make_unique<boost::asio::ip::tcp::socket>(acceptor.accept());
+
+    std::array<char, PKTSIZE> subscribe;
+    boost::asio::read(*socket, boost::asio::buffer(subscribe));
+  }
+
+  latencyHistogram *cadence = latencyRegistry::instance().create("cadence");
+  latencyHistogram *enqueue = latencyRegistry::instance().create("enqueue");
+
+  AVPacket *pkt       = av_packet_alloc();
+  uint64_t  periodUs  = 1000000 / fps;
+  uint64_t  startUs   = latencyHistogram::now_us();
+  uint64_t  nextUs    = startUs;
+  uint64_t  lastUs    = 0;
+  uint64_t  throttled = 0;
+
+  for (int i = 0; i < frames; i++) {
+    uint64_t now = latencyHistogram::now_us();
+    if (nextUs > now) usleep(nextUs - now);
+    nextUs += periodUs;
+
+    now = latencyHistogram::now_us();
+    if (lastUs) cadence->record(now - lastUs);
+    lastUs = now;
+
+    // Same decision as the capture loop, see th_entry_point
+    if (async && server->queue_depth(0) >= THROTTLE_QUEUE_PACKETS) {
+      throttled++;
+      continue;
+    }
+
+    if (av_new_packet(pkt, bytes) < 0) {
+      fprintf(stderr, "Could not allocate the packet\n");
+      return EXIT_FAILURE;
+    }
+    memset(pkt->data, i, bytes);
+    if (i % BENCH_GOP == 0 || (async && server->take_keyframe_request(0))) pkt->flags |= AV_PKT_FLAG_KEY;
+
+    packet_header_t header;
+    header.width      = 64;
+    header.height     = 64;
+    header.capture_us = now;
+
+    uint64_t sendUs = latencyHistogram::now_us();
+    if (async)
+      server->send_packet(pkt, header);
+    else
+      send_blocking(*socket, pkt, header);
+    enqueue->record(latencyHistogram::now_us() - sendUs);
+
+    av_packet_unref(pkt);
+  }
+  uint64_t wallUs = latencyHistogram::now_us() - startUs;
+
+  // Let the viewers drain what is still queued
+  usleep(500000);
+
+  printf("%s: %d frames in %.2f s (%.1f fps asked), %lu throttled, %lu packets received by %d viewers\n",
+         async ? "async" : "blocking", frames, wallUs / 1e6, (double)fps, throttled, received.load(), viewers);
+  latencyRegistry::instance().print(stdout);
+  if (server) server->print_stats(stdout);
+
+  av_packet_free(&pkt);
+  // The viewers block on their sockets until the process exits
+  fflush(stdout);
+  _exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,318 @@
+#include "../include/udpReceiver.hpp"
+
+#include <poll.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include "../include/latencyHistogram.hpp"
+
+//! @brief socket receive buffer asked for, a keyframe arrives as one burst of datagrams
+#define UDP_RECEIVE_BUFFER (4 * 1024 * 1024)
+//! @brief sequences are unwrapped from here, the first packet can start a few fragments before it
+#define UDP_SEQUENCE_BASE (1ull << 32)
+//! @brief a jump this far from the expected sequence is a restarted server, not a gap
+#define UDP_RESYNC_DATAGRAMS 65536
+
+/**
+ * @brief Subscribe to the server, packets are read with @ref receive
+ * @param[in] ip, port server UDP endpoint
+ * @param[in] request PKTSIZE text request, the same as on TCP
+ * @param[in] injector loss and delay applied to every received datagram */
+udpReceiver::udpReceiver(const std::string &ip, uint16_t port, const char *request, const lossInjector &injector)
+    : socket(io, boost::asio::ip::udp::v4()),
+      server(boost::asio::ip::address::from_string(ip), port),
+      request(request, PKTSIZE),
+      injector(injector) {
+  boost::system::error_code ignored;
+  socket.set_option(boost::asio::socket_base::receive_buffer_size(UDP_RECEIVE_BUFFER), ignored);
+  // Only the server datagrams are received, and the socket never blocks
+  socket.connect(server);
+  socket.non_blocking(true);
+
+  last_rx_us = latencyHistogram::now_us();
+}
+
+void udpReceiver::send_control(datagram_type_t type, int s, const uint8_t *payload, size_t size) {
+  std::vector<uint8_t> datagram(DATAGRAM_HEADER_SIZE + size);
+  datagram_header_t    header;
+  header.type   = type;
+  header.stream = s;
+  header.length = size;
+  write_datagram_header(header, datagram.data());
+  if (size) memcpy(datagram.data() + DATAGRAM_HEADER_SIZE, payload, size);
+
+  // A lost control datagram is sent again on the next timeout
+  boost::system::error_code ignored;
+  socket.send(boost::asio::buffer(datagram), 0, ignored);
+}
+
+/**
+ * @brief Wait for the next complete packet of any stream
+ * @param[out] header video header of the packet
+ * @param[out] pkt receives the encoded data, av_new_packet is called on it
+ * @return false if the server sent nothing for UDP_SERVER_TIMEOUT_MS */
+bool udpReceiver::receive(packet_header_t &header, AVPacket *pkt) {
+  for (;;) {
+    uint64_t now = latencyHistogram::now_us();
+
+    if (now - subscribed_us >= (uint64_t)UDP_KEEPALIVE_MS * 1000) {
+      send_control(DATAGRAM_SUBSCRIBE, 0, (const uint8_t *)request.data(), request.size());
+      subscribed_us = now;
+    }
+
+    while (!delayed.empty() && delayed.begin()->first <= now) {
+      process(delayed.begin()->second.data(), delayed.begin()->second.size(), now);
+      delayed.erase(delayed.begin());
+    }
+
+    // Round robin, a busy stream does not starve the others
+    for (int i = 0; i < MAX_OUTPUTS; i++) {
+      int     s  = (nextStream + i) % MAX_OUTPUTS;
+      stream &st = streams[s];
+      if (!st.started) continue;
+
+      repair(st, s, now);
+      recover(st, s, now);
+      if (deliver(st, header, pkt)) {
+        nextStream = s + 1;
+        return true;
+      }
+    }
+
+    if (now - last_rx_us > (uint64_t)UDP_SERVER_TIMEOUT_MS * 1000) return false;
+    wait(now);
+  }
+}
+
+/**
+ * @brief Sleep until a datagram arrives or a timer may fire, then read every pending datagram */
+void udpReceiver::wait(uint64_t now) {
+  bool pending = !delayed.empty();
+  for (const stream &st : streams) pending = pending || !st.gaps.empty();
+
+  // Timers have a millisecond resolution, with nothing pending only the keep-alive is due
+  int timeout = pending ? 1 : 10;
+  if (!delayed.empty() && delayed.begin()->first > now)
+    timeout = std::min<uint64_t>(timeout, (delayed.begin()->first - now + 999) / 1000);
+
+  struct pollfd fd = {socket.native_handle(), POLLIN, 0};
+  if (poll(&fd, 1, timeout) <= 0) return;
+
+  std::vector<uint8_t> buffer(DATAGRAM_MAX_SIZE);
+  for (;;) {
+    boost::system::error_code error;
+    size_t                    size = socket.receive(boost::asio::buffer(buffer), 0, error);
+    // would_block once drained, connection_refused while the server is not up
+    if (error) return;
+
+    now        = latencyHistogram::now_us();
+    last_rx_us = now;
+    if (injector.drop()) {
+      injected_drops++;
+    } else if (injector.enabled()) {
+      delayed.emplace(now + injector.delay_us(), std::vector<uint8_t>(buffer.begin(), buffer.begin() + size));
+    } else {
+      process(buffer.data(), size, now);
+    }
+  }
+}
+
+/**
+ * @brief Account a datagram from the server, data or fec */
+void udpReceiver::process(const uint8_t *data, size_t size, uint64_t now) {
+  datagram_header_t header;
+  if (!read_datagram_header(data, size, header)) return;
+  datagrams++;
+
+  stream &st = streams[header.stream];
+  if (header.type == DATAGRAM_DATA) {
+    if (!st.started) {
+      // Starts at the head of the packet, the fragments before this one become gaps in add_data
+      st.started           = true;
+      st.next              = UDP_SEQUENCE_BASE + header.sequence - header.fragment;
+      st.highest           = st.next - 1;
+      st.keyframe_asked_us = now;
+    }
+    add_data(st, st.unwrap(header.sequence), data, DATAGRAM_HEADER_SIZE + header.length, now);
+  } else if (header.type == DATAGRAM_FEC && st.started && header.fragment > 0) {
+    uint64_t first = st.unwrap(header.sequence);
+    if (first < st.next) return;
+    extend(st, first + header.fragment - 1, now);
+    st.fec[first].assign(data + DATAGRAM_HEADER_SIZE, data + DATAGRAM_HEADER_SIZE + header.length);
+    st.fecCount[first] = header.fragment;
+  }
+}
+
+/**
+ * @brief Sequences between the highest received and this one are missing from now on */
+void udpReceiver::extend(stream &st, uint64_t sequence, uint64_t now) {
+  if (sequence <= st.highest) return;
+  for (uint64_t s = st.highest + 1; s < sequence; s++) st.gaps.emplace(s, missing{now});
+  st.highest = sequence;
+}
+
+void udpReceiver::add_data(stream &st, uint64_t sequence, const uint8_t *data, size_t size, uint64_t now) {
+  if (sequence + UDP_RESYNC_DATAGRAMS < st.next || sequence > st.highest + UDP_RESYNC_DATAGRAMS) {
+    st.datagrams.clear();
+    st.gaps.clear();
+    st.fec.clear();
+    st.fecCount.clear();
+    st.next    = sequence;
+    st.highest = sequence;
+    st.waitKey = true;
+  }
+  if (sequence < st.next || st.datagrams.count(sequence)) {
+    duplicates++;
+    return;
+  }
+  if (sequence > st.highest)
+    extend(st, sequence, now);
+  else
+    st.gaps.erase(sequence);
+  st.datagrams[sequence].assign(data, data + size);
+}
+
+/**
+ * @brief Rebuild the datagram a fec group is missing, when it misses only one */
+void udpReceiver::repair(stream &st, int s, uint64_t now) {
+  for (auto it = st.fec.begin(); it != st.fec.end();) {
+    uint64_t first = it->first;
+    int      count = st.fecCount[first];
+
+    // A group never spans two packets, it is done once its packet is given back
+    uint64_t lost = 0;
+    int      nLost = 0;
+    if (first >= st.next)
+      for (uint64_t q = first; q < first + count; q++)
+        if (!st.datagrams.count(q)) {
+          lost = q;
+          nLost++;
+        }
+    // Two lost in the group, the parity helps only if a retransmission brings one back
+    if (nLost > 1) {
+      ++it;
+      continue;
+    }
+
+    if (nLost == 1) {
+      std::vector<uint8_t> rebuilt = it->second;
+      for (uint64_t q = first; q < first + count; q++) {
+        if (q == lost) continue;
+        const std::vector<uint8_t> &d = st.datagrams[q];
+        for (size_t b = 0; b < d.size() && b < rebuilt.size(); b++) rebuilt[b] ^= d[b];
+      }
+
+      datagram_header_t header;
+      if (read_datagram_header(rebuilt.data(), rebuilt.size(), header) && header.type == DATAGRAM_DATA &&
+          header.stream == s && st.unwrap(header.sequence) == lost) {
+        add_data(st, lost, rebuilt.data(), DATAGRAM_HEADER_SIZE + header.length, now);
+        fec_repaired++;
+      }
+    }
+    st.fecCount.erase(first);
+    it = st.fec.erase(it);
+  }
+}
+
+/**
+ * @brief NACK the gaps old enough, give up on the ones missing for UDP_RECOVERY_MS */
+void udpReceiver::recover(stream &st, int s, uint64_t now) {
+  st.gaps.erase(st.gaps.begin(), st.gaps.lower_bound(st.next));
+
+  // The oldest gap blocks every packet after it, past the timeout they are dropped
+  while (!st.gaps.empty() && now - st.gaps.begin()->second.since_us >= (uint64_t)UDP_RECOVERY_MS * 1000) {
+    st.next = st.gaps.begin()->first + 1;
+    st.gaps.erase(st.gaps.begin());
+    st.datagrams.erase(st.datagrams.begin(), st.datagrams.lower_bound(st.next));
+    st.gaps.erase(st.gaps.begin(), st.gaps.lower_bound(st.next));
+    st.waitKey = true;
+    gaps_lost++;
+  }
+
+  if (st.waitKey && now - st.keyframe_asked_us >= (uint64_t)UDP_KEYFRAME_RETRY_MS * 1000) {
+    send_control(DATAGRAM_KEYFRAME, s, NULL, 0);
+    st.keyframe_asked_us = now;
+    keyframes_asked++;
+  }
+
+  std::vector<uint8_t> payload;
+  for (auto &gap : st.gaps) {
+    missing &m = gap.second;
+    if (now - m.since_us < (uint64_t)UDP_REORDER_MS * 1000 || m.nacks >= UDP_NACK_RETRIES) continue;
+    if (m.nacks && now - m.nacked_us < (uint64_t)UDP_NACK_INTERVAL_MS * 1000) continue;
+
+    m.nacks++;
+    m.nacked_us = now;
+    nacks++;
+    payload.resize(payload.size() + 4);
+    put_u32(&payload[payload.size() - 4], (uint32_t)gap.first);
+    if (payload.size() == 4 * DATAGRAM_MAX_NACKS) {
+      send_control(DATAGRAM_NACK, s, payload.data(), payload.size());
+      payload.clear();
+    }
+  }
+  if (!payload.empty()) send_control(DATAGRAM_NACK, s, payload.data(), payload.size());
+}
+
+/**
+ * @brief Give back the next packet of a stream if all its datagrams are there
+ * @return false if it is not complete yet */
+bool udpReceiver::deliver(stream &st, packet_header_t &header, AVPacket *pkt) {
+  for (;;) {
+    auto it = st.datagrams.find(st.next);
+    if (it == st.datagrams.end()) return false;
+
+    datagram_header_t first;
+    read_datagram_header(it->second.data(), it->second.size(), first);
+    // Tail of a packet whose head was given up
+    if (first.fragment != 0) {
+      st.datagrams.erase(it);
+      st.next++;
+      continue;
+    }
+
+    int    n     = std::max<int>(first.fragments, 1);
+    size_t total = 0;
+    for (int i = 0; i < n; i++) {
+      auto f = st.datagrams.find(st.next + i);
+      if (f == st.datagrams.end()) return false;
+      total += f->second.size() - DATAGRAM_HEADER_SIZE;
+    }
+
+    const uint8_t *head       = it->second.data() + DATAGRAM_HEADER_SIZE;
+    int            headerSize = first.length >= HEADER_SIZE ? read_header(head, header) : 0;
+    bool           valid      = headerSize > 0 && total == headerSize + (size_t)header.payload_size;
+    bool           skip       = !valid || (st.waitKey && header.frame_type != FRAME_IDR);
+
+    if (!skip) {
+      av_new_packet(pkt, header.payload_size);
+      size_t skipped = 0, at = 0;
+      for (int i = 0; i < n; i++) {
+        const std::vector<uint8_t> &d    = st.datagrams[st.next + i];
+        const uint8_t              *data = d.data() + DATAGRAM_HEADER_SIZE;
+        size_t                      size = d.size() - DATAGRAM_HEADER_SIZE;
+        // The video header is not part of the encoded data
+        size_t drop = std::min(size, (size_t)headerSize - skipped);
+        skipped += drop;
+        memcpy(pkt->data + at, data + drop, size - drop);
+        at += size - drop;
+      }
+      st.waitKey = false;
+    } else {
+      packets_skipped++;
+    }
+
+    st.datagrams.erase(it, st.datagrams.lower_bound(st.next + n));
+    st.next += n;
+    if (!skip) return true;
+  }
+}
+
+void udpReceiver::print_stats(FILE *out) const {
+  fprintf(out,
+          "udp: %lu datagrams, %lu duplicates, %lu nacks, %lu fec repaired, %lu lost, %lu packets skipped, "
+          "%lu keyframes asked, %lu dropped by the injector\n",
+          datagrams, duplicates, nacks, fec_repaired, gaps_lost, packets_skipped, keyframes_asked, injected_drops);
+}
@@ -0,0 +1,220 @@
+#include "../include/udpServer.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include "../include/latencyHistogram.hpp"
+#include "../include/tcpServer.hpp"
+
+/**
+ * @brief Bind the UDP port and wait for peers, on the network thread of server
+ * @param[in] io io_context run by the network thread
+ * @param[in] port UDP port, usually PORT_AV
+ * @param[in] fec_group data datagrams covered by one fec datagram, 0 for none */
+udpServerAV::udpServerAV(tcpServerAV &server, boost::asio::io_context &io, int port, int fec_group)
+    : server(server),
+      socket(io, boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), port)),
+      expireTimer(io),
+      received(DATAGRAM_MAX_SIZE),
+      fecGroupSize(fec_group) {
+  // A full send buffer drops the datagram instead of stalling the network thread
+  socket.non_blocking(true);
+  receive();
+  expire();
+}
+
+void udpServerAV::receive() {
+  socket.async_receive_from(boost::asio::buffer(received), sender,
+                            [this](const boost::system::error_code &error, std::size_t size) {
+                              if (error == boost::asio::error::operation_aborted) return;
+                              // An ICMP unreachable from a peer that left shows up as an error, keep going
+                              if (!error) handle(size);
+                              receive();
+                            });
+}
+
+udpServerAV::peer *udpServerAV::find(const boost::asio::ip::udp::endpoint &endpoint) {
+  for (peer &p : peers)
+    if (p.endpoint == endpoint) return &p;
+  return NULL;
+}
+
+/**
+ * @brief Datagram from a peer: subscription or keep-alive, NACK or keyframe request */
+void udpServerAV::handle(size_t size) {
+  datagram_header_t header;
+  if (!read_datagram_header(received.data(), size, header)) return;
+
+  const uint8_t *payload = received.data() + DATAGRAM_HEADER_SIZE;
+  peer          *p       = find(sender);
+
+  if (header.type == DATAGRAM_SUBSCRIBE) {
+    if (p) {
+      p->last_us = latencyHistogram::now_us();
+      return;
+    }
+    std::array<char, PKTSIZE + 1> request{};
+    memcpy(request.data(), payload, std::min<size_t>(header.length, PKTSIZE));
+
+    std::stringstream name;
+    name << "UDP viewer " << sender;
+    // The datagrams of a burst would take sequences the other peers wait for, UDP joins on a keyframe
+    bool burst = false;
+    peers.push_back(peer{sender, server.subscribed(name.str(), request.data(), burst), latencyHistogram::now_us()});
+    nPeers++;
+    return;
+  }
+  // Not subscribed, or forgotten after a timeout: it subscribes again with its next keep-alive
+  if (p == NULL) return;
+  p->last_us = latencyHistogram::now_us();
+
+  if (header.type == DATAGRAM_KEYFRAME) {
+    keyframes_asked++;
+    server.request_keyframe(header.stream);
+  } else if (header.type == DATAGRAM_NACK) {
+    const history &h = sent[header.stream];
+    for (int i = 0; i < header.length / 4; i++) {
+      uint32_t sequence = get_u32(payload + 4 * i);
+      size_t   slot     = sequence % UDP_HISTORY_DATAGRAMS;
+      if (h.datagrams.empty() || h.sequences[slot] != sequence || (int32_t)(h.next - sequence) <= 0) {
+        nacks_late++;
+        continue;
+      }
+      send_to(p->endpoint, h.datagrams[slot].data(), h.datagrams[slot].size());
+      retransmitted++;
+    }
+  }
+}
+
+/**
+ * @brief Forget the peers silent for UDP_PEER_TIMEOUT_MS, every second */
+void udpServerAV::expire() {
+  uint64_t now = latencyHistogram::now_us();
+  for (auto it = peers.begin(); it != peers.end();) {
+    if (now - it->last_us > (uint64_t)UDP_PEER_TIMEOUT_MS * 1000) {
+      std::cout << "UDP viewer " << it->endpoint << " timed out" << std::endl;
+      server.unsubscribed(it->subscription);
+      it = peers.erase(it);
+      nPeers--;
+    } else {
+      ++it;
+    }
+  }
+
+  expireTimer.expires_after(std::chrono::seconds(1));
+  expireTimer.async_wait([this](const boost::system::error_code &error) {
+    if (!error) expire();
+  });
+}
+
+void udpServerAV::send_to(const boost::asio::ip::udp::endpoint &to, const uint8_t *datagram, size_t size) {
+  boost::system::error_code error;
+  socket.send_to(boost::asio::buffer(datagram, size), to, 0, error);
+  if (error)
+    datagrams_dropped++;
+  else
+    datagrams_sent++;
+}
+
+void udpServerAV::broadcast(int stream, const uint8_t *datagram, size_t size) {
+  for (const peer &p : peers)
+    if (p.subscription == ALL_OUTPUTS || p.subscription == stream) send_to(p.endpoint, datagram, size);
+}
+
+/**
+ * @brief Send the fec datagram of the group being built, if any */
+void udpServerAV::flush_fec(int stream) {
+  fecGroup &g = fec[stream];
+  if (g.count == 0) return;
+
+  // The parity follows its own header, the group is named by its first sequence
+  std::vector<uint8_t> datagram(DATAGRAM_HEADER_SIZE + g.parity.size());
+  datagram_header_t    header;
+  header.type     = DATAGRAM_FEC;
+  header.stream   = stream;
+  header.length   = g.parity.size();
+  header.sequence = g.first;
+  header.fragment = g.count;
+  write_datagram_header(header, datagram.data());
+  memcpy(datagram.data() + DATAGRAM_HEADER_SIZE, g.parity.data(), g.parity.size());
+
+  broadcast(stream, datagram.data(), datagram.size());
+  fec_sent++;
+  g.parity.clear();
+  g.count = 0;
+}
+
+/**
+ * @brief Cut a packet in datagrams and send them to every peer of its stream, on the network thread
+ *
+ * The video header goes in front of the encoded data, as on TCP. A packet
+ * ends the fec group it is in, so a frame never waits on the next one to be
+ * repaired. */
+void udpServerAV::send(const sharedPacket &packet) {
+  int      stream = packet.stream;
+  history &h      = sent[stream];
+  if (h.datagrams.empty()) {
+    h.datagrams.resize(UDP_HISTORY_DATAGRAMS);
+    h.sequences.resize(UDP_HISTORY_DATAGRAMS);
+  }
+
+  size_t total     = HEADER_SIZE + packet.pkt->size;
+  int    fragments = (total + DATAGRAM_PAYLOAD_SIZE - 1) / DATAGRAM_PAYLOAD_SIZE;
+
+  for (int i = 0; i < fragments; i++) {
+    size_t offset = (size_t)i * DATAGRAM_PAYLOAD_SIZE;
+    size_t length = std::min<size_t>(DATAGRAM_PAYLOAD_SIZE, total - offset);
+
+    uint32_t              sequence = h.next++;
+    size_t                slot     = sequence % UDP_HISTORY_DATAGRAMS;
+    std::vector<uint8_t> &datagram = h.datagrams[slot];
+    h.sequences[slot]              = sequence;
+    datagram.resize(DATAGRAM_HEADER_SIZE + length);
+
+    datagram_header_t header;
+    header.type      = DATAGRAM_DATA;
+    header.stream    = stream;
+    header.length    = length;
+    header.sequence  = sequence;
+    header.fragment  = i;
+    header.fragments = fragments;
+    write_datagram_header(header, datagram.data());
+
+    // The payload spans the video header and the encoded data
+    uint8_t *out = datagram.data() + DATAGRAM_HEADER_SIZE;
+    for (size_t at = offset; at < offset + length;) {
+      size_t n;
+      if (at < HEADER_SIZE) {
+        n = std::min(HEADER_SIZE - at, offset + length - at);
+        memcpy(out, packet.header.data() + at, n);
+      } else {
+        n = offset + length - at;
+        memcpy(out, packet.pkt->data + (at - HEADER_SIZE), n);
+      }
+      out += n;
+      at += n;
+    }
+
+    if (peers.empty()) continue;
+    broadcast(stream, datagram.data(), datagram.size());
+
+    if (fecGroupSize) {
+      fecGroup &g = fec[stream];
+      if (g.count == 0) g.first = sequence;
+      if (g.parity.size() < datagram.size()) g.parity.resize(datagram.size(), 0);
+      for (size_t b = 0; b < datagram.size(); b++) g.parity[b] ^= datagram[b];
+      if (++g.count == fecGroupSize) flush_fec(stream);
+    }
+  }
+  if (fecGroupSize) flush_fec(stream);
+}
+
+void udpServerAV::print_stats(FILE *out) const {
+  fprintf(out,
+          "udp: %d peers, %lu datagrams sent, %lu dropped by the kernel, %lu fec, %lu retransmitted, "
+          "%lu nacks too late, %lu keyframes asked\n",
+          nPeers.load(), datagrams_sent.load(), datagrams_dropped.load(), fec_sent.load(), retransmitted.load(),
+          nacks_late.load(), keyframes_asked.load());
+}
@@ -0,0 +1,248 @@
+#include "../include/uringWriter.hpp"
+
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+static int uring_setup(unsigned entries, io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned count) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/**
+ * @brief true if the kernel lets us create a ring, it may be disabled by sysctl or seccomp */
+bool uringWriter::available() {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = uring_setup(1, &params);
+  if (fd < 0) return false;
+  close(fd);
+  return true;
+}
+
+/**
+ * @brief Create the ring and the packet pool, exits on failure: check @ref available first
+ * @param[in] io io_context run by the network thread, completions are delivered on it
+ * @param[in] done called for every completion */
+uringWriter::uringWriter(boost::asio::io_context &io, completion done) : event(io), done(done) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ringFd = uring_setup(URING_ENTRIES, &params);
+  if (ringFd < 0) {
+    fprintf(stderr, "io_uring_setup: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+  sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+  sqRing = (uint8_t *)mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                           IORING_OFF_SQ_RING);
+  cqRing = params.features & IORING_FEAT_SINGLE_MMAP
+               ? sqRing
+               : (uint8_t *)mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                                 IORING_OFF_CQ_RING);
+  sqes = (io_uring_sqe *)mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                              IORING_OFF_SQES);
+  if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || (void *)sqes == MAP_FAILED) {
+    fprintf(stderr, "Could not map the io_uring queues: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  sqHead  = (unsigned *)(sqRing + params.sq_off.head);
+  sqTail  = (unsigned *)(sqRing + params.sq_off.tail);
+  sqMask  = (unsigned *)(sqRing + params.sq_off.ring_mask);
+  sqArray = (unsigned *)(sqRing + params.sq_off.array);
+  cqHead  = (unsigned *)(cqRing + params.cq_off.head);
+  cqTail  = (unsigned *)(cqRing + params.cq_off.tail);
+  cqMask  = (unsigned *)(cqRing + params.cq_off.ring_mask);
+  cqes    = (io_uring_cqe *)(cqRing + params.cq_off.cqes);
+
+  int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (efd < 0 || uring_register(ringFd, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+    fprintf(stderr, "Could not register the io_uring eventfd: %s\n", strerror(errno));
+    exit(1);
+  }
+  event.assign(efd);
+
+  // One registered buffer for the whole pool, WRITE_FIXED addresses it with buf_index 0
+  size_t poolSize = (size_t)URING_POOL_SLOTS * URING_SLOT_BYTES;
+  pool            = (uint8_t *)mmap(NULL, poolSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pool == MAP_FAILED) {
+    fprintf(stderr, "Could not allocate the io_uring packet pool\n");
+    exit(1);
+  }
+  iovec region{pool, poolSize};
+  fixed = uring_register(ringFd, IORING_REGISTER_BUFFERS, &region, 1) == 0;
+  if (fixed) {
+    for (int s = URING_POOL_SLOTS - 1; s >= 0; s--) freeSlots.push_back(s);
+  } else {
+    // Usually RLIMIT_MEMLOCK, every packet is then written from its own buffer
+    fprintf(stderr, "Could not register the io_uring packet pool: %s, writing from the packets\n",
+            strerror(errno));
+  }
+
+  // A fixed write goes through write(), not send(MSG_NOSIGNAL): a viewer that left must not kill us
+  signal(SIGPIPE, SIG_IGN);
+
+  wait_completions();
+}
+
+uringWriter::~uringWriter() {
+  if (pool) munmap(pool, (size_t)URING_POOL_SLOTS * URING_SLOT_BYTES);
+  if ((void *)sqes != MAP_FAILED) munmap(sqes, sqesSize);
+  if (cqRing != sqRing && cqRing != MAP_FAILED) munmap(cqRing, cqRingSize);
+  if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+  if (ringFd >= 0) close(ringFd);
+}
+
+/**
+ * @brief Take a slot of the registered pool, from any thread
+ * @param[in] size bytes to copy in it
+ * @return the slot, or -1 if size does not fit or every slot is in flight */
+int uringWriter::acquire(size_t size) {
+  std::lock_guard<std::mutex> lock(poolLock);
+  if (!fixed || size > URING_SLOT_BYTES || freeSlots.empty()) {
+    if (fixed) pool_misses++;
+    return -1;
+  }
+  int slot = freeSlots.back();
+  freeSlots.pop_back();
+  return slot;
+}
+
+/**
+ * @brief Give back a slot once the last write from it completed */
+void uringWriter::release(int slot) {
+  std::lock_guard<std::mutex> lock(poolLock);
+  freeSlots.push_back(slot);
+}
+
+/**
+ * @brief Wait until count entries are free at the tail of the submission queue
+ *
+ * The kernel takes no entry while the completion queue is full, and the
+ * eventfd handler that drains it runs on this very thread: the completions
+ * are delivered here instead, their callbacks may queue more writes. */
+void uringWriter::make_room(unsigned count) {
+  while (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > URING_ENTRIES - count) {
+    // Full, hand what we have to the kernel to make room
+    submit();
+    if (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) <= URING_ENTRIES - count) break;
+    // Nothing posted yet, the overflowed completions are flushed or a write in flight completes
+    if (reap() == 0) uring_enter(ringFd, 0, 1, IORING_ENTER_GETEVENTS);
+  }
+}
+
+/**
+ * @brief Free entry at the tail of the submission queue, published by @ref write once filled */
+io_uring_sqe *uringWriter::next_sqe() {
+  unsigned      index = *sqTail & *sqMask;
+  io_uring_sqe *sqe   = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqArray[index] = index;
+  return sqe;
+}
+
+/**
+ * @brief Queue a write on a connected socket, it starts at the next @ref submit
+ * @param[in] data from slot_data(slot) when slot is not -1, written with WRITE_FIXED
+ * @param[in] link the next write of the same socket waits for this one; if it
+ * fails or is short the next completes with -ECANCELED
+ * @param[in] user_data given back with the completion */
+void uringWriter::write(int fd, const uint8_t *data, size_t size, int slot, bool link, uint64_t user_data) {
+  // A linked write and the next one go in the same submit, the room for both is made before the first
+  if (!linked) make_room(link ? 2 : 1);
+  linked = link;
+
+  io_uring_sqe *sqe = next_sqe();
+  sqe->fd           = fd;
+  sqe->addr         = (uint64_t)(uintptr_t)data;
+  sqe->len          = size;
+  sqe->user_data    = user_data;
+  if (link) sqe->flags |= IOSQE_IO_LINK;
+
+  if (slot >= 0) {
+    sqe->opcode    = IORING_OP_WRITE_FIXED;
+    sqe->buf_index = 0;
+    fixed_writes++;
+  } else {
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->msg_flags = MSG_NOSIGNAL;
+  }
+  __atomic_store_n(sqTail, *sqTail + 1, __ATOMIC_RELEASE);
+  queued++;
+  entries++;
+}
+
+/**
+ * @brief Hand every queued write to the kernel in one system call */
+void uringWriter::submit() {
+  while (queued) {
+    int ret = uring_enter(ringFd, queued, 0, 0);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      // EAGAIN/EBUSY: the completion queue is full, it drains on the next wakeup or in make_room
+      if (errno == EAGAIN || errno == EBUSY) return;
+      fprintf(stderr, "io_uring_enter: %s\n", strerror(errno));
+      exit(1);
+    }
+    submits++;
+    queued -= ret;
+  }
+}
+
+void uringWriter::wait_completions() {
+  event.async_wait(boost::asio::posix::stream_descriptor::wait_read, [this](const boost::system::error_code &error) {
+    if (error) return;
+    ssize_t ignored = read(event.native_handle(), &eventCount, sizeof(eventCount));
+    (void)ignored;
+    reap();
+    wait_completions();
+  });
+}
+
+/**
+ * @brief Deliver every posted completion, then submit the writes the callbacks queued
+ * @return the number of completions delivered
+ *
+ * A callback may fill the submission queue and get here again from
+ * @ref make_room, the head is read back after every completion */
+unsigned uringWriter::reap() {
+  unsigned count = 0;
+  for (;;) {
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) break;
+    const io_uring_cqe &cqe = cqes[head & *cqMask];
+    uint64_t            tag = cqe.user_data;
+    int                 res = cqe.res;
+    // Release the entry before the callback, it may queue more
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    done(tag, res);
+    count++;
+  }
+  submit();
+  return count;
+}
+
+void uringWriter::print_stats(FILE *out) const {
+  fprintf(out, "io_uring: %lu io_uring_enter for %lu writes, %lu fixed, %lu packets not in the pool\n",
+          submits.load(), entries.load(), fixed_writes.load(), pool_misses.load());
+}
@@ -4,7 +4,6 @@
  * This is the entry point for the videoCapture program
  */
 
-#include <dlfcn.h>
 #include <getopt.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -12,9 +11,13 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <time.h>
+
+#include <algorithm>
 #include <cstddef>
 #include <iostream>
 #include <sstream>
+#include <vector>
 
 extern "C" {
 #include <libavcodec/codec.h>
@@ -23,126 +26,510 @@ extern "C" {
 #include <libavutil/imgutils.h>
 #include <libavutil/log.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/pixfmt.h>
 #include <libswscale/swscale.h>
 }
 
-#include <NvFBC.h>
 #include <xdo.h>
 
 #include <boost/asio.hpp>
 #include <boost/thread.hpp>
 
 #include "NvFBCUtils.h"
+#include "captureNvFBC.hpp"
+#include "captureSynthetic.hpp"
+#include "captureX11.hpp"
+#include "capturePipeline.hpp"
+#include "cursorServer.hpp"
+#include "dirtyMap.hpp"
+#include "frameScaler.hpp"
+#include "latencyHistogram.hpp"
 #include "protocol.hpp"
+#include "rateController.hpp"
 #include "tcpServer.hpp"
 
 #define APP_VERSION 2
 
-#define LIB_NVFBC_NAME "libnvidia-fbc.so.1"
-
 #define N_FRAMES -1
 #define N_THREADS 1
+#define STATS_INTERVAL 300
+#define KEEP_ALIVE_MS 1000
+#define DIRTY_ROI_FRACTION 4
+#define SAMPLING_RATE_MS 16
+#define CURSOR_PERIOD_MS 8
+
+static int  nFrames    = N_FRAMES;
+static bool zeroCopy   = false;
+static bool printStats = false;
+static bool pipelined  = false;
+static bool idleAware  = false;
+static int  keepAlive  = KEEP_ALIVE_MS;
 
-static void                   *libNVFBC                = NULL;
-static PNVFBCCREATEINSTANCE    NvFBCCreateInstance_ptr = NULL;
-static NVFBC_API_FUNCTION_LIST pFn;
-unsigned char                 *frame = NULL;
-NVFBC_SESSION_HANDLE           fbcHandle;
+/**
+ * @brief how the capture loop decides when to grab */
+enum captureSchedule {
+  SCHEDULE_POLL,  //!< display server samples every SAMPLING_RATE_MS, grabs force a refresh
+  SCHEDULE_PUSH   //!< display server pushes on damage, grabs return as soon as a frame is ready
+};
+static const char     *scheduleNames[] = {"poll", "push"};
+static captureSchedule schedule        = SCHEDULE_POLL;
+static int             maxFps          = 0;
+static int             minIntervalMs   = 0;
+static const char     *latencyOut      = NULL;
+static const char     *rateLog         = NULL;
+static bool            udpTransport    = false;
+static int             fecGroup        = 0;
+static int             msgZerocopy     = 0;
+static bool            ioUring         = false;
+static const char     *backend         = "nvfbc";
+static const char     *outputList      = "0";
+static int             encoderThreads  = 1;
+static bool            remoteCursor    = false;
+static cursorServer   *cursor          = NULL;
+
+static syntheticScenario scenario      = SCENARIO_SCROLL;
+static int               syntheticFps  = 60;
+static int               syntheticPool = SYNTHETIC_POOL;
+
+static capturePipeline::config pipelineConfig;
+static rateController::config  rateConfig;
+
+static uint64_t process_cpu_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
 
 /**
- * @brief Main loop for caputuring frame
- * @param th_params wrap all params in a single struct
- * Bind to the Frame Buffer Context, then get one frame every
- * screen refresh and send it to the TCP Server using tcpServer singleton
- */
-static void th_entry_point(videoThreadParams *th_params) {
-  NVFBCSTATUS fbcStatus;
+ * @brief Counters accumulated by the capture loop when --stats is given */
+struct captureStats {
+  uint64_t frames       = 0;
+  uint64_t encoded      = 0;
+  uint64_t skipped      = 0;  //!< unchanged frames not sent to the encoder
+  uint64_t keep_alives  = 0;  //!< unchanged frames encoded anyway after --keep-alive ms
+  uint64_t throttled    = 0;  //!< frames not encoded because every viewer is behind
+  uint64_t rate_skipped = 0;  //!< frames not encoded because the rate controller lowered the frame rate
+  uint64_t unstamped    = 0;  //!< new frames left out of change_to_grab, no timestamp or one after the grab
+  uint64_t bytes_copied = 0;
+  uint64_t prepare_us   = 0;  //!< grab returned -> frame ready for the encoder
+  uint64_t encode_us    = 0;  //!< grab returned -> encode_send returned
+
+  uint64_t wall_start_us;
+  uint64_t cpu_start_us;
+  uint64_t sent_start;
+
+  /**
+   * @param[in] sent bytes written by the server so far */
+  explicit captureStats(uint64_t sent)
+      : wall_start_us(NvFBCUtilsGetTimeInMicros()), cpu_start_us(process_cpu_us()), sent_start(sent) {}
+
+  /**
+   * @param[in] sent bytes written by the server so far for this output
+   * @param[in] format pixel format fed to the encoder
+   * @param[in] stream output the counters belong to, cpu is for the whole process */
+  void print(uint64_t sent, AVPixelFormat format, int stream) const {
+    uint64_t wall    = NvFBCUtilsGetTimeInMicros() - wall_start_us;
+    uint64_t cpu     = process_cpu_us() - cpu_start_us;
+    uint64_t divisor = encoded ? encoded : 1;
+
+    printf("stats[%d]: %s %s, %lu frames, %lu encoded (%.1f fps), %lu skipped, %lu keep-alive, %lu throttled, "
+           "%lu rate skipped\n",
+           stream, av_get_pix_fmt_name(format), zeroCopy ? "zero-copy" : "copy", frames, encoded,
+           encoded * 1e6 / wall, skipped, keep_alives, throttled, rate_skipped);
+    printf("stats[%d]: %lu bytes copied/frame, capture->encode %.1f us, capture->sent %.1f us, %lu unstamped\n",
+           stream, bytes_copied / divisor, (double)prepare_us / divisor, (double)encode_us / divisor, unstamped);
+    printf("stats[%d]: cpu %.1f%%, %.1f kbit/s\n", stream, 100.0 * cpu / wall, (sent - sent_start) * 8000.0 / wall);
+  }
+};
 
-  NVFBC_BIND_CONTEXT_PARAMS    bindParams;
-  NVFBC_RELEASE_CONTEXT_PARAMS releaseParams;
+/**
+ * @brief Free callback for the AVBufferRef wrapping the capture buffer.
+ * The memory is owned by the capture source, so there is nothing to release here */
+static void capture_buffer_free(void *opaque, uint8_t *data) {}
 
-  tcpServerAV *server = tcpServerAV::getInstance();
+/**
+ * @brief Point the planes of an AVFrame straight at the capture buffer
+ * @param[out] av_frame frame handed to the encoder, its previous buffers are released
+ * @param[in] grab planes of the last grab, contiguous from data[0]
+ * @param[in] ctx encoder context, gives the expected frame size
+ * @return 0 on success, a negative AVERROR otherwise
+ *
+ * The buffer stays valid only until the next grab; this is fine because
+ * encode_send drains the encoder and libx264 copies the picture on input */
+static int wrap_capture_frame(AVFrame *av_frame, const captureFrame &grab, AVCodecContext *ctx) {
+  int64_t pts = av_frame->pts;
+
+  if (grab.byte_size < (size_t)av_image_get_buffer_size(ctx->pix_fmt, ctx->width, ctx->height, 1))
+    return AVERROR(EINVAL);
+
+  av_frame_unref(av_frame);
+  av_frame->buf[0] = av_buffer_create(grab.data[0], grab.byte_size, capture_buffer_free, NULL, AV_BUFFER_FLAG_READONLY);
+  if (av_frame->buf[0] == NULL) return AVERROR(ENOMEM);
+
+  av_frame->width  = ctx->width;
+  av_frame->height = ctx->height;
+  av_frame->format = ctx->pix_fmt;
+  av_frame->pts    = pts;
+
+  for (int i = 0; i < av_pix_fmt_count_planes(ctx->pix_fmt); i++) {
+    av_frame->data[i]     = grab.data[i];
+    av_frame->linesize[i] = grab.linesize[i];
+  }
 
-  // Reset and bind to the FBC
-  memset(&bindParams, 0, sizeof(bindParams));
-  bindParams.dwVersion = NVFBC_BIND_CONTEXT_PARAMS_VER;
+  return 0;
+}
+
+/**
+ * @brief Copy the planes of the capture buffer into an AVFrame
+ * @param[out] av_frame destination frame, made writable if needed
+ * @param[in] grab planes of the last grab
+ * @param[in] ctx encoder context, gives the frame size and format
+ * @return number of bytes copied */
+static size_t copy_capture_frame(AVFrame *av_frame, const captureFrame &grab, AVCodecContext *ctx) {
+  int res = av_frame_make_writable(av_frame);
+  if (res < 0) exit(1);
+
+  av_image_copy(av_frame->data, av_frame->linesize, (const uint8_t **)grab.data, grab.linesize, ctx->pix_fmt,
+                ctx->width, ctx->height);
+
+  return av_image_get_buffer_size(ctx->pix_fmt, ctx->width, ctx->height, 1);
+}
 
-  fbcStatus = pFn.nvFBCBindContext(fbcHandle, &bindParams);
-  if (fbcStatus != NVFBC_SUCCESS) {
-    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
-    return;
+/**
+ * @brief Sleep until the next grab is allowed by --max-fps and --min-interval
+ * @param[in,out] nextGrabUs earliest time of the next grab as set by the previous call
+ * @param[in] lastGrabUs time the previous grab returned
+ *
+ * The fps cap keeps a running deadline so a late frame can be caught up,
+ * the minimum interval is a hard gap between two consecutive grabs */
+static void pace_capture(uint64_t &nextGrabUs, uint64_t lastGrabUs) {
+  uint64_t now = monotonic_us();
+  uint64_t at  = lastGrabUs + (uint64_t)minIntervalMs * 1000;
+
+  if (maxFps > 0) {
+    uint64_t period = 1000000 / maxFps;
+    nextGrabUs      = nextGrabUs + period > now ? nextGrabUs + period : now;
+    if (nextGrabUs > at) at = nextGrabUs;
   }
+  if (at > now) boost::this_thread::sleep_for(boost::chrono::microseconds(at - now));
+}
 
-  // Start the caputure loop
-  printf("Worker thread: Capturing frames of size %dx%d.\n", th_params->frame->width, th_params->frame->height);
-
-  for (int _ = 0; _ < 1000000; _++) {
-    int                           res;
-    NVFBC_TOSYS_GRAB_FRAME_PARAMS grabParams;
-    NVFBC_FRAME_GRAB_INFO         frameInfo;
-
-    memset(&grabParams, 0, sizeof(grabParams));
-    memset(&frameInfo, 0, sizeof(frameInfo));
-
-    grabParams.dwVersion = NVFBC_TOSYS_GRAB_FRAME_PARAMS_VER;
-
-    /*
-     * Use blocking calls.
-     *
-     * The application will wait for new frames.  New frames are generated
-     * when the mouse cursor moves or when the screen if refreshed.
-     */
-    grabParams.dwFlags = NVFBC_TOSYS_GRAB_FLAGS_FORCE_REFRESH;
-
-    /*
-     * This structure will contain information about the captured frame.
-     */
-    grabParams.pFrameGrabInfo = &frameInfo;
-
-    int t1 = NvFBCUtilsGetTimeInMillis();
-    /*
-     * Capture a new frame.
-     */
-    fbcStatus = pFn.nvFBCToSysGrabFrame(fbcHandle, &grabParams);
-    if (fbcStatus != NVFBC_SUCCESS) {
-      fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
-      goto done;
-    }
-    int t2 = NvFBCUtilsGetTimeInMillis();
+/**
+ * @brief Allocate and open the H.264 encoder of one output
+ * @param[out] params receives the encoder context, the input frame and the packet
+ * @param[in] width, height encoded size
+ * @param[in] format pixel format produced by the capture source
+ * @param[in] threads encoder threads, the cores are split between the outputs
+ * @param[in] rate bitrate and VBV buffer to start with, NULL for the x264 default CRF */
+static void open_encoder(videoThreadParams &params, int width, int height, AVPixelFormat format, int threads,
+                         const rateController *rate) {
+  int res;
 
-    int t3 = NvFBCUtilsGetTimeInMillis();
-    res    = av_frame_make_writable(th_params->frame);
-    if (res < 0) exit(1);
+  // Init ffmpeg packet that is the encoded version of a frame
+  if (params.pkt == nullptr) params.pkt = av_packet_alloc();
 
-    size_t pos = th_params->ctx->height * th_params->frame->linesize[0];
-    memcpy(th_params->frame->data[0], frame, pos);
+  // Init ffmpeg av codec context
+  auto codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+  params.ctx = avcodec_alloc_context3(codec);
 
-    /* Cb and Cr */
-    memcpy(th_params->frame->data[1], &frame[pos], th_params->ctx->height * th_params->frame->linesize[1]);
-    pos *= 2;
-    memcpy(th_params->frame->data[2], &frame[pos], th_params->ctx->height * th_params->frame->linesize[2]);
+  // Set context param
+  params.ctx->width        = width;
+  params.ctx->height       = height;
+  params.ctx->time_base    = (AVRational){1, 15};
+  params.ctx->framerate    = (AVRational){15, 1};
+  params.ctx->pix_fmt      = format;
+  params.ctx->thread_count = threads;
 
-    th_params->frame->pts++;
-    server->encode_send(th_params);
-    int t4 = NvFBCUtilsGetTimeInMillis();
+  // Set specific context params
+  if (codec->id == AV_CODEC_ID_H264) {
+    av_opt_set(params.ctx->priv_data, "preset", "ultrafast", 0);
+    av_opt_set(params.ctx->priv_data, "tune", "zerolatency", 0);
+    // A keyframe asked for a new viewer must be an IDR, it decodes on its own
+    av_opt_set(params.ctx->priv_data, "forced-idr", "1", 0);
+    // ultrafast turns adaptive quantization off, x264 then skips the dirty block ROI
+    if (idleAware) av_opt_set(params.ctx->priv_data, "aq-mode", "1", 0);
+  }
+  if (rate) rateController::apply(params.ctx, rate->bit_rate(), rate->buffer_size());
 
-    // printf("taking time: %d\nsending time: %d\ntotal time: %d\n", t2 - t1, t4 - t3, t4 - t1 - 16);
+  // Open the ffmpeg context
+  res = avcodec_open2(params.ctx, codec, NULL);
+  if (res < 0) {
+    fprintf(stderr, "Could not open codec: %d\n", (res));
+    exit(1);
   }
 
-done:
-  /*
-   * The worker thread is done using the FBC context, release it.
-   */
-  memset(&releaseParams, 0, sizeof(releaseParams));
+  // Allocate frame for passing single frame from the capture source to encoder
+  params.frame         = av_frame_alloc();
+  params.frame->width  = width;
+  params.frame->height = height;
+  params.frame->format = format;
+  params.frame->pts    = 0;
+
+  res = av_frame_get_buffer(params.frame, 0);
+  if (res < 0) {
+    fprintf(stderr, "Could not allocate the video frame data\n");
+    exit(1);
+  }
+}
 
-  releaseParams.dwVersion = NVFBC_RELEASE_CONTEXT_PARAMS_VER;
+/**
+ * @brief Set up the stages between a grab and the encoder for a captured size
+ * @param[in,out] th_params encoder of the output, reopened if the encoded size changes
+ * @param[in] format pixel format produced by the capture source
+ * @param[in] width, height captured size
+ * @param[in,out] pipeline, dirty, scaler stages sized for the previous capture, replaced
+ * @param[in] pipeCfg configuration of the pipeline of this output, with its histograms
+ * @param[in] rate controller of the output, its size step and bitrate are applied, NULL if disabled
+ *
+ * Runs on the first grab and every time the captured size changes. The
+ * encoded size is the one asked by the client, never larger than the capture.
+ * A new encoder starts on a keyframe with new parameter sets, so the client
+ * decoder follows without reconnecting */
+static void configure_output(videoThreadParams *th_params, AVPixelFormat format, int width, int height,
+                             capturePipeline *&pipeline, dirtyMap *&dirty, frameScaler *&scaler,
+                             const capturePipeline::config &pipeCfg, const rateController *rate) {
+  int encodeW, encodeH;
+  tcpServerAV::getInstance()->requested_size(encodeW, encodeH);
+  if (encodeW == 0 || encodeW > width) encodeW = width;
+  if (encodeH == 0 || encodeH > height) encodeH = height;
+  if (rate) {
+    encodeW = encodeW * rate->scale_percent() / 100;
+    encodeH = encodeH * rate->scale_percent() / 100;
+  }
+  encodeW &= ~1;
+  encodeH &= ~1;
+
+  if (pipeline) {
+    pipeline->stop();
+    delete pipeline;
+    pipeline = NULL;
+  }
+  delete dirty;
+  delete scaler;
+  dirty  = NULL;
+  scaler = NULL;
+
+  if (th_params->ctx == NULL || th_params->ctx->width != encodeW || th_params->ctx->height != encodeH) {
+    avcodec_free_context(&th_params->ctx);
+    av_frame_free(&th_params->frame);
+    open_encoder(*th_params, encodeW, encodeH, format, encoderThreads, rate);
+  } else if (rate) {
+    rateController::apply(th_params->ctx, rate->bit_rate(), rate->buffer_size());
+  }
+
+  if (encodeW != width || encodeH != height)
+    scaler = new frameScaler(width, height, encodeW, encodeH, format, encoderThreads);
+
+  if (pipelined) {
+    pipeline = new capturePipeline(th_params->ctx, pipeCfg);
+    pipeline->start();
+  }
+
+  if (idleAware) {
+    // 4:2:0 chroma is subsampled, only the luma plane is compared
+    int nb_planes = format == AV_PIX_FMT_YUV444P ? 3 : 1;
+    dirty         = new dirtyMap(width, height, nb_planes);
+  }
+
+  printf("Output %d: capturing %dx%d, encoding %dx%d\n", th_params->stream, width, height, encodeW, encodeH);
+}
+
+/**
+ * @brief Main loop for caputuring frame
+ * @param th_params wrap all params in a single struct, stream is the output index
+ * @param source capture backend, initialized on the main thread
+ * Bind to the capture source, then get one frame every
+ * screen refresh and send it to the TCP Server using tcpServer singleton.
+ * There is one such thread per captured output
+ */
+static void th_entry_point(videoThreadParams *th_params, captureSource *source) {
+  tcpServerAV *server = tcpServerAV::getInstance();
+  int          stream = th_params->stream;
+
+  // Bind to the capture source, for NvFBC the context follows the thread
+  if (!source->bind()) return;
+
+  captureStats     stats(server->sent_bytes(stream));
+  capturePipeline *pipeline     = NULL;
+  dirtyMap        *dirty        = NULL;
+  frameScaler     *scaler       = NULL;
+  uint64_t         lastEncodeUs = 0;
+  int              captureW     = 0;
+  int              captureH     = 0;
+
+  // Adaptive bitrate, see --latency-budget
+  rateController *rate      = rateConfig.budget_ms > 0 ? new rateController(rateConfig, stream) : NULL;
+  int             rateScale = 100;
+  unsigned        rateFrame = 0;
+
+  // Stage histograms of this output, recorded by this thread only
+  latencyRegistry  &registry     = latencyRegistry::instance();
+  std::string       changeName   = std::string("change_to_grab.") + scheduleNames[schedule];
+  latencyHistogram *changeToGrab = registry.create(changeName, stream);
+  latencyHistogram *grabLatency  = registry.create("grab", stream);
+  latencyHistogram *copyLatency  = registry.create("copy", stream);
+  uint64_t          nextGrabUs   = 0;
+  uint64_t          lastGrabUs   = 0;
+
+  // Outlives the pipelines rebuilt by configure_output, so do its histograms
+  capturePipeline::config pipeCfg = pipelineConfig;
+  pipeCfg.stream                  = stream;
+  pipeCfg.send_frame              = registry.create("avcodec_send_frame", stream);
+  pipeCfg.receive_packet          = registry.create("avcodec_receive_packet", stream);
+  // Recorded by the pipeline encoder thread or by encode_send, whichever encodes
+  th_params->send_frame     = pipeCfg.send_frame;
+  th_params->receive_packet = pipeCfg.receive_packet;
+
+  captureFrame grab;
+  // A change held back by the throttle or the frame rate divider is already in
+  // the dirty map reference, it is retried on the same grab: a new grab could
+  // wait up to the keep-alive
+  bool pendingDirty = false;
+
+  for (int i = 0; nFrames < 0 || i < nFrames; i++) {
+    int res;
+
+    if (pendingDirty) {
+      boost::this_thread::sleep_for(boost::chrono::milliseconds(SAMPLING_RATE_MS));
+    } else {
+      if (maxFps > 0 || minIntervalMs > 0) pace_capture(nextGrabUs, lastGrabUs);
+
+      uint64_t grabStartUs = monotonic_us();
+      /*
+       * Capture a new frame.
+       */
+      if (!source->grab(grab)) goto done;
+
+      lastGrabUs = monotonic_us();
+      grabLatency->record(lastGrabUs - grabStartUs);
+      if (grab.is_new && grab.timestamp_us && grab.timestamp_us <= lastGrabUs)
+        changeToGrab->record(lastGrabUs - grab.timestamp_us);
+      else if (grab.is_new)
+        stats.unstamped++;
+    }
+    uint64_t grabbedUs = NvFBCUtilsGetTimeInMicros();
+
+    // New bitrate on the running encoder, a new size needs a new one
+    if (rate && th_params->ctx && rate->update(lastGrabUs, server->link_sample(stream)) &&
+        rate->scale_percent() == rateScale) {
+      if (pipeline)
+        pipeline->set_rate(rate->bit_rate(), rate->buffer_size());
+      else
+        rateController::apply(th_params->ctx, rate->bit_rate(), rate->buffer_size());
+    }
 
-  fbcStatus = pFn.nvFBCReleaseContext(fbcHandle, &releaseParams);
-  if (fbcStatus != NVFBC_SUCCESS) {
-    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
-    return;
+    // First grab, mode change or rate controller size step, the TCP connection is kept
+    bool reconfigured = th_params->ctx == NULL || grab.width != captureW || grab.height != captureH ||
+                        (rate && rate->scale_percent() != rateScale);
+    if (reconfigured) {
+      captureW  = grab.width;
+      captureH  = grab.height;
+      rateScale = rate ? rate->scale_percent() : 100;
+      configure_output(th_params, source->format(), captureW, captureH, pipeline, dirty, scaler, pipeCfg, rate);
+    }
+
+    bool   encode = true;
+    size_t nDirty = 0;
+    if (dirty) {
+      // A new dirty map sees the whole frame as changed
+      if (pendingDirty && !reconfigured)
+        nDirty = dirty->blocks().size();
+      else if (grab.is_new || reconfigured)
+        nDirty = dirty->update(grab.data, grab.linesize);
+      if (nDirty == 0) {
+        encode = grabbedUs - lastEncodeUs >= (uint64_t)keepAlive * 1000;
+        if (encode)
+          stats.keep_alives++;
+        else
+          stats.skipped++;
+      }
+    }
+    // A new viewer waits for a keyframe, it does not wait for the keep-alive
+    if (!encode && server->keyframe_due(stream)) encode = true;
+    // Nobody watches the output, the next viewer asks for a keyframe anyway
+    if (encode && !server->watched(stream)) {
+      encode = false;
+      stats.skipped++;
+    }
+    // Every viewer is behind, more packets would only make their queues longer
+    bool throttled = encode && server->queue_depth(stream) >= THROTTLE_QUEUE_PACKETS;
+    if (throttled) {
+      encode = false;
+      stats.throttled++;
+    }
+    // Lower frame rate picked by the rate controller, a keyframe is never held back
+    bool rateSkipped = encode && rate && ++rateFrame % rate->frame_divider() != 0 && !server->keyframe_due(stream);
+    if (rateSkipped) {
+      encode = false;
+      stats.rate_skipped++;
+    }
+
+    uint64_t preparedUs = grabbedUs;
+    if (encode) {
+      AVFrame *target = pipeline ? pipeline->capture_slot() : th_params->frame;
+
+      if (scaler) {
+        stats.bytes_copied += scaler->scale(grab.data, grab.linesize, target);
+      } else if (zeroCopy) {
+        res = wrap_capture_frame(target, grab, th_params->ctx);
+        if (res < 0) {
+          fprintf(stderr, "Could not wrap the capture buffer (%zu bytes)\n", grab.byte_size);
+          exit(1);
+        }
+      } else {
+        stats.bytes_copied += copy_capture_frame(target, grab, th_params->ctx);
+      }
+      if (dirty) dirty->attach(target, nDirty ? dirty->total_blocks() / DIRTY_ROI_FRACTION : 0);
+      // Capture time for the packet header, see encodeTiming
+      target->opaque = (void *)(uintptr_t)lastGrabUs;
+      preparedUs = NvFBCUtilsGetTimeInMicros();
+      copyLatency->record(preparedUs - grabbedUs);
+
+      if (pipeline) {
+        pipeline->publish();
+      } else {
+        th_params->frame->pts++;
+        server->encode_send(th_params);
+      }
+      lastEncodeUs = grabbedUs;
+    }
+    // Retried every SAMPLING_RATE_MS on the same grab until the viewers caught
+    // up, a retry counts as a frame of the rate controller divider
+    pendingDirty = (throttled || rateSkipped) && nDirty > 0;
+
+    if (printStats) {
+      stats.frames++;
+      if (encode) {
+        stats.encoded++;
+        stats.prepare_us += preparedUs - grabbedUs;
+        stats.encode_us += NvFBCUtilsGetTimeInMicros() - grabbedUs;
+      }
+      if (stats.frames == STATS_INTERVAL) {
+        stats.print(server->sent_bytes(stream), th_params->ctx->pix_fmt, stream);
+        if (pipeline) pipeline->print_stats(stdout);
+        if (cursor) cursor->print_stats(stdout);
+        server->print_stats(stdout);
+        changeToGrab->print(stdout, (changeName + ':' + std::to_string(stream)).c_str());
+        stats = captureStats(server->sent_bytes(stream));
+      }
+    }
+  }
+
+done:
+
+  if (pipeline) {
+    pipeline->stop();
+    delete pipeline;
   }
+  delete dirty;
+  delete scaler;
+  delete rate;
+
+  /*
+   * The worker thread is done using the capture source, release it.
+   */
+  source->release();
 }
 
 static void th_xdo_server() {
@@ -161,36 +548,132 @@ static void usage(const char *pname) {
   printf("\n");
   printf("Options:\n");
   printf("  --help|-h\t\tThis message\n");
-  printf("  --frames|-f <n>\tNumber of frames to capture (default: %u)\n", N_FRAMES);
+  printf("  --frames|-f <n>\tNumber of frames to capture (default: %d, unlimited)\n", N_FRAMES);
+  printf("  --backend|-b <name>\t'nvfbc', 'x11' (MIT-SHM + XDamage) or 'synthetic' (default: nvfbc)\n");
+  printf("  --outputs|-O <list>\tDisplay outputs to capture, comma separated indices or 'all' (default: 0)\n");
+  printf("  --size|-g <size>\tCaptured size: 'native', '1080p', '1440p', '4k' or <w>x<h> (default: %dx%d)\n", VSIZEW,
+         VSIZEH);
+  printf("\t\t\tThe client picks the encoded size, frames are downscaled in between\n");
+  printf("  --pixel-format|-P <f>\t'yuv444p' (High 4:4:4) or 'nv12' (4:2:0) (default: yuv444p)\n");
+  printf("  --scenario|-x <name>\tSynthetic content: scroll, drag, noise, cursor or static (default: scroll)\n");
+  printf("  --rate|-R <fps>\tSynthetic frame rate (default: 60)\n");
+  printf("  --pool|-o <n>\t\tSynthetic frames pre-rendered (default: %d)\n", SYNTHETIC_POOL);
+  printf("  --cursor|-C <mode>\t'embedded' draws the cursor in the frames, 'remote' sends it on port %d\n"
+         "\t\t\tand the client draws it (default: embedded)\n",
+         PORT_CURSOR);
+  printf("  --zero-copy|-z\t\tHand the capture buffer to the encoder without copying it\n");
+  printf("  --stats|-s\t\tPrint bytes copied and capture->encode latency every %d frames\n", STATS_INTERVAL);
+  printf("  --idle|-i\t\tSkip encoding frames that did not change\n");
+  printf("  --keep-alive|-k <ms>\tEncode an unchanged frame at least every <ms> in idle mode (default: %d)\n",
+         KEEP_ALIVE_MS);
+  printf("  --schedule|-S <mode>\t'poll' samples every %d ms, 'push' grabs as soon as a frame is ready (default: poll)\n",
+         SAMPLING_RATE_MS);
+  printf("  --max-fps|-F <n>\tCap the capture rate (default: unlimited)\n");
+  printf("  --min-interval|-m <ms>\tMinimum time between two grabs (default: 0)\n");
+  printf("  --latency-out|-l <f>\tWrite the per-stage latency histograms to <f> as csv on SIGUSR1 and on exit,\n"
+         "\t\t\tSIGUSR1 prints them on stdout without it\n");
+  printf("  --pipeline|-p\t\tRun capture, encode and send on separate threads\n");
+  printf("  --ring-slots|-r <n>\tFrame slots between capture and encoder (default: %zu)\n",
+         capturePipeline::config().frame_slots);
+  printf("  --drop-policy|-d <p>\t'oldest' skips stale frames, 'block' stalls capture (default: oldest)\n");
+  printf("  --latency-budget|-L <ms>\tAdapt bitrate, then frame rate and size, to keep the viewer queuing\n"
+         "\t\t\tdelay under <ms> (default: off, x264 constant quality)\n");
+  printf("  --bitrate|-B <min>:<max>\tBitrate range of the adaptation in kbit/s (default: %d:%d)\n",
+         rateController::config().min_kbps, rateController::config().max_kbps);
+  printf("  --rate-log|-G <f>\tWrite every adaptation decision to <f> as csv\n");
+  printf("  --udp|-u\t\tAlso serve viewers over UDP on port %d, with NACK retransmission\n", PORT_AV);
+  printf("  --fec|-e <n>\t\tSend an XOR parity datagram every <n> UDP datagrams (default: 0, none)\n");
+  printf("  --msg-zerocopy|-Z <bytes>\tSend TCP payloads of at least <bytes> with MSG_ZEROCOPY, %d is a good\n"
+         "\t\t\tstart; pays off on a real NIC, loopback copies anyway (default: 0, off)\n",
+         ZEROCOPY_MIN_BYTES);
+  printf("  --io-uring|-U\t\tWrite to the TCP viewers through io_uring, one submission per packet for all of them\n");
 }
 
 void my_log_callback(void *ptr, int level, const char *fmt, va_list vargs) {
   av_log_default_callback(ptr, 0, fmt, vargs);
 }
 /**
- * Initializes the NvFBC library and creates an NvFBC instance.
- *
- * Creates an NvFBC instance, then creates a worker thread to capture frames.
- */
-int main(int argc, char *argv[]) {
-  static struct option longopts[] = {{"frames", required_argument, NULL, 'f'}, {NULL, 0, NULL, 0}};
-
-  int opt, res;
+ * @brief Create a capture source for the backend selected with --backend
+ * @return NULL if the backend name is unknown */
+static captureSource *new_source() {
+  if (strcmp(backend, "nvfbc") == 0) return new captureNvFBC();
+  if (strcmp(backend, "x11") == 0) return new captureX11();
+  if (strcmp(backend, "synthetic") == 0) return new captureSynthetic(scenario, syntheticFps, syntheticPool);
+  return NULL;
+}
 
-  boost::thread     th_AV;
-  boost::thread     th_XDO;
-  videoThreadParams th_params;
+/**
+ * @brief Parse --outputs
+ * @param[in] list comma separated output indices or "all"
+ * @param[out] outputs requested indices, "all" gives only 0 and is completed once the first source is up
+ * @param[out] all true if every output was requested
+ * @return false if an index is invalid or repeated */
+static bool parse_outputs(const char *list, std::vector<int> &outputs, bool &all) {
+  all = strcmp(list, "all") == 0;
+  if (all) {
+    outputs = {0};
+    return true;
+  }
 
-  NVFBCSTATUS fbcStatus;
+  std::stringstream stream(list);
+  std::string       item;
+  outputs.clear();
+  while (std::getline(stream, item, ',')) {
+    char *end;
+    long  output = strtol(item.c_str(), &end, 10);
+    if (item.empty() || *end != '\0' || output < 0 || output >= MAX_OUTPUTS) return false;
+    if (std::find(outputs.begin(), outputs.end(), (int)output) != outputs.end()) return false;
+    outputs.push_back((int)output);
+  }
+  return !outputs.empty();
+}
 
-  NVFBC_CREATE_HANDLE_PARAMS           createHandleParams;
-  NVFBC_GET_STATUS_PARAMS              statusParams;
-  NVFBC_CREATE_CAPTURE_SESSION_PARAMS  createCaptureParams;
-  NVFBC_DESTROY_CAPTURE_SESSION_PARAMS destroyCaptureParams;
-  NVFBC_DESTROY_HANDLE_PARAMS          destroyHandleParams;
-  NVFBC_TOSYS_SETUP_PARAMS             setupParams;
-  NVFBC_RELEASE_CONTEXT_PARAMS         releaseParams;
-  NVFBC_BIND_CONTEXT_PARAMS            bindParams;
+/**
+ * Initializes the capture sources and the encoders.
+ *
+ * Sets up the selected capture backend on every requested output, then
+ * creates one worker thread per output to capture frames.
+ */
+int main(int argc, char *argv[]) {
+  static struct option longopts[] = {{"frames", required_argument, NULL, 'f'},
+                                     {"backend", required_argument, NULL, 'b'},
+                                     {"outputs", required_argument, NULL, 'O'},
+                                     {"size", required_argument, NULL, 'g'},
+                                     {"pixel-format", required_argument, NULL, 'P'},
+                                     {"scenario", required_argument, NULL, 'x'},
+                                     {"rate", required_argument, NULL, 'R'},
+                                     {"pool", required_argument, NULL, 'o'},
+                                     {"cursor", required_argument, NULL, 'C'},
+                                     {"zero-copy", no_argument, NULL, 'z'},
+                                     {"stats", no_argument, NULL, 's'},
+                                     {"idle", no_argument, NULL, 'i'},
+                                     {"keep-alive", required_argument, NULL, 'k'},
+                                     {"schedule", required_argument, NULL, 'S'},
+                                     {"max-fps", required_argument, NULL, 'F'},
+                                     {"min-interval", required_argument, NULL, 'm'},
+                                     {"latency-out", required_argument, NULL, 'l'},
+                                     {"pipeline", no_argument, NULL, 'p'},
+                                     {"ring-slots", required_argument, NULL, 'r'},
+                                     {"drop-policy", required_argument, NULL, 'd'},
+                                     {"latency-budget", required_argument, NULL, 'L'},
+                                     {"bitrate", required_argument, NULL, 'B'},
+                                     {"rate-log", required_argument, NULL, 'G'},
+                                     {"udp", no_argument, NULL, 'u'},
+                                     {"fec", required_argument, NULL, 'e'},
+                                     {"msg-zerocopy", required_argument, NULL, 'Z'},
+                                     {"io-uring", no_argument, NULL, 'U'},
+                                     {"help", no_argument, NULL, 'h'},
+                                     {NULL, 0, NULL, 0}};
+
+  int opt;
+
+  boost::thread_group th_AV;
+  boost::thread       th_XDO;
+
+  std::vector<captureSource *> sources;
+  std::vector<int>             outputs;
+  bool                         allOutputs;
+  captureConfig                captureCfg;
 
   av_log_set_level(AV_LOG_INFO);
   // av_log_set_callback(my_log_callback);
@@ -198,8 +681,144 @@ int main(int argc, char *argv[]) {
   /*
    * Parse the command line.
    */
-  while ((opt = getopt_long(argc, argv, "hf:", longopts, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "hf:b:O:g:P:x:R:o:C:zsik:S:F:m:l:pr:d:L:B:G:ue:Z:U", longopts, NULL)) != -1) {
     switch (opt) {
+      case 'f':
+        nFrames = atoi(optarg);
+        break;
+      case 'b':
+        backend = optarg;
+        break;
+      case 'O':
+        outputList = optarg;
+        break;
+      case 'g':
+        if (strcmp(optarg, "1080p") == 0) {
+          captureCfg.width  = 1920;
+          captureCfg.height = 1080;
+        } else if (strcmp(optarg, "1440p") == 0) {
+          captureCfg.width  = 2560;
+          captureCfg.height = 1440;
+        } else if (strcmp(optarg, "4k") == 0) {
+          captureCfg.width  = 3840;
+          captureCfg.height = 2160;
+        } else if (strcmp(optarg, "native") == 0) {
+          captureCfg.width  = 0;
+          captureCfg.height = 0;
+        } else if (sscanf(optarg, "%dx%d", &captureCfg.width, &captureCfg.height) != 2) {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'P':
+        captureCfg.format = av_get_pix_fmt(optarg);
+        if (captureCfg.format != AV_PIX_FMT_YUV444P && captureCfg.format != AV_PIX_FMT_NV12) {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'x':
+        if (!captureSynthetic::parse_scenario(optarg, scenario)) {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'R':
+        syntheticFps = atoi(optarg);
+        break;
+      case 'o':
+        syntheticPool = atoi(optarg);
+        break;
+      case 'C':
+        if (strcmp(optarg, "remote") == 0) {
+          remoteCursor = true;
+        } else if (strcmp(optarg, "embedded") == 0) {
+          remoteCursor = false;
+        } else {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'z':
+        zeroCopy = true;
+        break;
+      case 's':
+        printStats = true;
+        break;
+      case 'i':
+        idleAware = true;
+        break;
+      case 'k':
+        keepAlive = atoi(optarg) > 0 ? atoi(optarg) : KEEP_ALIVE_MS;
+        break;
+      case 'S':
+        if (strcmp(optarg, "push") == 0) {
+          schedule = SCHEDULE_PUSH;
+        } else if (strcmp(optarg, "poll") == 0) {
+          schedule = SCHEDULE_POLL;
+        } else {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'F':
+        maxFps = atoi(optarg);
+        break;
+      case 'm':
+        minIntervalMs = atoi(optarg);
+        break;
+      case 'l':
+        latencyOut = optarg;
+        break;
+      case 'p':
+        pipelined = true;
+        break;
+      case 'r':
+        pipelineConfig.frame_slots = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        break;
+      case 'd':
+        if (strcmp(optarg, "block") == 0) {
+          pipelineConfig.policy = ringPolicy::BLOCK;
+        } else if (strcmp(optarg, "oldest") == 0) {
+          pipelineConfig.policy = ringPolicy::DROP_OLDEST;
+        } else {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'L':
+        rateConfig.budget_ms = atoi(optarg);
+        break;
+      case 'B':
+        if (sscanf(optarg, "%d:%d", &rateConfig.min_kbps, &rateConfig.max_kbps) != 2 || rateConfig.min_kbps <= 0 ||
+            rateConfig.max_kbps < rateConfig.min_kbps) {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'G':
+        rateLog = optarg;
+        break;
+      case 'u':
+        udpTransport = true;
+        break;
+      case 'e':
+        fecGroup = atoi(optarg);
+        if (fecGroup < 0) {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'Z':
+        msgZerocopy = atoi(optarg);
+        if (msgZerocopy < 0) {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'U':
+        ioUring = true;
+        break;
       case 'h':
       default:
         usage(argv[0]);
@@ -207,227 +826,113 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  NvFBCUtilsPrintVersions(APP_VERSION);
-
-  /*
-   * Dynamically load the NvFBC library.
-   */
-  libNVFBC = dlopen(LIB_NVFBC_NAME, RTLD_NOW);
-  if (libNVFBC == NULL) {
-    fprintf(stderr, "Unable to open '%s'\n", LIB_NVFBC_NAME);
-    return EXIT_FAILURE;
-  }
-
-  /*
-   * Resolve the 'NvFBCCreateInstance' symbol that will allow us to get
-   * the API function pointers.
-   */
-  NvFBCCreateInstance_ptr = (PNVFBCCREATEINSTANCE)dlsym(libNVFBC, "NvFBCCreateInstance");
-  if (NvFBCCreateInstance_ptr == NULL) {
-    fprintf(stderr, "Unable to resolve symbol 'NvFBCCreateInstance'\n");
-    return EXIT_FAILURE;
+  if (pipelined && zeroCopy) {
+    fprintf(stderr, "--zero-copy is ignored with --pipeline, the capture buffer is reused by the next grab\n");
+    zeroCopy = false;
   }
 
-  /*
-   * Create an NvFBC instance.
-   *
-   * API function pointers are accessible through pFn.
-   */
-  memset(&pFn, 0, sizeof(pFn));
-
-  pFn.dwVersion = NVFBC_VERSION;
-
-  fbcStatus = NvFBCCreateInstance_ptr(&pFn);
-  if (fbcStatus != NVFBC_SUCCESS) {
-    fprintf(stderr, "Unable to create NvFBC instance (status: %d)\n", fbcStatus);
+  if (!parse_outputs(outputList, outputs, allOutputs)) {
+    usage(argv[0]);
     return EXIT_FAILURE;
   }
 
-  /*
-   * Create a session handle that is used to identify the client.
-   */
-  memset(&createHandleParams, 0, sizeof(createHandleParams));
-
-  createHandleParams.dwVersion = NVFBC_CREATE_HANDLE_PARAMS_VER;
-
-  fbcStatus = pFn.nvFBCCreateHandle(&fbcHandle, &createHandleParams);
-  if (fbcStatus != NVFBC_SUCCESS) {
-    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
-    return 1;
-  }
-
-  /*
-   * Get information about the state of the display driver.
-   *
-   * This call is optional but helps the application decide what it should
-   * do.
-   */
-  memset(&statusParams, 0, sizeof(statusParams));
-
-  statusParams.dwVersion = NVFBC_GET_STATUS_PARAMS_VER;
-
-  fbcStatus = pFn.nvFBCGetStatus(fbcHandle, &statusParams);
-  if (fbcStatus != NVFBC_SUCCESS) {
-    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
-    return 1;
-  }
-
-  if (statusParams.bCanCreateNow == NVFBC_FALSE) {
-    fprintf(stderr,
-            "It is not possible to create a capture session "
-            "on this system.\n");
-    return 1;
-  }
-
-  auto display = [statusParams](std::ostream &os) {
-    os << "Name of connected display\n";
-    for (int i = 0; i < statusParams.dwOutputNum; i++) {
-      os << "Display: " << statusParams.outputs[i].name << "    \tid: " << i << std::endl;
+  if (rateLog) {
+    rateConfig.log = fopen(rateLog, "w");
+    if (rateConfig.log == NULL) {
+      fprintf(stderr, "Could not open %s\n", rateLog);
+      return EXIT_FAILURE;
     }
-  };
-  display(std::cout);
-
-  memset(&createCaptureParams, 0, sizeof(createCaptureParams));
-
-  createCaptureParams.dwVersion        = NVFBC_CREATE_CAPTURE_SESSION_PARAMS_VER;
-  createCaptureParams.eCaptureType     = NVFBC_CAPTURE_TO_SYS;
-  createCaptureParams.bWithCursor      = NVFBC_TRUE;
-  createCaptureParams.frameSize.w      = VSIZEW;
-  createCaptureParams.frameSize.h      = VSIZEH;
-  createCaptureParams.eTrackingType    = NVFBC_TRACKING_OUTPUT;
-  createCaptureParams.dwOutputId       = statusParams.outputs[1].dwId;
-  createCaptureParams.dwSamplingRateMs = 16;
-
-  fbcStatus = pFn.nvFBCCreateCaptureSession(fbcHandle, &createCaptureParams);
-  if (fbcStatus != NVFBC_SUCCESS) {
-    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
-    return 1;
+    // One line per decision, flushed as they come so the log can be followed live
+    setvbuf(rateConfig.log, NULL, _IOLBF, 0);
+    rateController::log_header(rateConfig.log);
   }
 
-  /*
-   * Set up the capture session.
-   *
-   * The ppBuffer structure member will be allocated of the proper size by
-   * the NvFBC library.
-   */
-  memset(&setupParams, 0, sizeof(setupParams));
-
-  setupParams.dwVersion     = NVFBC_TOSYS_SETUP_PARAMS_VER;
-  setupParams.eBufferFormat = NVFBC_BUFFER_FORMAT_YUV444P;
-  setupParams.ppBuffer      = (void **)&frame;
-  setupParams.bWithDiffMap  = NVFBC_FALSE;
-
-  fbcStatus = pFn.nvFBCToSysSetUp(fbcHandle, &setupParams);
-  if (fbcStatus != NVFBC_SUCCESS) {
-    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
-    return 1;
+  // Read by the server constructor, on the first capture thread
+  if (udpTransport) tcpServerAV::enable_udp(PORT_AV, fecGroup);
+  tcpServerAV::enable_zerocopy(msgZerocopy);
+  if (ioUring) tcpServerAV::enable_uring();
+
+  // Before any thread exists, they all inherit the blocked SIGUSR1
+  latencyRegistry::instance().dump_on_signal(latencyOut);
+
+  if (strcmp(backend, "nvfbc") == 0) NvFBCUtilsPrintVersions(APP_VERSION);
+
+  // A remote cursor is left out of the frames, moving it alone does not
+  // produce a new frame
+  captureCfg.with_cursor = !remoteCursor;
+  captureCfg.push_model  = schedule == SCHEDULE_PUSH;
+  captureCfg.sampling_ms = SAMPLING_RATE_MS;
+  if (idleAware) {
+    // The buffer is only refreshed when the frame changed, a static desktop
+    // times out after the keep-alive period
+    captureCfg.force_refresh = false;
+    captureCfg.timeout_ms    = keepAlive;
   }
 
-  /*
-   * The main thread is about to hand work over the worker thread,
-   * release the FBC context.
-   */
-  memset(&releaseParams, 0, sizeof(releaseParams));
-
-  releaseParams.dwVersion = NVFBC_RELEASE_CONTEXT_PARAMS_VER;
+  // One capture session per output, "all" is expanded once the first
+  // session tells how many outputs are connected
+  for (size_t i = 0; i < outputs.size(); i++) {
+    captureSource *source = new_source();
+    if (source == NULL) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    sources.push_back(source);
 
-  fbcStatus = pFn.nvFBCReleaseContext(fbcHandle, &releaseParams);
-  if (fbcStatus != NVFBC_SUCCESS) {
-    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
-    return 1;
+    captureCfg.output = outputs[i];
+    if (!source->init(captureCfg)) {
+      for (captureSource *s : sources) delete s;
+      return EXIT_FAILURE;
+    }
+    if (allOutputs && i == 0)
+      for (int o = 1; o < std::min(source->output_count(), MAX_OUTPUTS); o++) outputs.push_back(o);
   }
 
-  // Init ffmpeg packet that is the encoded version of a frame
-  th_params.pkt = av_packet_alloc();
-
-  // Init ffmpeg av codec context
-  auto codec    = avcodec_find_encoder(AV_CODEC_ID_H264);
-  th_params.ctx = avcodec_alloc_context3(codec);
-
-  // Set context param
-  th_params.ctx->width     = VSIZEW;
-  th_params.ctx->height    = VSIZEH;
-  th_params.ctx->time_base = (AVRational){1, 15};
-  th_params.ctx->framerate = (AVRational){15, 1};
-  th_params.ctx->pix_fmt   = AV_PIX_FMT_YUV444P;
-
-  // Set specific context params
-  if (codec->id == AV_CODEC_ID_H264) {
-    av_opt_set(th_params.ctx->priv_data, "preset", "ultrafast", 0);
-    av_opt_set(th_params.ctx->priv_data, "tune", "zerolatency", 0);
+  if (remoteCursor) {
+    std::vector<cursorServer::area> areas;
+    for (size_t i = 0; i < outputs.size(); i++) {
+      cursorServer::area a;
+      a.stream = outputs[i];
+      if (sources[i]->screen_area(a.x, a.y, a.width, a.height)) areas.push_back(a);
+    }
+    cursor = new cursorServer(areas, CURSOR_PERIOD_MS);
+    if (!cursor->start()) {
+      for (captureSource *s : sources) delete s;
+      return EXIT_FAILURE;
+    }
   }
 
-  // Open the ffmpeg context
-  res = avcodec_open2(th_params.ctx, codec, NULL);
-  if (res < 0) {
-    fprintf(stderr, "Could not open codec: %d\n", (res));
-    exit(1);
-  }
+  // Spread the cores between the encoders, x264 slices each frame across its
+  // threads and the downscale stage uses as many slices
+  encoderThreads = std::max<int>(1, boost::thread::hardware_concurrency() / outputs.size());
 
-  // Allocate frame for passing single frame from FBC to encoder
-  th_params.frame         = av_frame_alloc();
-  th_params.frame->width  = VSIZEW;
-  th_params.frame->height = VSIZEH;
-  th_params.frame->format = AV_PIX_FMT_YUV444P;
-  th_params.frame->pts    = 0;
+  // The encoders are opened by the capture threads once the captured and
+  // requested sizes are known
+  std::vector<videoThreadParams> th_params(outputs.size());
+  for (size_t i = 0; i < outputs.size(); i++) th_params[i].stream = outputs[i];
 
-  res = av_frame_get_buffer(th_params.frame, 0);
-  if (res < 0) {
-    fprintf(stderr, "Could not allocate the video frame data\n");
-    exit(1);
+  for (size_t i = 0; i < outputs.size(); i++) {
+    videoThreadParams *params = &th_params[i];
+    captureSource     *source = sources[i];
+    th_AV.create_thread([params, source]() { th_entry_point(params, source); });
   }
 
-  printf("Size %d x %d\n", th_params.frame->width, th_params.frame->height);
-
-  boost::thread *th_swap = new boost::thread(th_entry_point, &th_params);
-  th_AV.swap(*th_swap);
-  delete th_swap;
-
-  th_swap = new boost::thread(th_xdo_server);
+  boost::thread *th_swap = new boost::thread(th_xdo_server);
   th_XDO.swap(*th_swap);
   delete th_swap;
 
   th_XDO.join();
-  th_AV.join();
-
-  /*
-   * The main thread takes back the FBC context.
-   */
-  memset(&bindParams, 0, sizeof(bindParams));
-
-  bindParams.dwVersion = NVFBC_BIND_CONTEXT_PARAMS_VER;
+  th_AV.join_all();
 
-  fbcStatus = pFn.nvFBCBindContext(fbcHandle, &bindParams);
-  if (fbcStatus != NVFBC_SUCCESS) {
-    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
-    return 1;
-  }
-
-  /*
-   * Destroy capture session, tear down resources.
-   */
-  memset(&destroyCaptureParams, 0, sizeof(destroyCaptureParams));
-
-  destroyCaptureParams.dwVersion = NVFBC_DESTROY_CAPTURE_SESSION_PARAMS_VER;
-
-  fbcStatus = pFn.nvFBCDestroyCaptureSession(fbcHandle, &destroyCaptureParams);
-  if (fbcStatus != NVFBC_SUCCESS) {
-    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
-    return 1;
-  }
+  latencyRegistry::instance().print(stdout);
+  if (latencyOut) latencyRegistry::instance().dump(latencyOut);
 
   /*
-   * Destroy session handle, tear down more resources.
+   * The main thread takes back the capture sources and tears them down.
    */
-  memset(&destroyHandleParams, 0, sizeof(destroyHandleParams));
-
-  destroyHandleParams.dwVersion = NVFBC_DESTROY_HANDLE_PARAMS_VER;
-
-  fbcStatus = pFn.nvFBCDestroyHandle(fbcHandle, &destroyHandleParams);
-  if (fbcStatus != NVFBC_SUCCESS) {
-    fprintf(stderr, "%s\n", pFn.nvFBCGetLastErrorStr(fbcHandle));
-    return 1;
-  }
+  for (captureSource *source : sources) delete source;
+  delete cursor;
+  if (rateConfig.log) fclose(rateConfig.log);
 
   return EXIT_SUCCESS;
 }